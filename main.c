@@ -3,6 +3,7 @@
  * cpldcpu Oct 26, 2023
  * 
  * Audio output on PC3 (inverter) and Pc4 (non-inverted) using complementary PWM outputs
+ * With USE_STEREO_PWM: left on PC4/PC3 (TIM1 CH1/CH1N), right on PC7/PD2 (TIM1 CH2/CH2N)
  *
  * Based on CH32fun PWM example 03-28-2023 E. Brombaugh
  * Modified to use DMA for PWM value loading - inspired from https://github.com/BogdanTheGeek/ch32fun-audio/blob/main/main.c
@@ -20,29 +21,148 @@
 #define pwm_shift        8             // PWM shift for 8-bit output
 #define OSR              8             // Oversampling ratio for delta-sigma
 
+// Mix at a lower rate to save CPU time: SAMPLE_RATE 14700 with OSR 12, or 11025
+// with OSR 16, keep the PWM rate. USE_DSM_INTERPOLATION ramps across the duty
+// values of each sample instead of holding it (make -C tools mixrate compares
+// the SNR and the IRQ load)
+#define USE_DSM_INTERPOLATION 0
+
+// Stereo output on a second compare channel (TIM1 CH2), panned like the desktop
+// output. Doubles the PWM buffer to 2kb, so it only fits on CH32V006. The
+// left and right duty values are interleaved for a DMA burst to both compare
+// registers, or with PWM_RIGHT_BUFFER set to BUF_SAMPLES * OSR, kept in two
+// buffers, one DMA channel per compare register
+#define USE_STEREO_PWM   0
+#define PWM_RIGHT_BUFFER 0
+
+// Audio configuration
+#define SAMPLE_RATE      22050         // MOD playback sample rate
+#define BUF_SAMPLES      ((1024 / OSR) & ~1)  // Audio samples (not PWM samples), 128 at OSR 8
+
+// No hardware divider: look up the sample step of each period in a table built for SAMPLE_RATE
+#define USE_PERIOD_TABLE 1
+#define PERIOD_TABLE_RATE SAMPLE_RATE
+
+// Decode each row on the ticks before it, so that the IRQ which crosses into
+// a new row only applies it (~110 bytes of RAM per player)
+#define USE_ROW_PREDECODE 1
+
+// Mix all channels on every sample and wrap loops in bounded time, so that the
+// IRQ takes about as long on every block (needs USE_ROW_PREDECODE)
+#define USE_CONSTANT_TIME 0
+
+// Play a song from an external SPI flash (25-series, read command 03h) instead
+// of the songs built into the firmware, for songs larger than the internal
+// flash. The song has to be written to the SPI flash at SPIFLASH_SONG.
+// Wiring: PC1 chip select, PC5 SCK, PC6 MOSI, PC7 MISO
+#define USE_STORAGE 0
+#define SPIFLASH_SONG    0
+#define SPIFLASH_SIZE    (1024 * 1024) // Bytes from SPIFLASH_SONG on that the song may take
+
+#if USE_STORAGE && USE_STEREO_PWM
+#error "The right PWM channel (PC7) is the MISO pin of the SPI flash"
+#endif
+
+// Embedded MOD files (songs[] table, see MOD_FILES in the Makefile). Songs
+// packed with make SAMPLE_BANK=1 come with their sample bank, songs.h then
+// sets USE_SAMPLE_BANK
+#include "songs.h"
 
 #include "modplay.c"
 // Move criticial functions to sram to speed up processing. takes ~2kb sram
-ModPlayerStatus_t *RenderMOD(volatile uint8_t *buf, int len) __attribute__((section(".srodata"))) __attribute__((used));
-ModPlayerStatus_t *ProcessMOD() __attribute__((section(".srodata"))) __attribute__((used));
-void _RecalculateWaveform(Oscillator_t *oscillator) __attribute__((section(".srodata"))) __attribute__((used));
+ModPlayerStatus_t *RenderMOD(ModPlayerStatus_t *mp, volatile uint8_t *buf, int len) __attribute__((section(".srodata"))) __attribute__((used));
+ModPlayerStatus_t *ProcessMOD(ModPlayerStatus_t *mp) __attribute__((section(".srodata"))) __attribute__((used));
+void _RecalculateWaveform(ModPlayerStatus_t *mp, Oscillator_t *oscillator) __attribute__((section(".srodata"))) __attribute__((used));
+#if EVENT_QUEUE_SIZE
+void _PushEvent(ModPlayerStatus_t *mp, int type, int channel, int value) __attribute__((section(".srodata"))) __attribute__((used));
+#endif
 
 
-// Audio configuration
-#define SAMPLE_RATE      22050         // MOD playback sample rate
-#define BUF_SAMPLES      128           // Audio samples (not PWM samples)
+// Playlist: crossfade time between songs, 0 = gapless switch when a song ends.
+// Crossfading needs a second player instance in RAM (CH32V006 only).
+#define CROSSFADE_MS     0
+
+
+#define NUM_SONGS        ((int)(sizeof(songs) / sizeof(songs[0])))
+
+#if USE_STORAGE
+/*
+ * Reads from the SPI flash, polled: the render IRQ waits for the data
+ */
+static uint8_t spiflash_xfer(uint8_t out)
+{
+	while (!(SPI1->STATR & SPI_STATR_TXE));
+	SPI1->DATAR = out;
+	while (!(SPI1->STATR & SPI_STATR_RXNE));
+	return SPI1->DATAR;
+}
 
+static int spiflash_read(const ModStorage_t *st, uint32_t offset, void *buf, uint32_t len)
+{
+	uint32_t addr = (uintptr_t) st->user + offset;
+	uint8_t *p = buf;
+
+	GPIOC->BCR = 1 << 1;                   // Select the flash
+	spiflash_xfer(0x03);                   // Read data
+	spiflash_xfer(addr >> 16);
+	spiflash_xfer(addr >> 8);
+	spiflash_xfer(addr);
+
+	while (len--) *p++ = spiflash_xfer(0);
+
+	GPIOC->BSHR = 1 << 1;
+	return 1;
+}
 
-// Include embedded MOD file
-#include "test_mod.h"
+static const ModStorage_t g_spiflash = { spiflash_read, (void *) SPIFLASH_SONG };
+
+/*
+ * SPI1 as master at 24 MHz, mode 0, chip select driven by software
+ */
+static void spiflash_init(void)
+{
+	RCC->APB2PCENR |= RCC_APB2Periph_GPIOC | RCC_APB2Periph_SPI1;
+
+	GPIOC->BSHR = 1 << 1;
+	GPIOC->CFGLR &= ~((0xf<<(4*1)) | (0xf<<(4*5)) | (0xf<<(4*6)) | (0xf<<(4*7)));
+	GPIOC->CFGLR |= (GPIO_Speed_50MHz | GPIO_CNF_OUT_PP)<<(4*1) |
+	                (GPIO_Speed_50MHz | GPIO_CNF_OUT_PP_AF)<<(4*5) |
+	                (GPIO_Speed_50MHz | GPIO_CNF_OUT_PP_AF)<<(4*6) |
+	                (GPIO_CNF_IN_FLOATING)<<(4*7);
+
+	// Prescaler 2 (BR = 0)
+	SPI1->CTLR1 = SPI_CTLR1_MSTR | SPI_CTLR1_SSM | SPI_CTLR1_SSI;
+	SPI1->CTLR1 |= SPI_CTLR1_SPE;
+}
 
+#define SONG_DATA(i)     (&g_spiflash)
+#define SONG_SIZE(i)     SPIFLASH_SIZE
+#define SONG_GAIN(i)     0x10000
+#else
+#define SONG_DATA(i)     (songs[i].data)
+#define SONG_SIZE(i)     (songs[i].len)
+#define SONG_GAIN(i)     (songs[i].gain)   // Found on the host, see SONG_GAIN in the Makefile
+#endif
 
-// Ring buffer for CH1 PWM compare values (0..255)
-static volatile uint8_t  g_rb_ch1[BUF_SAMPLES * OSR];  // 8-bit PWM buffer with oversampling
+
+// Duty values per PWM period in the buffer of DMA1 channel 5, 2 when it
+// writes both compare registers in a burst
+#define PWM_VALUES       ((USE_STEREO_PWM && !PWM_RIGHT_BUFFER) ? 2 : 1)
+
+// Ring buffer for CH1 PWM compare values (0..255), with the CH2 values of
+// stereo output interleaved or in the second half
+static volatile uint8_t  g_rb_ch1[BUF_SAMPLES * OSR * (USE_STEREO_PWM ? 2 : 1)];  // 8-bit PWM buffer with oversampling
 static volatile size_t   g_buffer_offset = 0;  // Tracks which half of buffer DMA just finished
+static uint32_t          g_buffer_phase;       // Buffer index of an output sample minus its samplepos, mod BUF_SAMPLES
+
+// MOD player instances, the render IRQ plays the one `mod_player` points to
+static ModPlayerStatus_t g_players[CROSSFADE_MS ? 2 : 1];
+static ModPlayerStatus_t * volatile mod_player = NULL;
+static int g_song = 0;
 
-// MOD player pointer
-static ModPlayerStatus_t *mod_player = NULL;
+#if CROSSFADE_MS
+static uint32_t g_song_end;            // samplepos at which the current song loops back
+#endif
 
 // Profiling statistics
 typedef struct {
@@ -53,6 +173,7 @@ typedef struct {
 } ProfileStats_t;
 
 static volatile ProfileStats_t g_profile_stats = {0, 0, UINT32_MAX, 0};
+static volatile uint32_t g_fade_max_cycles = 0;  // IRQ maximum while a crossfade runs
 
 /*
  * DMA1 Channel 5 interrupt handler
@@ -67,6 +188,7 @@ void DMA1_Channel5_IRQHandler(void)
 {
 	// Start profiling - capture SysTick counter (counts up)
 	uint32_t start_cycles = SysTick->CNT;
+	int fading = mod_player && mod_player->fadefrom;
 
 	volatile uint32_t intfr = DMA1->INTFR;
 
@@ -92,7 +214,7 @@ void DMA1_Channel5_IRQHandler(void)
 
 		// Render MOD audio samples with delta-sigma modulation
 		if (mod_player) {
-			RenderMOD(&g_rb_ch1[offset * OSR], BUF_SAMPLES/2);
+			RenderMOD(mod_player, &g_rb_ch1[offset * OSR * PWM_VALUES], BUF_SAMPLES/2);
 		}
 
 		// Re-check interrupt flags in case new interrupt occurred during handling
@@ -120,6 +242,95 @@ void DMA1_Channel5_IRQHandler(void)
 	if (elapsed > g_profile_stats.max_cycles) {
 		g_profile_stats.max_cycles = elapsed;
 	}
+	if (fading && elapsed > g_fade_max_cycles) {
+		g_fade_max_cycles = elapsed;
+	}
+}
+
+/*
+ * Output sample currently read by the DMA, in the same units as
+ * ModPlayerStatus_t.samplepos and ModEvent_t.timestamp
+ */
+static uint32_t audio_play_position(void)
+{
+	ModPlayerStatus_t *mp = mod_player;
+	uint32_t rendered, remaining;
+
+	// Retry if the render IRQ ran in between the two reads, the atomic
+	// loads keep the compiler from merging them
+	do {
+		rendered = __atomic_load_n(&mp->samplepos, __ATOMIC_ACQUIRE);
+		remaining = DMA1_Channel5->CNTR;
+	} while (rendered != __atomic_load_n(&mp->samplepos, __ATOMIC_ACQUIRE));
+
+	// The buffer is always ahead of the DMA, by between half and a full buffer.
+	// The next sample to render goes to index (rendered + g_buffer_phase) mod
+	// BUF_SAMPLES; kept below BUF_SAMPLES, which need not be a power of two
+	uint32_t readidx = (BUF_SAMPLES * OSR * PWM_VALUES - remaining) / (OSR * PWM_VALUES);
+	uint32_t ahead = (rendered % BUF_SAMPLES + g_buffer_phase + BUF_SAMPLES - readidx) % BUF_SAMPLES;
+	if (ahead == 0) ahead = BUF_SAMPLES;
+
+	return rendered - ahead;
+}
+
+/*
+ * Advance the playlist: queue the next song for a gapless switch at the end
+ * of the current one, or crossfade to it on the spare player instance
+ */
+static void playlist_update(void)
+{
+	// A song from the SPI flash is played on its own
+	if (NUM_SONGS < 2 || USE_STORAGE) return;
+
+	int next = (g_song + 1) % NUM_SONGS;
+	ModPlayerStatus_t *cur = mod_player;
+
+#if CROSSFADE_MS
+	const uint32_t fade = SAMPLE_RATE * CROSSFADE_MS / 1000;
+
+	// Start the fade so that it is over where the current song loops back,
+	// wherever that is in the order list. Not while a fade is still running
+	if (__atomic_load_n(&cur->fadefrom, __ATOMIC_ACQUIRE)) return;
+	if ((int32_t)(__atomic_load_n(&cur->samplepos, __ATOMIC_ACQUIRE) - (g_song_end - fade)) < 0) return;
+
+	ModPlayerStatus_t *spare = (cur == &g_players[0]) ? &g_players[1] : &g_players[0];
+
+	// The spare instance is free again, use it to measure the next song first
+	uint32_t length = LengthMOD(spare, SONG_DATA(next), SONG_SIZE(next), SAMPLE_RATE);
+
+	if (!length || !InitMOD(spare, SONG_DATA(next), SONG_SIZE(next), SAMPLE_RATE)) {
+		g_song = next;  // Not a valid MOD, try the one after it next time
+		return;
+	}
+
+	SetGainMOD(spare, SONG_GAIN(next));
+
+	// Play every song on its own for at least the fade time, so that a very
+	// short song does not start the next fade as soon as its own is over
+	if (length < 2 * fade) length = 2 * fade;
+
+#if EVENT_QUEUE_SIZE
+	SetEventMaskMOD(spare, cur->eventmask);
+#endif
+
+	// Swap instances between two render calls
+	NVIC_DisableIRQ(DMA1_Channel5_IRQn);
+	CrossfadeMOD(spare, cur, fade);
+	mod_player = spare;
+	g_song_end = spare->samplepos + length;
+	NVIC_EnableIRQ(DMA1_Channel5_IRQn);
+
+	g_song = next;
+#else
+	// Wait until a previously queued song has started
+	if (cur->nextmod) return;
+
+	// The queued song has started, the switch in the IRQ set its gain
+	if (cur->mod == SONG_DATA(next)) g_song = next;
+
+	next = (g_song + 1) % NUM_SONGS;
+	QueueMOD(cur, SONG_DATA(next), SONG_SIZE(next), MOD_SWITCH_END, SONG_GAIN(next));
+#endif
 }
 
 /*
@@ -156,7 +367,7 @@ void t1pwm_init( void )
 	TIM1->PSC = 0;  // 48MHz PWM clock
 
 	// Auto Reload - determines PWM resolution
-	TIM1->ATRLR = 255;  // 8-bit PWM, effective sample rate = 22.05 kHz * 8 (OSR)
+	TIM1->ATRLR = 255;  // 8-bit PWM, effective sample rate = SAMPLE_RATE * OSR
 
 	// Set Center aligned PWM on Timer 1 - reduces harmonics
 	TIM1->CTLR1 &= ~TIM1_CTLR1_CMS;
@@ -177,14 +388,34 @@ void t1pwm_init( void )
 	// Set the Capture Compare Register value to 50% initially
 	TIM1->CH1CVR = 128;
 
+#if USE_STEREO_PWM
+	// Right channel: CH2 on PC7 and CH2N on PD2, set up like CH1
+	RCC->APB2PCENR |= RCC_APB2Periph_GPIOD;
+	GPIOC->OUTDR &= ~(1<<7);
+	GPIOD->OUTDR &= ~(1<<2);
+	GPIOC->CFGLR &= ~(0xf<<(4*7));
+	GPIOD->CFGLR &= ~(0xf<<(4*2));
+
+	TIM1->CCER |= TIM1_CCER_CC2NE | TIM1_CCER_CC2NP | TIM1_CCER_CC2E | TIM1_CCER_CC2P;
+	TIM1->CHCTLR1 |= TIM1_CHCTLR1_OC2M_2 | TIM1_CHCTLR1_OC2M_1;
+	TIM1->CH2CVR = 128;
+#endif
+
 	// Enable TIM1 outputs
 	TIM1->BDTR |= TIM1_BDTR_MOE;
 
 	// --- Configure DMA1 Channel 5 for TIM1 CH1 (triggered by TIM1 Update) ---
 	DMA1_Channel5->CFGR  = 0;
+#if PWM_VALUES == 2
+	// Interleaved stereo: every update request starts a burst of two transfers
+	// through DMAADR, to CH1CVR and CH2CVR (DBA = register 13, DBL = 2 transfers)
+	TIM1->DMACFGR = (1 << 8) | 13;
+	DMA1_Channel5->PADDR = (uint32_t)&TIM1->DMAADR;  // Peripheral: TIM1 DMA burst register
+#else
 	DMA1_Channel5->PADDR = (uint32_t)&TIM1->CH1CVR;  // Peripheral: TIM1 CH1 compare register
+#endif
 	DMA1_Channel5->MADDR = (uint32_t)g_rb_ch1;       // Memory: CH1 ring buffer
-	DMA1_Channel5->CNTR  = BUF_SAMPLES * OSR;        // Number of transfers (with oversampling)
+	DMA1_Channel5->CNTR  = BUF_SAMPLES * OSR * PWM_VALUES;  // Number of transfers (with oversampling)
 	DMA1_Channel5->CFGR  = DMA_CFGR1_DIR |           // Memory to peripheral
 						   // No MSIZE flags = 8-bit memory transfer
 					       DMA_CFGR1_PSIZE_1 |       // 32-bit peripheral
@@ -193,6 +424,21 @@ void t1pwm_init( void )
 	                       DMA_CFGR1_MINC |          // Memory increment
 	                       DMA_CFGR1_HTIE |          // Half-transfer interrupt enable
 	                       DMA_CFGR1_TCIE;           // Transfer complete interrupt enable
+
+#if USE_STEREO_PWM && PWM_RIGHT_BUFFER
+	// --- Configure DMA1 Channel 3 for TIM1 CH2 from the second buffer ---
+	// CCDS makes the CH2 DMA request on the update event as well, so both
+	// channels load their compare registers for the same PWM period. The
+	// render IRQ stays on channel 5, which runs in step with this one
+	TIM1->CTLR2 |= TIM_CCDS;
+
+	DMA1_Channel3->CFGR  = 0;
+	DMA1_Channel3->PADDR = (uint32_t)&TIM1->CH2CVR;
+	DMA1_Channel3->MADDR = (uint32_t)g_rb_ch1 + PWM_RIGHT_BUFFER;
+	DMA1_Channel3->CNTR  = BUF_SAMPLES * OSR;
+	DMA1_Channel3->CFGR  = DMA_CFGR1_DIR | DMA_CFGR1_PSIZE_1 | DMA_CFGR1_CIRC |
+	                       DMA_CFGR1_PL | DMA_CFGR1_MINC;
+#endif
 }
 
 /*
@@ -209,6 +455,11 @@ void pwm_audio_start(void)
 	// Enable CH1 DMA channel
 	DMA1_Channel5->CFGR |= DMA_CFGR1_EN;  // CH1 DMA (triggered by Update)
 
+#if USE_STEREO_PWM && PWM_RIGHT_BUFFER
+	TIM1->DMAINTENR |= TIM_CC2DE;
+	DMA1_Channel3->CFGR |= DMA_CFGR1_EN;  // CH2 DMA (triggered by Update through CCDS)
+#endif
+
 	// Start the timer - this begins the DMA transfers
 	TIM1->CTLR1 |= TIM1_CTLR1_CEN;
 
@@ -220,6 +471,11 @@ void pwm_audio_start(void)
 	// PC4 is T1CH1, 10MHz Output alt func, push-pull
 	GPIOC->CFGLR |= (GPIO_Speed_10MHz | GPIO_CNF_OUT_PP_AF)<<(4*4);
 
+#if USE_STEREO_PWM
+	// PC7 is T1CH2, PD2 is T1CH2N
+	GPIOC->CFGLR |= (GPIO_Speed_10MHz | GPIO_CNF_OUT_PP_AF)<<(4*7);
+	GPIOD->CFGLR |= (GPIO_Speed_10MHz | GPIO_CNF_OUT_PP_AF)<<(4*2);
+#endif
 }
 
 /*
@@ -229,10 +485,18 @@ void pwm_audio_stop(void)
 {
 	GPIOC->CFGLR &= ~(0xf<<(4*3));
 	GPIOC->CFGLR &= ~(0xf<<(4*4));
+#if USE_STEREO_PWM
+	GPIOC->CFGLR &= ~(0xf<<(4*7));
+	GPIOD->CFGLR &= ~(0xf<<(4*2));
+#endif
 
 	TIM1->CTLR1 &= ~TIM1_CTLR1_CEN;
 	TIM1->DMAINTENR &= ~TIM1_DMAINTENR_UDE;
 	DMA1_Channel5->CFGR &= ~DMA_CFGR1_EN;
+#if USE_STEREO_PWM && PWM_RIGHT_BUFFER
+	TIM1->DMAINTENR &= ~TIM_CC2DE;
+	DMA1_Channel3->CFGR &= ~DMA_CFGR1_EN;
+#endif
 	NVIC_DisableIRQ(DMA1_Channel5_IRQn);
 }
 
@@ -247,33 +511,103 @@ int main()
 
 	t1pwm_init();
 
+#if USE_STORAGE
+	spiflash_init();
+#endif
+
 	printf("Sample rate: %d Hz\n\r", SAMPLE_RATE);
 
-	mod_player = InitMOD(test_mod, SAMPLE_RATE);
+#if USE_SAMPLE_BANK
+	// The packed songs take their samples from the bank
+	SetSampleBankMOD((const int8_t *) sample_bank, sizeof(sample_bank));
+#endif
+
+#if CROSSFADE_MS
+	// Length of the first song, measured on the spare instance
+	g_song_end = LengthMOD(&g_players[1], SONG_DATA(0), SONG_SIZE(0), SAMPLE_RATE);
+#endif
+
+	mod_player = InitMOD(&g_players[0], SONG_DATA(0), SONG_SIZE(0), SAMPLE_RATE);
+
+#if EVENT_QUEUE_SIZE
+	// Only sync effects are of interest here, rows are reported by the status print.
+	// Set before the first render, so that no other events are queued
+	SetEventMaskMOD(mod_player, (1 << MOD_EVENT_SYNC) | (1 << MOD_EVENT_SYNC_E8));
+#endif
+
+#if USE_STORAGE
+	if (!mod_player) {
+		printf("No MOD file in the SPI flash at %u\n\r", SPIFLASH_SONG);
+		while(1);
+	}
+
+	printf("MOD file in SPI flash at %u\n\r", SPIFLASH_SONG);
+#else
+	printf("MOD file loaded: %u bytes (%d songs)\n\r", songs[0].len, NUM_SONGS);
+#if USE_SAMPLE_BANK
+	printf("Sample bank: %u bytes\n\r", (unsigned) sizeof(sample_bank));
+#endif
+#endif
+	SetGainMOD(mod_player, SONG_GAIN(0));
 
-	printf("MOD file loaded: %u bytes\n\r", test_mod_len);
 	printf("Channels: %d, Orders: %d, Patterns: %d\n\r",
 	       mod_player->channels, mod_player->orders, mod_player->maxpattern);
 
-	// Fill entire buffer initially
-	RenderMOD(g_rb_ch1, BUF_SAMPLES);
+	// Start the DMA and timer on a buffer of silence (duty value 128, what
+	// RenderMOD() outputs for a silent mix), without waiting for a render.
+	// The second half is rendered while the DMA plays the first one, the
+	// render IRQ takes over from there. It leaves the buffer alone until
+	// mod_player is set, in case this render takes longer than half a buffer.
+	// To resume a song, RestoreMOD() a snapshot saved with SaveMOD() here
+	ModPlayerStatus_t *mp = mod_player;
 
-	// Reset counters
+	mod_player = NULL;
+	memset((uint8_t *) g_rb_ch1, 128, sizeof(g_rb_ch1));
 	g_buffer_offset = 0;
 
-	// NOW start the DMA and timer
+	// The first rendered sample goes to the middle of the buffer, so the
+	// silent half plays the BUF_SAMPLES/2 samples before it. samplepos is not
+	// block aligned after a RestoreMOD()
+	g_buffer_phase = (BUF_SAMPLES / 2 + BUF_SAMPLES - mp->samplepos % BUF_SAMPLES) % BUF_SAMPLES;
+
 	pwm_audio_start();
 
+	RenderMOD(mp, &g_rb_ch1[(BUF_SAMPLES / 2) * OSR * PWM_VALUES], BUF_SAMPLES / 2);
+	mod_player = mp;
+
 	printf("MOD playback active!\n\r");
 
+#if EVENT_QUEUE_SIZE
+	ModEvent_t ev;
+	int ev_pending = 0;
+#endif
+	int loops = 0;
+
 	while(1)
 	{
-		Delay_Ms(2000);
+		Delay_Ms(1);
+
+		playlist_update();
+
+#if EVENT_QUEUE_SIZE
+		// Act on sync events once they reach the speaker
+		if (!ev_pending) ev_pending = PollEventMOD(mod_player, &ev);
+		if (ev_pending && (int32_t)(ev.timestamp - audio_play_position()) <= 0) {
+			if (ev.type == MOD_EVENT_SYNC || ev.type == MOD_EVENT_SYNC_E8) {
+				printf("Sync %02x on channel %d at order %d, row %d\n\r",
+				       ev.value, ev.channel, ev.order + 1, ev.row);
+			}
+			ev_pending = 0;
+		}
+#endif
+
+		if (++loops < 2000) continue;
+		loops = 0;
 
 		// Print MOD playback status
 		if (mod_player) {
-			printf("Order: %d/%d, Row: %d/64, Tick: %d/%d\n\r",
-			       mod_player->order + 1, mod_player->orders,
+			printf("Song: %d/%d, Order: %d/%d, Row: %d/64, Tick: %d/%d\n\r",
+			       g_song + 1, NUM_SONGS, mod_player->order + 1, mod_player->orders,
 			       mod_player->row, mod_player->tick, mod_player->maxtick);
 		}
 
@@ -295,6 +629,12 @@ int main()
 			printf("IRQ: avg=%lu us, min=%lu us, max=%lu us, rate=%lu Hz, CPU=%lu%%\n\r",
 			       avg_us, min_us, max_us, int_rate_hz, cpu_percent);
 
+			// Peak IRQ time of all crossfades so far
+			if (g_fade_max_cycles) {
+				printf("IRQ max during crossfade: %lu us\n\r",
+				       (g_fade_max_cycles * 1000) / (FUNCONF_SYSTEM_CORE_CLOCK / 1000));
+			}
+
 			// Reset statistics for next interval
 			g_profile_stats.count = 0;
 			g_profile_stats.total_cycles = 0;
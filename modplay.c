@@ -9,7 +9,7 @@ char testbuffer[512];
 
 #define assert(cond, ...) if(!(cond)) { \
 		snprintf(testbuffer, 512, __VA_ARGS__); \
-		_assert(cond, #cond, &mp, __LINE__); \
+		_assert(cond, #cond, mp, __LINE__); \
 	}
 
 void _assert(int cond, const char *condstr, const ModPlayerStatus_t *mp, int line) {
@@ -30,16 +30,123 @@ void _assert(int cond, const char *condstr, const ModPlayerStatus_t *mp, int lin
 #define USE_LINEAR_INTERPOLATION 1
 #endif
 
+#if USE_STORAGE && USE_LINEAR_INTERPOLATION
+#error "USE_STORAGE needs USE_LINEAR_INTERPOLATION=0, see InitMOD() in modplay.h"
+#endif
+
+#if USE_STORAGE && SAMPLE_CACHE_SIZE
+#error "SAMPLE_CACHE_SIZE has no effect with USE_STORAGE, short loops stay in the stream windows"
+#endif
+
+#if USE_STORAGE && USE_SAMPLE_BANK
+#error "USE_SAMPLE_BANK needs the sample bank in memory, it cannot be combined with USE_STORAGE"
+#endif
+
+#if USE_STORAGE && (STREAM_WINDOW < 2 || STREAM_WINDOW > 32767 || (STORAGE_BLOCK_SIZE & (STORAGE_BLOCK_SIZE - 1)))
+#error "STREAM_WINDOW must be 2 to 32767, STORAGE_BLOCK_SIZE a power of two"
+#endif
+
 // Set to 1 for mono output (saves memory bandwidth and code size)
 // Can also be controlled via -DUSE_MONO_OUTPUT=1 compile flag
 #ifndef USE_MONO_OUTPUT
 #define USE_MONO_OUTPUT 0
 #endif
 
-ModPlayerStatus_t mp;
+// Oversampling ratio of the delta-sigma PWM output (mono output only)
+// Can also be controlled via -DOSR=4 compile flag
+#ifndef OSR
+#define OSR 8
+#endif
+
+#if USE_STEREO_PWM && !USE_MONO_OUTPUT
+#error "USE_STEREO_PWM selects the stereo PWM output, it needs USE_MONO_OUTPUT=1"
+#endif
+
+#if USE_DSM_INTERPOLATION && !USE_MONO_OUTPUT
+#error "USE_DSM_INTERPOLATION applies to the PWM output, it needs USE_MONO_OUTPUT=1"
+#endif
+
+// Set to 1 to keep the cost of every render block close to the same, for
+// interrupt handlers that must not jitter: the mixer works through all channel
+// slots on every sample, silent ones included, and steps a loop back at most
+// once per sample (WrapChannelOnceMOD() in modplay.h). The row decoding is
+// spread over the ticks before the row by USE_ROW_PREDECODE
+// Can also be controlled via -DUSE_CONSTANT_TIME=1 compile flag
+#ifndef USE_CONSTANT_TIME
+#define USE_CONSTANT_TIME 0
+#endif
+
+#if USE_CONSTANT_TIME && !USE_ROW_PREDECODE
+#error "USE_CONSTANT_TIME needs USE_ROW_PREDECODE=1, which spreads the row decoding over the ticks"
+#endif
+
+#if USE_CONSTANT_TIME && USE_STORAGE
+#error "USE_CONSTANT_TIME cannot bound the storage reads of USE_STORAGE"
+#endif
+
+// Stereo PWM output (USE_STEREO_PWM): 0 interleaves the left and right duty
+// values, otherwise the right values go to a second buffer this many bytes
+// after the left one, see RenderMOD() in modplay.h
+#ifndef PWM_RIGHT_BUFFER
+#define PWM_RIGHT_BUFFER 0
+#endif
+
+// Bytes from one duty value of a PWM channel to its next
+#define PWM_STEP ((USE_STEREO_PWM && !PWM_RIGHT_BUFFER) ? 2 : 1)
+
+// Set to 1 to render the stereo output in blocks per channel (desktop builds, stereo
+// output only): each channel runs without end/loop checks up to its next wrap, see
+// _MixChannelBlock(). The pan/pack stage uses SSE2 where available
+// Can also be controlled via -DUSE_BLOCK_MIXER=0 compile flag
+#ifndef USE_BLOCK_MIXER
+#define USE_BLOCK_MIXER (!USE_MONO_OUTPUT && !USE_CONSTANT_TIME)
+#endif
+
+#if USE_BLOCK_MIXER && USE_CONSTANT_TIME
+#error "USE_CONSTANT_TIME mixes sample by sample, it needs USE_BLOCK_MIXER=0"
+#endif
+
+#if USE_BLOCK_MIXER
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define MIX_BLOCK 64  // Maximum samples rendered per channel in one go
+#endif
+
+// Set to 1 to convert periods to sample steps with a table instead of a division
+// per channel and tick (for CPUs without a hardware divider). The table is built
+// at compile time for PERIOD_TABLE_RATE, other sample rates and SetPitchMOD()
+// scales fall back to the division. Steps are interpolated between every 4th
+// period, which is within 1 cent of the exact value
+// Can also be controlled via -DUSE_PERIOD_TABLE=1 compile flag
+#ifndef USE_PERIOD_TABLE
+#define USE_PERIOD_TABLE 0
+#endif
+
+#if USE_PERIOD_TABLE
+#ifndef PERIOD_TABLE_RATE
+#define PERIOD_TABLE_RATE 22050
+#endif
+
+#define PERIOD_TABLE_MIN  80   // Covers B-3 at finetune +7 with a deep vibrato
+#define PERIOD_TABLE_SIZE 224  // One entry every 4 periods, up to period 972
+
+// _RecalculatePaulaRate() at PERIOD_TABLE_RATE without pitch scaling
+#define _PTR_REM (3546895 % PERIOD_TABLE_RATE)
+#define PERIOD_TABLE_PAULARATE ((uint32_t) ((3546895 / PERIOD_TABLE_RATE) << 16 | \
+	((_PTR_REM << 8) / PERIOD_TABLE_RATE) << 8 | \
+	((((_PTR_REM << 8) % PERIOD_TABLE_RATE) << 8) / PERIOD_TABLE_RATE)))
 
-// Delta-sigma residual accumulator for PWM output
-static uint32_t g_dsm_residual = 0;
+#define _PT1(i)  (PERIOD_TABLE_PAULARATE / (PERIOD_TABLE_MIN + 4 * (i)))
+#define _PT4(i)  _PT1(i), _PT1(i + 1), _PT1(i + 2), _PT1(i + 3)
+#define _PT16(i) _PT4(i), _PT4(i + 4), _PT4(i + 8), _PT4(i + 12)
+#define _PT32(i) _PT16(i), _PT16(i + 16)
+
+static const uint32_t period_table[PERIOD_TABLE_SIZE] = {
+	_PT32(0), _PT32(32), _PT32(64), _PT32(96), _PT32(128), _PT32(160), _PT32(192)
+};
+#endif
 
 static const int32_t finetune_table[16] = {
 	65536, 65065, 64596, 64132,
@@ -62,7 +169,87 @@ static const int32_t arpeggio_table[16] = {
 	32768, 30929, 29193, 27554
 };
 
-void _RecalculateWaveform(Oscillator_t *oscillator) {
+static inline uint32_t _PeriodToStep(const ModPlayerStatus_t *mp, int32_t period) {
+	// Sample step (16.16) for an Amiga period, paularate / period
+#if USE_PERIOD_TABLE
+	uint32_t i = period - PERIOD_TABLE_MIN;
+
+	if(mp->paularate == PERIOD_TABLE_PAULARATE && i < (PERIOD_TABLE_SIZE - 1) * 4) {
+		const uint32_t *t = &period_table[i >> 2];
+		int32_t d = t[1] - t[0];
+
+		// t[0] + d * (i & 3) / 4, without a multiplication
+		return t[0] + ((((i & 1) ? d : 0) + ((i & 2) ? d * 2 : 0)) >> 2);
+	}
+#endif
+
+	return mp->paularate / period;
+}
+
+void _RecalculateTempo(ModPlayerStatus_t *mp) {
+	// Samples per tick = samplerate * 2.5 / bpm / temposcale, kept as an exact
+	// fraction so that the tick rate does not drift for any BPM/samplerate.
+	// That is samplerate * 640 * 256 / (bpm * temposcale), the factor 256 is
+	// applied in 4 bit steps to keep the full 16.16 tempo scale without
+	// needing a 64-bit division (bpm * temposcale < 2^26)
+	uint32_t num = mp->samplerate * 5 * 128;
+	uint32_t den = mp->bpm * mp->temposcale;
+	uint32_t speed = num / den, rem = num % den;
+
+	for(int i = 0; i < 2; i++) {
+		speed = (speed << 4) | ((rem << 4) / den);
+		rem = (rem << 4) % den;
+	}
+
+	mp->audiospeed = speed;
+	mp->audiospeedrem = rem;
+	mp->audiospeedden = den;
+
+	if(mp->audiotickerr >= den) mp->audiotickerr = 0;
+}
+
+void _RecalculatePaulaRate(ModPlayerStatus_t *mp) {
+	// Amiga PAL clock / samplerate as 16.16 fixed point, computed in 8 bit
+	// steps to keep the fraction without needing a 64-bit division
+	uint32_t rate = mp->samplerate;
+	uint32_t rem = 3546895 % rate;
+	uint32_t base = (3546895 / rate) << 16;
+
+	base |= ((rem << 8) / rate) << 8;
+	rem = (rem << 8) % rate;
+	base |= (rem << 8) / rate;
+
+	mp->paularate = ((uint64_t) base * mp->pitchscale) >> 16;
+}
+
+#if EVENT_QUEUE_SIZE
+void _PushEvent(ModPlayerStatus_t *mp, int type, int channel, int value) {
+	if(!(mp->eventmask & (1 << type))) return;
+
+	uint8_t head = mp->eventhead;
+
+	if((uint8_t) (head - __atomic_load_n(&mp->eventtail, __ATOMIC_ACQUIRE)) >= EVENT_QUEUE_SIZE) {
+		mp->eventsdropped++;
+		return;
+	}
+
+	ModEvent_t *ev = &mp->events[head & (EVENT_QUEUE_SIZE - 1)];
+
+	ev->timestamp = mp->eventtime;
+	ev->type = type;
+	ev->channel = channel;
+	ev->order = mp->order;
+	ev->row = mp->row;
+	ev->value = value;
+
+	// Publish the event only after it has been completely written
+	__atomic_store_n(&mp->eventhead, head + 1, __ATOMIC_RELEASE);
+}
+#else
+#define _PushEvent(mp, type, channel, value)
+#endif
+
+void _RecalculateWaveform(ModPlayerStatus_t *mp, Oscillator_t *oscillator) {
 	int32_t result = 0;
 
 	// The following generators _might_ have been inspired by micromod's code:
@@ -87,594 +274,1698 @@ void _RecalculateWaveform(Oscillator_t *oscillator) {
 
 		case 3:
 			// Random
-			result = (mp.random >> 20) - 255;
-			mp.random = (mp.random * 65 + 17) & 0x1FFFFFFF;
+			result = (mp->random >> 20) - 255;
+			mp->random = (mp->random * 65 + 17) & 0x1FFFFFFF;
 			break;
 	}
 
 	oscillator->val = result * oscillator->depth;
 }
 
-ModPlayerStatus_t *ProcessMOD() {
-	if(mp.tick == 0) {
-		mp.skiporderrequest = -1;
+#if USE_STORAGE
+static void _ReadStorageMOD(ModPlayerStatus_t *mp, uint32_t offset, void *buf, uint32_t len) {
+	// Reads from the storage of the current song, failed reads give zeros
+	if(!mp->mod->read(mp->mod, offset, buf, len)) {
+		memset(buf, 0, len);
+		mp->readerrors++;
+	}
+}
 
-		for(int i = 0; i < 4; i++) {  // Hardcoded 4 channels
-			mp.ch[i].vibrato.val = mp.ch[i].tremolo.val = 0;
+static void _ReadMOD(ModPlayerStatus_t *mp, uint32_t offset, void *buf, uint32_t len) {
+	// Reads through the block cache
+	uint8_t *dst = buf;
 
-			const uint8_t *cell = mp.patterndata + 4 * (i + 4 * (mp.row + 64 * mp.ordertable[mp.order]));  // 4 channels
+	while(len) {
+		uint32_t block = offset / STORAGE_BLOCK_SIZE, start = offset % STORAGE_BLOCK_SIZE;
+		uint32_t n = (len < STORAGE_BLOCK_SIZE - start) ? len : STORAGE_BLOCK_SIZE - start;
+		int i = 0;
 
-			int note_tmp = ((cell[0] << 8) | cell[1]) & 0xFFF;
-			int sample_tmp = (cell[0] & 0xF0) | (cell[2] >> 4);
-			int eff_tmp = cell[2] & 0x0F;
-			int effval_tmp = cell[3];
+		while(i < STORAGE_BLOCKS && mp->blocktag[i] != block + 1) i++;
 
-			if(mp.ch[i].eff == 0 && mp.ch[i].effval != 0) {
-				mp.ch[i].period = mp.ch[i].note;
-			}
+		if(i < STORAGE_BLOCKS) {
+			mp->blockhits++;
+		} else {
+			// Replace the blocks in turn
+			i = mp->blocknext;
+			mp->blocknext = (i + 1) % STORAGE_BLOCKS;
+			mp->blocktag[i] = block + 1;
+			mp->blockmisses++;
 
-			if(sample_tmp) {
-				if(sample_tmp > 31) sample_tmp = 1;
+			_ReadStorageMOD(mp, block * STORAGE_BLOCK_SIZE, mp->blocks[i], STORAGE_BLOCK_SIZE);
+		}
 
-				mp.ch[i].sample = sample_tmp - 1;
-				
-				mp.ch[i].samplegen.length = mp.samples[sample_tmp - 1].actuallength << 1;
-				mp.ch[i].samplegen.looplength = mp.samples[sample_tmp - 1].looplength << 1;
-				mp.ch[i].volume = mp.sampleheaders[sample_tmp - 1].volume;
-				mp.ch[i].samplegen.sample = mp.samples[sample_tmp - 1].data;
-			}
+		memcpy(dst, mp->blocks[i] + start, n);
 
-			if(note_tmp) {
-				int finetune;
+		dst += n;
+		offset += n;
+		len -= n;
+	}
+}
+#endif
 
-				if(eff_tmp == 0xE && (effval_tmp & 0xF0) == 0x50)
-					finetune = effval_tmp & 0xF;
-				else
-					finetune = mp.sampleheaders[mp.ch[i].sample].finetune;
+static inline const SampleHeader_t *_HeaderMOD(ModPlayerStatus_t *mp, int n, SampleHeader_t *buf) {
+	// Header of sample `n`, read into `*buf` without the name in storage builds
+#if USE_STORAGE
+	_ReadMOD(mp, 20 + 30 * n + 22, &buf->lengthhi, 8);
+	return buf;
+#else
+	(void) buf;
+	return mp->sampleheaders + n;
+#endif
+}
 
-				note_tmp = note_tmp * finetune_table[finetune & 0xF] >> 16;
+static inline const uint8_t *_RowMOD(ModPlayerStatus_t *mp, int order, int row) {
+	// Pattern data of `row` at `order`, one cell of 4 bytes per channel
+	int pattern = mp->ordertable[order];
 
-				mp.ch[i].note = note_tmp;
+#if USE_STORAGE
+	uint32_t tag = 64 * pattern + row + 1;
 
-				if(eff_tmp != 0x3 && eff_tmp != 0x5 && (eff_tmp != 0xE || (effval_tmp & 0xF0) != 0xD0)) {
-					mp.ch[i].samplegen.age = mp.ch[i].samplegen.currentptr = 0;
-					mp.ch[i].period = mp.ch[i].note;
+	if(mp->rowtag != tag) {
+		_ReadMOD(mp, 1084 + 16 * (tag - 1), mp->rowbuf, 16);
+		mp->rowtag = tag;
+	}
 
-					if(mp.ch[i].vibrato.waveform < 4) mp.ch[i].vibrato.phase = 0;
-					if(mp.ch[i].tremolo.waveform < 4) mp.ch[i].tremolo.phase = 0;
-				}
-			}
+	return mp->rowbuf;
+#else
+	return mp->patterndata + 16 * (row + 64 * pattern);  // 4 channels
+#endif
+}
 
-			if(eff_tmp || effval_tmp) switch(eff_tmp) {
-				case 0x3:
-					if(effval_tmp) mp.ch[i].slideamount = effval_tmp;
+#if USE_SAMPLE_BANK
+// Sample data of the packed songs, see SetSampleBankMOD()
+static const int8_t *_bank;
+static uint32_t _banksize;
 
-				case 0x5:
-					mp.ch[i].slidenote = mp.ch[i].note;
-					break;
+static inline uint32_t _BankOffsetMOD(const SampleHeader_t *sh) {
+	// Offset of the data of a sample of a packed song in the bank
+	const uint8_t *p = (const uint8_t *) sh->name + 18;
 
-				case 0x4:
-					if(effval_tmp & 0xF0) mp.ch[i].vibrato.speed = effval_tmp >> 4;
-					if(effval_tmp & 0x0F) mp.ch[i].vibrato.depth = effval_tmp & 0x0F;
+	return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+#endif
 
-					// break intentionally left out here
-	
-				case 0x6:
-					_RecalculateWaveform(&mp.ch[i].vibrato);
-					break;
+static uint32_t _SampleStartMOD(ModPlayerStatus_t *mp, int n) {
+	// File offset of the data of sample `n`, which follows the patterns and
+	// the samples before it (its offset in the bank for a packed song)
+#if USE_STORAGE
+	return mp->sampledata[n];
+#else
+#if USE_SAMPLE_BANK
+	if(mp->banked)
+		return _BankOffsetMOD(mp->sampleheaders + n);
+#endif
 
-				case 0x7:
-					if(effval_tmp & 0xF0) mp.ch[i].tremolo.speed = effval_tmp >> 4;
-					if(effval_tmp & 0x0F) mp.ch[i].tremolo.depth = effval_tmp & 0x0F;
-					_RecalculateWaveform(&mp.ch[i].tremolo);
-					break;
+	uint32_t start = 1084 + 64 * 4 * 4 * mp->maxpattern;  // 4 channels hardcoded
 
-				case 0xC:
-					mp.ch[i].volume = (effval_tmp > 0x40) ? 0x40 : effval_tmp;
-					break;
+	for(const SampleHeader_t *sh = mp->sampleheaders; sh < mp->sampleheaders + n; sh++)
+		start += ((sh->lengthhi << 8) | sh->lengthlo) * 2;
 
-				case 0x9:
-					if(effval_tmp) {
-						mp.ch[i].samplegen.currentptr = effval_tmp << 8;
-						mp.ch[i].sampleoffset = effval_tmp;
-					} else {
-						mp.ch[i].samplegen.currentptr = mp.ch[i].sampleoffset << 8;
-					}
+	return start;
+#endif
+}
 
-					mp.ch[i].samplegen.age = 0;
-					break;
+static void _SampleLengthMOD(ModPlayerStatus_t *mp, int n, uint32_t *bytes, uint32_t *loopbytes) {
+	// Length and loop of sample `n` (0..30) in bytes, from its header
+	SampleHeader_t buf;
+	const SampleHeader_t *sample = _HeaderMOD(mp, n, &buf);
+
+	uint16_t length = (sample->lengthhi << 8) | sample->lengthlo;
+	uint16_t looppoint = (sample->looppointhi << 8) | sample->looppointlo;
+	uint16_t actuallength = ((sample->looplengthhi << 8) | sample->looplengthlo) + looppoint;
+	uint16_t looplength;
+
+	if(actuallength < 0x2) {
+		actuallength = length;
+		looplength = 0;
+	} else if(actuallength > length) {
+		looppoint /= 2;
+		actuallength -= looppoint;
+		looplength = actuallength - looppoint;
+	} else {
+		looplength = actuallength - looppoint;
+	}
 
-				case 0xB:
-					if(effval_tmp >= mp.orders) effval_tmp = 0;
+	// A damaged header can wrap the 16-bit sums above, drop a loop that
+	// does not fit in the sample
+	if(looplength > actuallength)
+		looplength = 0;
 
-					mp.skiporderrequest = effval_tmp;
-					break;
+	if(mp->truncated & (1u << n)) {
+		// Cut the sample to the end of the file, and its loop with it
+		uint32_t start = _SampleStartMOD(mp, n), end = mp->size;
+#if USE_SAMPLE_BANK
+		if(mp->banked) end = _banksize;
+#endif
+		uint32_t words = (start < end) ? (end - start) / 2 : 0;
 
-				case 0xD:
-					if(mp.skiporderrequest < 0) {
-						if(mp.order + 1 < mp.orders)
-							mp.skiporderrequest = mp.order + 1;
-						else
-							mp.skiporderrequest = 0;
-					}
+		if(actuallength > words) {
+			uint32_t loopstart = actuallength - looplength;
 
-					if(effval_tmp > 0x63) effval_tmp = 0;
+			looplength = (loopstart < words) ? words - loopstart : 0;
+			actuallength = words;
+		}
+	}
 
-					mp.skiporderdestrow = (effval_tmp >> 4) * 10 + (effval_tmp & 0xF); // What were the ProTracker guys smoking?!
-					break;
+	*bytes = actuallength << 1;
+	*loopbytes = looplength << 1;
+}
 
-				case 0xE:
-					switch(effval_tmp >> 4) {
-						case 0x1:
-							mp.ch[i].period -= effval_tmp & 0xF;
-							break;
 
-						case 0x2:
-							mp.ch[i].period += effval_tmp & 0xF;
-							break;
-						
-						case 0x4:
-							mp.ch[i].vibrato.waveform = effval_tmp & 0x7;
-							break;
+static inline const int8_t *_SampleDataMOD(ModPlayerStatus_t *mp, int n) {
+	// Data of sample `n` in the MOD file (unused with USE_STORAGE)
+#if USE_STORAGE
+	(void) mp; (void) n;
+	return NULL;
+#else
+#if USE_SAMPLE_BANK
+	if(mp->banked)
+		return _bank + _SampleStartMOD(mp, n);
+#endif
 
-						case 0x6:
-							if(effval_tmp & 0xF) {
-								if(!mp.patloopcycle)
-									mp.patloopcycle = (effval_tmp & 0xF) + 1;
+	return (const int8_t *) mp->mod + _SampleStartMOD(mp, n);
+#endif
+}
 
-								if(mp.patloopcycle > 1) {
-									mp.skiporderrequest = mp.order;
-									mp.skiporderdestrow = mp.patlooprow;
-								}
+static inline void _RelocateMOD(ModPlayerStatus_t *mp, PaulaChannel_t *pch, int n, const int8_t *data) {
+	// Points the sampler at sample `n`, whose data is at `data`
+#if USE_STORAGE
+	// Read into the window by _StreamMOD() before the channel is mixed
+	(void) data;
+	pch->offset = mp->sampledata[n];
+	pch->sample = mp->window[pch - mp->paula];
+#else
+	(void) mp; (void) n;
+	pch->sample = data;
+#if SAMPLE_CACHE_SIZE
+	pch->data = data;
+#endif
+#endif
+}
 
-								mp.patloopcycle--;
-							} else {
-								mp.patlooprow = mp.row;
-							}
+void _SetSampleMOD(ModPlayerStatus_t *mp, PaulaChannel_t *pch, int n, int relocate) {
+	// Sets up the sampler for sample `n` (0..30) from its header. With
+	// `relocate`, also finds its data
+	if(relocate)
+		_RelocateMOD(mp, pch, n, _SampleDataMOD(mp, n));
 
-						case 0x7:
-							mp.ch[i].tremolo.waveform = effval_tmp & 0x7;
-							break;
+	_SampleLengthMOD(mp, n, &pch->length, &pch->looplength);
+}
 
-						case 0xA:
-							mp.ch[i].volume += effval_tmp & 0xF;
-							if(mp.ch[i].volume > 0x40) mp.ch[i].volume = 0x40;
-							break;
+#if SAMPLE_CACHE_SIZE
+void _FillCacheMOD(ModPlayerStatus_t *mp) {
+	// Counts how often each sample is triggered in the song, then copies the
+	// loops of the looping samples to the cache, most often triggered first
+	uint16_t triggers[31] = {0};
+	uint8_t used[256] = {0};
 
-						case 0xB:
-							mp.ch[i].volume -= effval_tmp & 0xF;
-							if(mp.ch[i].volume < 0x00) mp.ch[i].volume = 0x00;
-							break;
+	for(int i = 0; i < mp->orders; i++) used[mp->ordertable[i]] = 1;
 
-						case 0xE:
-							mp.maxtick *= ((effval_tmp & 0xF) + 1);
-							break;
-					}
-					break;
+	for(int pat = 0; pat < mp->maxpattern; pat++) {
+		if(!used[pat]) continue;
 
-				case 0xF:
-					if(effval_tmp) {
-						if(effval_tmp < 0x20) {
-							mp.maxtick = (mp.maxtick / mp.speed) * effval_tmp;
-							mp.speed = effval_tmp;
-						} else {
-							mp.audiospeed = mp.samplerate * 125 / effval_tmp / 50;
-						}
-					}
+		const uint8_t *cell = mp->patterndata + 1024 * pat;  // 4 channels * 64 rows * 4 bytes
 
-					break;
-			}
+		for(int i = 0; i < 64 * 4; i++, cell += 4) {
+			int sample = (cell[0] & 0xF0) | (cell[2] >> 4);
 
-			mp.ch[i].eff = eff_tmp;
-			mp.ch[i].effval = effval_tmp;
+			if(sample && sample <= 31 && triggers[sample - 1] < UINT16_MAX) triggers[sample - 1]++;
 		}
 	}
 
-	for(int i = 0; i < 4; i++) {  // Hardcoded 4 channels
-		int eff_tmp = mp.ch[i].eff;
-		int effval_tmp = mp.ch[i].effval;
-
-		if(eff_tmp || effval_tmp) switch(eff_tmp) {
-			case 0x0:
-				switch(mp.tick % 3) {
-					case 0:
-						mp.ch[i].period = mp.ch[i].note;
-						break;
-
-					case 1:
-						mp.ch[i].period = (mp.ch[i].note * arpeggio_table[effval_tmp >> 4]) >> 16;
-						break;
-
-					case 2:
-						mp.ch[i].period = (mp.ch[i].note * arpeggio_table[effval_tmp & 0xF]) >> 16;
-						break;
-				}
-				break;
+	int free = SAMPLE_CACHE_SIZE;
 
-			case 0x1:
-				if(mp.tick) mp.ch[i].period -= effval_tmp;
-				break;
+	for(int i = 0; i < 31; i++) mp->cacheoffset[i] = -1;
 
-			case 0x2:
-				if(mp.tick) mp.ch[i].period += effval_tmp;
-				break;
+	for(;;) {
+		PaulaChannel_t pch;
+		int best = -1;
 
-			case 0x5:
-				if(mp.tick) {
-					if(effval_tmp > 0xF) {
-						mp.ch[i].volume += (effval_tmp >> 4);
-						if(mp.ch[i].volume > 0x40) mp.ch[i].volume = 0x40;
-					} else {
-						mp.ch[i].volume -= (effval_tmp & 0xF);
-						if(mp.ch[i].volume < 0x00) mp.ch[i].volume = 0x00;
-					}
-				}
-				
-				effval_tmp = 0;
-				// break intentionally left out here
+		// Most triggered looping sample whose loop still fits
+		for(int i = 0; i < 31; i++) {
+			if(!triggers[i] || (best >= 0 && triggers[i] <= triggers[best])) continue;
 
-			case 0x3:
-				if(mp.tick) {
-					if(!effval_tmp) effval_tmp = mp.ch[i].slideamount;
+			_SetSampleMOD(mp, &pch, i, 0);
 
-					if(mp.ch[i].slidenote > mp.ch[i].period) {
-						mp.ch[i].period += effval_tmp;
+			if(pch.looplength && (int) pch.looplength <= free) best = i;
+			else triggers[i] = 0;
+		}
 
-						if(mp.ch[i].slidenote < mp.ch[i].period)
-							mp.ch[i].period = mp.ch[i].slidenote;
-					} else if(mp.ch[i].slidenote < mp.ch[i].period) {
-						mp.ch[i].period -= effval_tmp;
+		if(best < 0) break;
 
-						if(mp.ch[i].slidenote > mp.ch[i].period)
-							mp.ch[i].period = mp.ch[i].slidenote;
-					} 
-				}
+		_SetSampleMOD(mp, &pch, best, 1);
 
-				break;
+		int offset = SAMPLE_CACHE_SIZE - free;
 
-			case 0x4:
-				if(mp.tick) {
-					mp.ch[i].vibrato.phase += mp.ch[i].vibrato.speed;
-					_RecalculateWaveform(&mp.ch[i].vibrato);
-				}
-				break;
+		memcpy(mp->samplecache + offset, pch.sample + pch.length - pch.looplength, pch.looplength);
+		mp->cacheoffset[best] = offset;
+		free -= pch.looplength;
+		triggers[best] = 0;
+	}
+}
+#endif
 
-			case 0x6:
-				if(mp.tick) {
-					mp.ch[i].vibrato.phase += mp.ch[i].vibrato.speed;
-					_RecalculateWaveform(&mp.ch[i].vibrato);
-				}
-				// break intentionally left out here
+int _LoadMOD(ModPlayerStatus_t *mp, const ModFile_t *mod, uint32_t size) {
+	// Hardcoded for 4-channel ProTracker MODs only
+	// Verify signature (M.K. or M!K!), the order count and that the file
+	// holds every pattern of the order table, before the current song is
+	// given up
+	int orders, maxpattern = 0;
 
-			case 0xA:
-				if(mp.tick) {
-					if(effval_tmp > 0xF) {
-						mp.ch[i].volume += (effval_tmp >> 4);
-						if(mp.ch[i].volume > 0x40) mp.ch[i].volume = 0x40;
-					} else {
-						mp.ch[i].volume -= (effval_tmp & 0xF);
-						if(mp.ch[i].volume < 0x00) mp.ch[i].volume = 0x00;
-					}
-				}
+	if(size < 1084)
+		return 0;
 
-				break;
+#if USE_STORAGE
+	uint8_t sig[4], buf[16];
 
-			case 0x7:
-				if(mp.tick) {
-					mp.ch[i].tremolo.phase += mp.ch[i].tremolo.speed;
-					_RecalculateWaveform(&mp.ch[i].tremolo);
-				}
-				break;
+	if(!mod->read(mod, 1080, sig, 4) || !mod->read(mod, 950, buf, 1))
+		return 0;
 
-			case 0xE:
-				switch(effval_tmp >> 4) {
-					case 0x9:
-						if(mp.tick && !(mp.tick % (effval_tmp & 0xF)))
-							mp.ch[i].samplegen.age = mp.ch[i].samplegen.currentptr = mp.ch[i].samplegen.currentsubptr = 0;
-						break;
+	orders = buf[0];
 
-					case 0xC:
-						if(mp.tick >= (effval_tmp & 0xF)) mp.ch[i].volume = 0;
-						break;
+	for(int i = 0; i < 128; i += 16) {
+		if(!mod->read(mod, 952 + i, buf, 16))
+			return 0;
 
-					case 0xD:
-						if(mp.tick == (effval_tmp & 0xF)) {
-							mp.ch[i].samplegen.age = mp.ch[i].samplegen.currentptr = mp.ch[i].samplegen.currentsubptr = 0;
-							mp.ch[i].period = mp.ch[i].note;
-						}
-						break;
-				}
+		for(int j = 0; j < 16; j++)
+			if(buf[j] > maxpattern) maxpattern = buf[j];
+	}
+#else
+	const uint8_t *sig = mod + 1080;
 
-				break;
-		}
+	orders = mod[950];
 
-		if(mp.ch[i].period < 0 && mp.ch[i].period != 0) {
-			mp.ch[i].period = 0;
-		}
+	for(int i = 0; i < 128; i++)
+		if(mod[952 + i] > maxpattern) maxpattern = mod[952 + i];
+#endif
 
-		// Pre-calculate sampler period & volume
+	uint32_t signature = sig[3] | (sig[2] << 8) | (sig[1] << 16) | (sig[0] << 24);
+#if USE_SAMPLE_BANK
+	int banked = signature == MOD_BANK_SIGNATURE && _bank;
+#else
+	const int banked = 0;
+#endif
+	if(signature != 0x4D2E4B2E && signature != 0x4D214B21 && !banked) {
+		return 0;  // Only accept 4-channel ProTracker MODs
+	}
 
-		if(mp.ch[i].period)
-			mp.ch[i].samplegen.period = mp.paularate / (mp.ch[i].period + (mp.ch[i].vibrato.val >> 7));
-		else
-			mp.ch[i].samplegen.period = 0;
-		
-		int32_t vol = mp.ch[i].volume + (mp.ch[i].tremolo.val >> 6);
+	if(orders == 0 || 1084 + 1024 * (uint32_t) (maxpattern + 1) > size) {
+		return 0;  // 4 channels * 64 rows * 4 bytes per pattern
+	}
 
-		if(vol < 0) vol = 0;
-		if(vol > 64) vol = 64;
+	// Reset the song position, everything else (output rate, speed control,
+	// events) carries over so that songs can be switched while playing
+	mp->order = mp->row = mp->tick = mp->loops = 0;
+	mp->skiporderrequest = mp->skiporderdestrow = 0;
+	mp->patlooprow = mp->patloopcycle = 0;
 
-		mp.ch[i].samplegen.volume = vol;
-	}
+	memset(mp->ch, 0, sizeof(mp->ch));
+	memset(mp->paula, 0, sizeof(mp->paula));
 
-	mp.tick++;
-	if(mp.tick >= mp.maxtick) {
-		mp.tick = 0;
-		mp.maxtick = mp.speed;
+#if USE_ROW_PREDECODE
+	// Cells decoded from the previous song, or before a jump
+	mp->decoded = 0;
+#endif
 
-		if(mp.skiporderrequest >= 0) {
-			mp.row = mp.skiporderdestrow;
-			mp.order = mp.skiporderrequest;
+#if SAMPLE_CACHE_SIZE
+	// JumpMOD() reloads the same song, its samples are cached already
+	int refill = (mod != mp->mod);
+#endif
 
-			mp.skiporderdestrow = 0;
-			mp.skiporderrequest = -1;
-		} else {
-			mp.row++;
-			if(mp.row >= 0x40) {
-				mp.row = 0;
-				mp.order++;
+	mp->mod = mod;
+	mp->size = size;
+	mp->channels = 4;  // Hardcoded to 4 channels
+#if USE_SAMPLE_BANK
+	mp->banked = banked;
+#endif
 
-				if(mp.order >= mp.orders) mp.order = 0;
-			}
-		}
-	}
+#if USE_STORAGE
+	// Drop the blocks of the previous song, the windows were emptied above
+	// and are refilled before the next sample is mixed (also after JumpMOD())
+	memset(mp->blocktag, 0, sizeof(mp->blocktag));
+	mp->rowtag = 0;
+	mp->streamtick = 0;
 
-	return &mp;
-}
+	_ReadMOD(mp, 952, mp->orderbuf, 128);
 
-ModPlayerStatus_t *RenderMOD(volatile uint8_t *buf, int len) {
-#if USE_MONO_OUTPUT
-	const int32_t chmul = 32768;  // 131072 / 2 channels
+	mp->ordertable = mp->orderbuf;
 #else
-	memset(buf, 0, len * 4);  // Stereo: 2 channels * 2 bytes
-	const int32_t majorchmul = 65536;  // 131072 / 2
-	const int32_t minorchmul = 21845;  // 131072 / 6
+	mp->ordertable = mod + 952;
+	mp->patterndata = mod + 1084;
+	mp->sampleheaders = (SampleHeader_t *) (mod + 20);
 #endif
 
-	for(int s = 0; s < len; s++) {
-		// Process the tick, if necessary
+	mp->orders = (orders > 128) ? 128 : orders;
+	mp->maxpattern = maxpattern + 1;
 
-		if(mp.audiotick <= 0) {
-			ProcessMOD();
-			mp.audiotick = mp.audiospeed;
-		}
+	// Find the samples that run past the end of the file (of the bank for a
+	// packed song), _SetSampleMOD() cuts them from now on
+	uint32_t data = 1084 + 1024 * mp->maxpattern;  // 4 channels * 64 rows * 4 bytes
 
-		mp.audiotick--;
+	mp->truncated = 0;
 
-		// Render the audio
+	for(int i = 0; i < 31; i++) {
+		SampleHeader_t buf;
+		const SampleHeader_t *sh = _HeaderMOD(mp, i, &buf);
+		PaulaChannel_t pch;
 
-#if USE_MONO_OUTPUT
-		int32_t mono = 0;
-#else
-		int32_t l = 0, r = 0;
+#if USE_STORAGE
+		mp->sampledata[i] = data;
 #endif
+		_SetSampleMOD(mp, &pch, i, 0);
 
-		for(int ch = 0; ch < 4; ch++) {  // Hardcoded 4 channels
-			PaulaChannel_t *pch = &mp.ch[ch].samplegen;
+		if(!banked && data + pch.length > size) mp->truncated |= 1u << i;
+		data += ((sh->lengthhi << 8) | sh->lengthlo) * 2;
 
-			if(pch->sample) {
-				// If the single-shot sample has finished playing, skip this channel
+#if USE_SAMPLE_BANK
+		uint32_t start = _BankOffsetMOD(sh);
 
-				if((pch->looplength == 0) && (pch->currentptr >= pch->length))
-					continue;
+		if(banked && (start > _banksize || pch.length > _banksize - start)) mp->truncated |= 1u << i;
+#endif
+	}
+
+#if SAMPLE_CACHE_SIZE
+	if(refill) _FillCacheMOD(mp);
+#endif
+
+	mp->maxtick = mp->speed = 6; mp->bpm = 125;
+	_RecalculateTempo(mp);
+
+	for(int i = 0; i < 4; i++) {  // Hardcoded 4 channels
+		mp->paula[i].age = INT32_MAX;
+	}
+
+#if EVENT_QUEUE_SIZE
+	mp->eventorder = -1;
+#endif
+
+	return 1;
+}
+
+static inline void _EnterLoopMOD(PaulaChannel_t *pch) {
+	// A sample offset (9xx) or a switch to a shorter sample can leave the
+	// position far past the end of a loop, only on the row that applies it.
+	// Bring it into the loop where the mixer's wrap would take it, so that
+	// the wrap only has to undo the steps of the mixer itself. That is one
+	// step back per output sample, or a few when the sample step is longer
+	// than the loop (extreme.mod). Positions stay below 2^18 (samples of up
+	// to 128 kB, offsets up to 0xFF00), so the remainder takes a fixed 18
+	// shift-and-subtract steps instead of a division, which is a libgcc
+	// call on RV32EC that takes a data-dependent time
+	if(!pch->looplength || pch->currentptr < pch->length) return;
+
+	uint32_t over = pch->currentptr - pch->length;
+
+	for(int b = 17; b >= 0; b--)
+		if((over >> b) >= pch->looplength) over -= pch->looplength << b;
+
+	pch->currentptr = pch->length - pch->looplength + over;
+}
+
+static void _DecodeCellMOD(ModPlayerStatus_t *mp, int i, const uint8_t *cell, ModCell_t *dc) {
+	// Decodes the pattern cell of channel `i`, looking up its sample. Uses
+	// the sample the channel plays, which only the first tick of a row
+	// changes, so the cells of the next row can be decoded on any tick
+	// after the first one of the current row
+	SampleHeader_t buf;
+
+	int note = ((cell[0] << 8) | cell[1]) & 0xFFF;
+	int sample = (cell[0] & 0xF0) | (cell[2] >> 4);
+
+	dc->eff = cell[2] & 0x0F;
+	dc->effval = cell[3];
+
+	if(sample > 31) sample = 1;
+
+	dc->sample = sample;
+
+	if(sample) {
+		// Walking the headers to the sample data is only needed when the
+		// channel switches to another sample
+		dc->relocate = sample - 1 != mp->ch[i].sample || !mp->paula[i].sample;
+		dc->data = dc->relocate ? _SampleDataMOD(mp, sample - 1) : NULL;
+		dc->volume = _HeaderMOD(mp, sample - 1, &buf)->volume;
+
+		_SampleLengthMOD(mp, sample - 1, &dc->length, &dc->looplength);
+	}
+
+	if(note) {
+		int finetune;
+
+		if(dc->eff == 0xE && (dc->effval & 0xF0) == 0x50)
+			finetune = dc->effval & 0xF;
+		else
+			finetune = _HeaderMOD(mp, sample ? sample - 1 : mp->ch[i].sample, &buf)->finetune;
+
+		dc->period = note * finetune_table[finetune & 0xF] >> 16;
+	}
+
+	dc->note = note;
+}
+
+#if USE_ROW_PREDECODE
+static void _DecodeRowMOD(ModPlayerStatus_t *mp, int order, int row, int upto) {
+	// Decodes the cells of the row at `order`/`row` up to channel `upto`
+	if(mp->decodedorder != order || mp->decodedrow != row) {
+		mp->decodedorder = order;
+		mp->decodedrow = row;
+		mp->decoded = 0;
+	}
+
+	if(mp->decoded >= upto)
+		return;
+
+	const uint8_t *cells = _RowMOD(mp, order, row);
+
+	for(; mp->decoded < upto; mp->decoded++, mp->cellsdecoded++)
+		_DecodeCellMOD(mp, mp->decoded, cells + 4 * mp->decoded, &mp->nextrow[mp->decoded]);
+}
+
+static void _PredecodeMOD(ModPlayerStatus_t *mp) {
+	// On a tick after the first one of a row: decodes cells of the next row,
+	// one channel per tick on the last ticks of the row, more if there are
+	// fewer ticks than channels left
+	int left = mp->maxtick - mp->tick;  // this tick and the ones after it
+	int upto = 4 - (left - 1);  // Hardcoded 4 channels
+
+	if(upto <= 0)
+		return;
+
+	// The position the row advance in ProcessMOD() goes to
+	int order = mp->order, row = mp->row + 1;
+
+	if(mp->skiporderrequest >= 0) {
+		order = mp->skiporderrequest;
+		row = mp->skiporderdestrow;
+	} else if(row >= 0x40) {
+		row = 0;
+		if(++order >= mp->orders) order = 0;
+	}
+
+	_DecodeRowMOD(mp, order, row, upto);
+}
+#endif
+
+ModPlayerStatus_t *ProcessMOD(ModPlayerStatus_t *mp) {
+	if(mp->tick == 0) {
+		mp->skiporderrequest = -1;
+
+#if EVENT_QUEUE_SIZE
+		if(mp->order != mp->eventorder) {
+			mp->eventorder = mp->order;
+			_PushEvent(mp, MOD_EVENT_ORDER, 0, mp->ordertable[mp->order]);
+		}
+
+		_PushEvent(mp, MOD_EVENT_ROW, 0, 0);
+#endif
+
+#if USE_ROW_PREDECODE
+		// Decode what the ticks before did not get to
+		if(mp->decodedorder != mp->order || mp->decodedrow != mp->row)
+			mp->decoded = 0;
+
+		_DecodeRowMOD(mp, mp->order, mp->row, 4);
+
+		const ModCell_t *cells = mp->nextrow;
+#else
+		ModCell_t cells[4];
+		const uint8_t *row = _RowMOD(mp, mp->order, mp->row);
+
+		for(int i = 0; i < 4; i++)  // Hardcoded 4 channels
+			_DecodeCellMOD(mp, i, row + 4 * i, &cells[i]);
+#endif
+
+		for(int i = 0; i < 4; i++) {  // Hardcoded 4 channels
+			mp->ch[i].vibrato.val = mp->ch[i].tremolo.val = 0;
+
+			const ModCell_t *cell = &cells[i];
+
+			int eff_tmp = cell->eff;
+			int effval_tmp = cell->effval;
+
+			if(mp->ch[i].eff == 0 && mp->ch[i].effval != 0) {
+				mp->ch[i].period = mp->ch[i].note;
+			}
+
+			if(cell->sample) {
+				PaulaChannel_t *pch = &mp->paula[i];
+
+				if(cell->relocate)
+					_RelocateMOD(mp, pch, cell->sample - 1, cell->data);
+
+				pch->length = cell->length;
+				pch->looplength = cell->looplength;
+
+				mp->ch[i].sample = cell->sample - 1;
+				mp->ch[i].volume = cell->volume;
+			}
+
+			if(cell->note) {
+				mp->ch[i].note = cell->period;
+
+				if(eff_tmp != 0x3 && eff_tmp != 0x5 && (eff_tmp != 0xE || (effval_tmp & 0xF0) != 0xD0)) {
+					mp->paula[i].age = mp->paula[i].currentptr = 0;
+					mp->ch[i].period = mp->ch[i].note;
+
+					if(mp->ch[i].vibrato.waveform < 4) mp->ch[i].vibrato.phase = 0;
+					if(mp->ch[i].tremolo.waveform < 4) mp->ch[i].tremolo.phase = 0;
+				}
+			}
+
+			if(eff_tmp || effval_tmp) switch(eff_tmp) {
+				case 0x3:
+					if(effval_tmp) mp->ch[i].slideamount = effval_tmp;
+
+				case 0x5:
+					mp->ch[i].slidenote = mp->ch[i].note;
+					break;
+
+				case 0x4:
+					if(effval_tmp & 0xF0) mp->ch[i].vibrato.speed = effval_tmp >> 4;
+					if(effval_tmp & 0x0F) mp->ch[i].vibrato.depth = effval_tmp & 0x0F;
+
+					// break intentionally left out here
+	
+				case 0x6:
+					_RecalculateWaveform(mp, &mp->ch[i].vibrato);
+					break;
+
+				case 0x7:
+					if(effval_tmp & 0xF0) mp->ch[i].tremolo.speed = effval_tmp >> 4;
+					if(effval_tmp & 0x0F) mp->ch[i].tremolo.depth = effval_tmp & 0x0F;
+					_RecalculateWaveform(mp, &mp->ch[i].tremolo);
+					break;
+
+				case 0x8:
+					_PushEvent(mp, MOD_EVENT_SYNC, i, effval_tmp);
+					break;
+
+				case 0xC:
+					mp->ch[i].volume = (effval_tmp > 0x40) ? 0x40 : effval_tmp;
+					break;
+
+				case 0x9:
+					if(effval_tmp) {
+						mp->paula[i].currentptr = effval_tmp << 8;
+						mp->ch[i].sampleoffset = effval_tmp;
+					} else {
+						mp->paula[i].currentptr = mp->ch[i].sampleoffset << 8;
+					}
+
+					mp->paula[i].age = 0;
+					break;
+
+				case 0xB:
+					if(effval_tmp >= mp->orders) effval_tmp = 0;
+
+					mp->skiporderrequest = effval_tmp;
+					break;
+
+				case 0xD:
+					if(mp->skiporderrequest < 0) {
+						if(mp->order + 1 < mp->orders)
+							mp->skiporderrequest = mp->order + 1;
+						else
+							mp->skiporderrequest = 0;
+					}
+
+					mp->skiporderdestrow = (effval_tmp >> 4) * 10 + (effval_tmp & 0xF); // What were the ProTracker guys smoking?!
+
+					// Also catches digits above 9, which would break into the next pattern
+					if(mp->skiporderdestrow > 63) mp->skiporderdestrow = 0;
+					break;
+
+				case 0xE:
+					switch(effval_tmp >> 4) {
+						case 0x0:
+							mp->ledfilter = !(effval_tmp & 0xF);
+							break;
+
+						case 0x1:
+							mp->ch[i].period -= effval_tmp & 0xF;
+							break;
+
+						case 0x2:
+							mp->ch[i].period += effval_tmp & 0xF;
+							break;
+						
+						case 0x4:
+							mp->ch[i].vibrato.waveform = effval_tmp & 0x7;
+							break;
+
+						case 0x6:
+							if(effval_tmp & 0xF) {
+								if(!mp->patloopcycle)
+									mp->patloopcycle = (effval_tmp & 0xF) + 1;
+
+								if(mp->patloopcycle > 1) {
+									mp->skiporderrequest = mp->order;
+									mp->skiporderdestrow = mp->patlooprow;
+								}
+
+								mp->patloopcycle--;
+							} else {
+								mp->patlooprow = mp->row;
+							}
+
+							break;
+
+						case 0x7:
+							mp->ch[i].tremolo.waveform = effval_tmp & 0x7;
+							break;
+
+						case 0x8:
+							_PushEvent(mp, MOD_EVENT_SYNC_E8, i, effval_tmp & 0xF);
+							break;
+
+						case 0xA:
+							mp->ch[i].volume += effval_tmp & 0xF;
+							if(mp->ch[i].volume > 0x40) mp->ch[i].volume = 0x40;
+							break;
+
+						case 0xB:
+							mp->ch[i].volume -= effval_tmp & 0xF;
+							if(mp->ch[i].volume < 0x00) mp->ch[i].volume = 0x00;
+							break;
+
+						case 0xE:
+							mp->maxtick *= ((effval_tmp & 0xF) + 1);
+							break;
+					}
+					break;
+
+				case 0xF:
+					if(effval_tmp) {
+						if(effval_tmp < 0x20) {
+							mp->maxtick = (mp->maxtick / mp->speed) * effval_tmp;
+							mp->speed = effval_tmp;
+						} else {
+							mp->bpm = effval_tmp;
+							_RecalculateTempo(mp);
+						}
+					}
+
+					break;
+			}
+
+			mp->ch[i].eff = eff_tmp;
+			mp->ch[i].effval = effval_tmp;
+
+			_EnterLoopMOD(&mp->paula[i]);
+		}
+	}
+
+	for(int i = 0; i < 4; i++) {  // Hardcoded 4 channels
+		int eff_tmp = mp->ch[i].eff;
+		int effval_tmp = mp->ch[i].effval;
+
+		if(eff_tmp || effval_tmp) switch(eff_tmp) {
+			case 0x0:
+				switch(mp->tick % 3) {
+					case 0:
+						mp->ch[i].period = mp->ch[i].note;
+						break;
+
+					case 1:
+						mp->ch[i].period = (mp->ch[i].note * arpeggio_table[effval_tmp >> 4]) >> 16;
+						break;
+
+					case 2:
+						mp->ch[i].period = (mp->ch[i].note * arpeggio_table[effval_tmp & 0xF]) >> 16;
+						break;
+				}
+				break;
+
+			case 0x1:
+				if(mp->tick) mp->ch[i].period -= effval_tmp;
+				break;
+
+			case 0x2:
+				if(mp->tick) mp->ch[i].period += effval_tmp;
+				break;
+
+			case 0x5:
+				if(mp->tick) {
+					if(effval_tmp > 0xF) {
+						mp->ch[i].volume += (effval_tmp >> 4);
+						if(mp->ch[i].volume > 0x40) mp->ch[i].volume = 0x40;
+					} else {
+						mp->ch[i].volume -= (effval_tmp & 0xF);
+						if(mp->ch[i].volume < 0x00) mp->ch[i].volume = 0x00;
+					}
+				}
+				
+				effval_tmp = 0;
+				// break intentionally left out here
+
+			case 0x3:
+				if(mp->tick) {
+					if(!effval_tmp) effval_tmp = mp->ch[i].slideamount;
+
+					if(mp->ch[i].slidenote > mp->ch[i].period) {
+						mp->ch[i].period += effval_tmp;
+
+						if(mp->ch[i].slidenote < mp->ch[i].period)
+							mp->ch[i].period = mp->ch[i].slidenote;
+					} else if(mp->ch[i].slidenote < mp->ch[i].period) {
+						mp->ch[i].period -= effval_tmp;
+
+						if(mp->ch[i].slidenote > mp->ch[i].period)
+							mp->ch[i].period = mp->ch[i].slidenote;
+					} 
+				}
+
+				break;
+
+			case 0x4:
+				if(mp->tick) {
+					mp->ch[i].vibrato.phase += mp->ch[i].vibrato.speed;
+					_RecalculateWaveform(mp, &mp->ch[i].vibrato);
+				}
+				break;
+
+			case 0x6:
+				if(mp->tick) {
+					mp->ch[i].vibrato.phase += mp->ch[i].vibrato.speed;
+					_RecalculateWaveform(mp, &mp->ch[i].vibrato);
+				}
+				// break intentionally left out here
+
+			case 0xA:
+				if(mp->tick) {
+					if(effval_tmp > 0xF) {
+						mp->ch[i].volume += (effval_tmp >> 4);
+						if(mp->ch[i].volume > 0x40) mp->ch[i].volume = 0x40;
+					} else {
+						mp->ch[i].volume -= (effval_tmp & 0xF);
+						if(mp->ch[i].volume < 0x00) mp->ch[i].volume = 0x00;
+					}
+				}
+
+				break;
+
+			case 0x7:
+				if(mp->tick) {
+					mp->ch[i].tremolo.phase += mp->ch[i].tremolo.speed;
+					_RecalculateWaveform(mp, &mp->ch[i].tremolo);
+				}
+				break;
+
+			case 0xE:
+				switch(effval_tmp >> 4) {
+					case 0x9:
+						if(mp->tick && !(mp->tick % (effval_tmp & 0xF)))
+							mp->paula[i].age = mp->paula[i].currentptr = mp->paula[i].currentsubptr = 0;
+						break;
+
+					case 0xC:
+						if(mp->tick >= (effval_tmp & 0xF)) mp->ch[i].volume = 0;
+						break;
+
+					case 0xD:
+						if(mp->tick == (effval_tmp & 0xF)) {
+							mp->paula[i].age = mp->paula[i].currentptr = mp->paula[i].currentsubptr = 0;
+							mp->ch[i].period = mp->ch[i].note;
+						}
+						break;
+				}
+
+				break;
+		}
+
+		if(mp->ch[i].period < 0 && mp->ch[i].period != 0) {
+			mp->ch[i].period = 0;
+		}
+
+		// Pre-calculate sampler period & volume
+
+		if(mp->ch[i].period)
+			mp->paula[i].period = _PeriodToStep(mp, mp->ch[i].period + (mp->ch[i].vibrato.val >> 7));
+		else
+			mp->paula[i].period = 0;
+		
+		int32_t vol = mp->ch[i].volume + (mp->ch[i].tremolo.val >> 6);
+
+		if(vol < 0) vol = 0;
+		if(vol > 64) vol = 64;
+
+		mp->paula[i].volume = vol;
+
+#if SAMPLE_CACHE_SIZE
+		// Play from the cache once the channel is in the loop, it stays there
+		// until the next trigger, which starts from the MOD file again
+		PaulaChannel_t *pch = &mp->paula[i];
+		int offset = mp->cacheoffset[mp->ch[i].sample];
+
+		if(pch->sample) {
+			uint32_t loopstart = pch->length - pch->looplength;
+
+			if(offset >= 0 && pch->looplength && pch->currentptr >= loopstart)
+				pch->sample = mp->samplecache + offset - loopstart;
+			else
+				pch->sample = pch->data;
+		}
+#endif
+	}
+
+#if USE_ROW_PREDECODE
+	if(mp->tick > 0)
+		_PredecodeMOD(mp);
+#endif
+
+	mp->tick++;
+	if(mp->tick >= mp->maxtick) {
+		int oldorder = mp->order;
+
+		mp->tick = 0;
+		mp->maxtick = mp->speed;
+
+		if(mp->skiporderrequest >= 0) {
+			mp->row = mp->skiporderdestrow;
+			mp->order = mp->skiporderrequest;
+
+			mp->skiporderdestrow = 0;
+			mp->skiporderrequest = -1;
+		} else {
+			mp->row++;
+			if(mp->row >= 0x40) {
+				mp->row = 0;
+				mp->order++;
+
+				if(mp->order >= mp->orders) mp->order = 0;
+			}
+		}
+
+		// The song has looped if it went back, or jumped to the start of the
+		// same order without a pending pattern loop (E6x)
+		int looped = mp->order < oldorder ||
+			(mp->order == oldorder && mp->row == 0 && mp->patloopcycle == 0);
+
+		mp->loops += looped;
+
+		// Switch to a queued song at the order boundary
+		const ModFile_t *nextmod = __atomic_load_n(&mp->nextmod, __ATOMIC_ACQUIRE);
+
+		if(nextmod && (looped || (mp->nextmode == MOD_SWITCH_ORDER && mp->order != oldorder))) {
+			mp->nextmod = NULL;
+
+			if(_LoadMOD(mp, nextmod, mp->nextsize) && mp->nextgain)
+				SetGainMOD(mp, mp->nextgain);
+		}
+
+#if USE_STORAGE
+		// Fetch the next row now, not on the tick that decodes it
+		_RowMOD(mp, mp->order, mp->row);
+#endif
+	}
+
+	return mp;
+}
+
+#if USE_STORAGE
+static void _FillWindowMOD(ModPlayerStatus_t *mp, int ch, uint32_t start, uint32_t stop) {
+	// Loads the part [start, stop) of the song into the window of channel
+	// `ch`, keeping what it already holds of it
+	PaulaChannel_t *pch = &mp->paula[ch];
+	int8_t *window = mp->window[ch];
+	uint32_t lo = (start > pch->windowstart) ? start : pch->windowstart;
+	uint32_t hi = (stop < pch->windowend) ? stop : pch->windowend;
+
+	if(lo < hi) {
+		memmove(window + (lo - start), window + (lo - pch->windowstart), hi - lo);
+	} else {
+		lo = hi = stop;
+	}
+
+	if(start < lo) _ReadStorageMOD(mp, start, window, lo - start);
+	if(hi < stop) _ReadStorageMOD(mp, hi, window + (hi - start), stop - hi);
+
+	pch->windowstart = start;
+	pch->windowend = stop;
+	mp->windowfills++;
+}
+
+static void _StreamMOD(ModPlayerStatus_t *mp) {
+	// Makes sure that the window of every channel holds the sample data it
+	// reads from now on, and sets `streamtick` to the number of samples
+	// until the next tick or until a channel runs past its window
+	uint32_t run = mp->audiotick;
+
+	for(int ch = 0; ch < 4; ch++) {  // Hardcoded 4 channels
+		PaulaChannel_t *pch = &mp->paula[ch];
+
+		if(!pch->sample || !WrapChannelMOD(pch))
+			continue;
+
+		// Positions in the song
+		uint32_t pos = pch->offset + pch->currentptr;
+		uint32_t end = pch->offset + pch->length;
+		uint32_t loop = end - pch->looplength;
+		uint32_t start = (pch->looplength && loop < pos) ? loop : pos;
+		uint32_t stop = end;
+
+		if(end - start > STREAM_WINDOW) {
+			if(pos >= pch->windowstart && pos < pch->windowend) {
+				// Still streaming from the window
+				start = pch->windowstart;
+				stop = pch->windowend;
+			} else {
+				start = pos;
+				stop = (end - pos > STREAM_WINDOW) ? pos + STREAM_WINDOW : end;
+			}
+		}
+
+		if(start < pch->windowstart || stop > pch->windowend)
+			_FillWindowMOD(mp, ch, start, stop);
+
+		pch->sample = mp->window[ch] - (pch->windowstart - pch->offset);
+
+		// The window lasts until the next tick if it holds the rest of the
+		// sample and, for a looping sample, the loop
+		if(pch->windowend < end || (pch->looplength && loop < pch->windowstart)) {
+			uint32_t left = run;
+
+			if(pch->period)
+				left = (((pch->windowend - pos) << 16) - pch->currentsubptr + pch->period - 1) / pch->period;
+
+			if(left < run) run = left;
+		}
+	}
+
+	mp->streamtick = run;
+}
+#endif
 
-				// If it is a looping sample, wrap around to the loop point
+// Largest level of the PWM output: above 0xFF00 the duty value 255 plus
+// the carry of the modulator would wrap around to 0
+#define PWM_PEAK (0xFF00 - 32768)
 
-				while(pch->currentptr >= pch->length)
-					pch->currentptr -= pch->looplength;
+#if USE_MONO_OUTPUT
+static inline void _HeadroomMOD(ModPlayerStatus_t *mp) {
+	// Each channel adds at most 128 * volume to the mix, and volumes only
+	// change on ticks: clip until the next tick if the sum at the current
+	// gain can leave the output range. A crossfade mixes another instance
+	// in, whose volumes are not known here
+#if USE_STEREO_PWM
+	// Each side carries its own pair of channels plus a third of the other
+	// pair, panned as in _AddSampleMOD()
+	uint32_t pair[2] = { 0, 0 };
+
+	for(int ch = 0; ch < CHANNELS; ch++)
+		if(mp->paula[ch].sample)
+			pair[(ch & 3) == 1 || (ch & 3) == 2] += 128 * mp->paula[ch].volume;
+
+	uint32_t left = (pair[0] * 65536 + pair[1] * 21845) >> 16;
+	uint32_t right = (pair[1] * 65536 + pair[0] * 21845) >> 16;
+	uint32_t peak = (((left > right) ? left : right) * mp->mixgain) >> 11;  // As in RenderMOD()
+#else
+	uint32_t peak = 0;
+
+	for(int ch = 0; ch < CHANNELS; ch++)
+		if(mp->paula[ch].sample)
+			peak += 128 * mp->paula[ch].volume;
+
+	peak = (peak * mp->mixgain) >> 12;  // As in RenderMOD()
+#endif
+	mp->saturate = mp->fadefrom || peak > PWM_PEAK;
+}
+#endif
+
+static inline void _ProcessTickMOD(ModPlayerStatus_t *mp, uint32_t pos) {
+	mp->eventtime = pos;
+	ProcessMOD(mp);
+	mp->audiotick = mp->audiospeed;
+
+#if USE_MONO_OUTPUT
+	_HeadroomMOD(mp);
+#endif
+
+#if USE_STORAGE
+	// Periods and sample positions may have changed
+	mp->streamtick = 0;
+#endif
+
+	// Spread the fractional part of the tick length evenly
+	mp->audiotickerr += mp->audiospeedrem;
+	if(mp->audiotickerr >= mp->audiospeedden) {
+		mp->audiotickerr -= mp->audiospeedden;
+		mp->audiotick++;
+	}
+}
 
-				// Render the current sample
+int AdvanceMOD(ModPlayerStatus_t *mp, int len) {
+	if(mp->audiotick <= 0)
+		_ProcessTickMOD(mp, mp->samplepos);
 
-				if(!pch->muted) {
+#if USE_STORAGE
+	if(mp->streamtick <= 0)
+		_StreamMOD(mp);
+
+	if(len > (int) mp->streamtick) len = mp->streamtick;
+#endif
+
+	int n = (len < (int) mp->audiotick) ? len : (int) mp->audiotick;
+
+	mp->audiotick -= n;
+	mp->samplepos += n;
+#if USE_STORAGE
+	mp->streamtick -= n;
+#endif
+
+	return n;
+}
+
+static inline void _TickMOD(ModPlayerStatus_t *mp, uint32_t pos) {
+	// Process the tick, if necessary
+
+	if(mp->audiotick <= 0)
+		_ProcessTickMOD(mp, pos);
+
+#if USE_STORAGE
+	if(mp->streamtick <= 0)
+		_StreamMOD(mp);
+
+	mp->streamtick--;
+#endif
+
+	mp->audiotick--;
+}
+
+static inline int32_t _ChannelSample(const ModPlayerStatus_t *mp, const PaulaChannel_t *pch, int ch) {
+	// Render the current sample, the position must already be wrapped
 #if USE_LINEAR_INTERPOLATION
-					uint32_t nextptr = pch->currentptr + 1;
+	uint32_t nextptr = pch->currentptr + 1;
 
-					while(nextptr >= pch->length) {
-						if(pch->looplength != 0)
-							nextptr -= pch->looplength;
-						else
-							nextptr = pch->currentptr;
-					}
+	// A loop is never longer than the sample (see InitMOD), one step back suffices
+	if(nextptr >= pch->length)
+		nextptr = pch->looplength ? nextptr - pch->looplength : pch->currentptr;
 
-					assert(pch->currentptr < pch->length, "channel: %d, test %u < %u", ch, pch->currentptr, pch->length);
-					assert(nextptr < pch->length, "channel: %d, test %u < %u", ch, nextptr, pch->length);
+	assert(pch->currentptr < pch->length, "channel: %d, test %u < %u", ch, pch->currentptr, pch->length);
+	assert(nextptr < pch->length, "channel: %d, test %u < %u", ch, nextptr, pch->length);
 
-					int32_t sample1 = pch->sample[pch->currentptr];
-					int32_t sample2 = pch->sample[nextptr];
+	int32_t sample1 = pch->sample[pch->currentptr];
+	int32_t sample2 = pch->sample[nextptr];
 
-					assert(pch->currentsubptr < 0x10000, "channel: %d, test %u < 0x10000", ch, pch->currentsubptr);
+	assert(pch->currentsubptr < 0x10000, "channel: %d, test %u < 0x10000", ch, pch->currentsubptr);
 
-					int32_t sample = (sample1 * (0x10000 - pch->currentsubptr) +
-						sample2 * pch->currentsubptr) * pch->volume / 65536;
+	return (sample1 * (0x10000 - pch->currentsubptr) +
+		sample2 * pch->currentsubptr) * pch->volume / 65536;
 #else
-					int32_t sample = pch->sample[pch->currentptr] * pch->volume;
+#if USE_STORAGE
+	assert(pch->offset + pch->currentptr >= pch->windowstart && pch->offset + pch->currentptr < pch->windowend,
+		"channel: %d, test %u in window %u..%u", ch, pch->offset + pch->currentptr, pch->windowstart, pch->windowend);
 #endif
 
-#if USE_MONO_OUTPUT
-					// Mix all channels equally to mono
-					mono += sample * chmul;
+	return pch->sample[pch->currentptr] * pch->volume;
+#endif
+}
+
+static inline void _AddSampleMOD(int32_t *l, int32_t *r, int32_t sample, int ch, const int stereo) {
+	const int32_t majorchmul = 65536;  // 131072 / 2
+	const int32_t minorchmul = 21845;  // 131072 / 6
+
+	if(!stereo) {
+		// Mix all channels equally to mono, scaled once per sample by the caller
+		*l += sample;
+	} else if((ch & 3) == 1 || (ch & 3) == 2) {
+		// Distribute the rendered sample across both output channels (stereo panning)
+		*l += sample * minorchmul;
+		*r += sample * majorchmul;
+	} else {
+		*l += sample * majorchmul;
+		*r += sample * minorchmul;
+	}
+}
+
+#if USE_CONSTANT_TIME
+// Stand-ins for the channels that do not play: they render from a silent
+// loop and step an idle channel, at the cost of a playing one
+static const int8_t _silence[2];
+static const PaulaChannel_t _silentchannel = { .sample = _silence, .length = 2, .looplength = 2 };
+static PaulaChannel_t _idlechannel;
+#endif
+
+static inline void _MixMOD(ModPlayerStatus_t *mp, int32_t *l, int32_t *r, const int stereo) {
+	for(int ch = 0; ch < 4; ch++) {  // Hardcoded 4 channels
+		PaulaChannel_t *pch = &mp->paula[ch];
+
+#if USE_CONSTANT_TIME
+		int playing = pch->sample && WrapChannelOnceMOD(pch);
+
+		_AddSampleMOD(l, r, _ChannelSample(mp, (playing && !pch->muted) ? pch : &_silentchannel, ch), ch, stereo);
+		StepChannelMOD(playing ? pch : &_idlechannel);
 #else
-					// Distribute the rendered sample across both output channels (stereo panning)
-					if((ch & 3) == 1 || (ch & 3) == 2) {
-						l += sample * minorchmul;
-						r += sample * majorchmul;
-					} else {
-						l += sample * majorchmul;
-						r += sample * minorchmul;
-					}
+		if(pch->sample) {
+			if(!WrapChannelMOD(pch))
+				continue;
+
+			// Render the current sample
+
+			if(!pch->muted)
+				_AddSampleMOD(l, r, _ChannelSample(mp, pch, ch), ch, stereo);
+
+			// Advance to the next required sample
+
+			StepChannelMOD(pch);
+		}
 #endif
-				}
+	}
+}
 
-				// Advance to the next required sample
+static inline void _CrossfadeMOD(ModPlayerStatus_t *mp, uint32_t pos, int32_t *l, int32_t *r, const int stereo) {
+	ModPlayerStatus_t *from = mp->fadefrom;
+	int32_t fl = 0, fr = 0;
 
-				pch->currentsubptr += pch->period;
+	_TickMOD(from, pos);
+	_MixMOD(from, &fl, &fr, stereo);
 
-				if(pch->currentsubptr >= 0x10000) {
-					pch->currentptr += pch->currentsubptr >> 16;
-					pch->currentsubptr &= 0xFFFF;
-				}
+#if USE_MONO_OUTPUT
+	// At the gain of the instance faded out, RenderMOD() applies ours
+	if(!stereo) {
+		fl = (fl * mp->faderatio) >> 11;
+	} else {
+		fl = ((int64_t) fl * mp->faderatio) >> 11;
+		fr = ((int64_t) fr * mp->faderatio) >> 11;
+	}
+#endif
+
+	// Linear fade, gain in 1.15 fixed point
+	int32_t gain = mp->fadegain >> 15;
+
+	if(!stereo) {
+		*l = (*l * gain + fl * (32768 - gain)) >> 15;
+	} else {
+		*l = (*l >> 15) * gain + (fl >> 15) * (32768 - gain);
+		*r = (*r >> 15) * gain + (fr >> 15) * (32768 - gain);
+	}
 
-				if(pch->age < INT32_MAX)
-					pch->age++;
+	mp->fadegain += mp->fadestep;
+	if(mp->fadegain >= (1 << 30))
+		mp->fadefrom = NULL;
+}
+
+static inline void _FrameMOD(ModPlayerStatus_t *mp, uint32_t pos, int32_t *l, int32_t *r, const int stereo) {
+	// Renders the output sample at `pos`, unscaled: the sum of all channels
+	// for mono, the panned sums times 65536 for stereo
+	_TickMOD(mp, pos);
+
+	*l = *r = 0;
+	_MixMOD(mp, l, r, stereo);
+
+	if(mp->fadefrom)
+		_CrossfadeMOD(mp, pos, l, r, stereo);
+}
+
+#if USE_BLOCK_MIXER
+static void _MixChannelBlock(const ModPlayerStatus_t *mp, PaulaChannel_t *pch, int ch, int32_t *acc, int n) {
+	// The gain over the sample-by-sample mixer comes from hoisting the
+	// end/loop checks out of the inner loop
+	while(n > 0) {
+		if(!WrapChannelMOD(pch))
+			return;
+
+		// Number of samples that can be rendered before the read position
+		// (including the interpolation partner) runs past the sample end,
+		// so that the inner loop needs no wrap checks
+
+		uint32_t end = pch->length - USE_LINEAR_INTERPOLATION;
+		int run = n;
+
+		if(pch->currentptr >= end) {
+			run = 1;
+		} else if(pch->period) {
+			uint64_t left = ((uint64_t) (end - pch->currentptr) << 16) - pch->currentsubptr;
+			uint64_t steps = (left + pch->period - 1) / pch->period;
+
+			if(steps < (uint64_t) run) run = steps;
+		}
+
+		uint32_t ptr = pch->currentptr, sub = pch->currentsubptr, step = pch->period;
+
+		if(pch->muted) {
+			uint64_t pos = sub + (uint64_t) step * run;
+
+			ptr += pos >> 16;
+			sub = pos & 0xFFFF;
+		} else if(pch->currentptr >= end) {
+			acc[0] += _ChannelSample(mp, pch, ch);
+
+			sub += step;
+			ptr += sub >> 16;
+			sub &= 0xFFFF;
+		} else {
+			// Positions advance incrementally, no gathers or divisions
+			const int8_t *data = pch->sample;
+			int32_t vol = pch->volume;
+
+			for(int i = 0; i < run; i++) {
+#if USE_LINEAR_INTERPOLATION
+				acc[i] += (data[ptr] * (int32_t) (0x10000 - sub) + data[ptr + 1] * (int32_t) sub) * vol / 65536;
+#else
+				acc[i] += data[ptr] * vol;
+#endif
+
+				sub += step;
+				ptr += sub >> 16;
+				sub &= 0xFFFF;
 			}
 		}
 
+		pch->currentptr = ptr;
+		pch->currentsubptr = sub;
+
+		pch->age = (pch->age < (uint32_t) (INT32_MAX - run)) ? pch->age + run : INT32_MAX;
+
+		acc += run;
+		n -= run;
+	}
+}
+
+static void _PanBlock(const int32_t *a, const int32_t *b, int16_t *out, int n) {
+	// a: sum of channels 0 and 3, b: sum of channels 1 and 2
+	// left = (a * 65536 + b * 21845) / 65536, right = (a * 21845 + b * 65536) / 65536,
+	// truncated towards zero like the sample-by-sample mixer, saturated to 16 bits
+	int i = 0;
+
+#if defined(__SSE2__)
+	const __m128i minor = _mm_set1_epi32(21845);  // (21845, 0) pairs for madd
+	const __m128i round = _mm_set1_epi32(0xFFFF);
+	const __m128i zero = _mm_setzero_si128();
+
+	for(; i + 4 <= n; i += 4) {
+		__m128i va = _mm_loadu_si128((const __m128i *) (a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i *) (b + i));
+
+		// SSE2 has no 32-bit multiply, the channel sums fit in 16 bits so
+		// multiply them as (x, 0) pairs with pmaddwd instead
+		__m128i am = _mm_madd_epi16(_mm_unpacklo_epi16(_mm_packs_epi32(va, va), zero), minor);
+		__m128i bm = _mm_madd_epi16(_mm_unpacklo_epi16(_mm_packs_epi32(vb, vb), zero), minor);
+
+		__m128i l = _mm_add_epi32(_mm_slli_epi32(va, 16), bm);
+		__m128i r = _mm_add_epi32(_mm_slli_epi32(vb, 16), am);
+
+		l = _mm_srai_epi32(_mm_add_epi32(l, _mm_and_si128(_mm_srai_epi32(l, 31), round)), 16);
+		r = _mm_srai_epi32(_mm_add_epi32(r, _mm_and_si128(_mm_srai_epi32(r, 31), round)), 16);
+
+		_mm_storeu_si128((__m128i *) (out + 2 * i), _mm_unpacklo_epi16(_mm_packs_epi32(l, l), _mm_packs_epi32(r, r)));
+	}
+#endif
+
+	for(; i < n; i++) {
+		int32_t l = (a[i] * 65536 + b[i] * 21845) / 65536;
+		int32_t r = (a[i] * 21845 + b[i] * 65536) / 65536;
+
+		out[2 * i] = (l > INT16_MAX) ? INT16_MAX : (l < INT16_MIN) ? INT16_MIN : l;
+		out[2 * i + 1] = (r > INT16_MAX) ? INT16_MAX : (r < INT16_MIN) ? INT16_MIN : r;
+	}
+}
+
+static void _RenderMODBlocks(ModPlayerStatus_t *mp, int16_t *out, int len) {
+	int32_t acc[2][MIX_BLOCK];
+
+	for(int s = 0; s < len; ) {
+		// Render up to the next tick, so that all channels keep their
+		// period and volume for the whole block
+		int n = AdvanceMOD(mp, (len - s > MIX_BLOCK) ? MIX_BLOCK : len - s);
+
+		memset(acc, 0, sizeof(acc));
+
+		for(int ch = 0; ch < 4; ch++) {  // Hardcoded 4 channels
+			PaulaChannel_t *pch = &mp->paula[ch];
+
+			if(pch->sample)
+				_MixChannelBlock(mp, pch, ch, acc[(ch & 3) == 1 || (ch & 3) == 2], n);
+		}
+
+		_PanBlock(acc[0], acc[1], out + 2 * s, n);
+
+		s += n;
+	}
+}
+#endif
+
+ModPlayerStatus_t *RenderMOD(ModPlayerStatus_t *mp, volatile uint8_t *buf, int len) {
+#if USE_BLOCK_MIXER
+	// Crossfades are rare, they use the sample-by-sample mixer below
+	if(!mp->fadefrom) {
+		_RenderMODBlocks(mp, (int16_t *) buf, len);
+		return mp;
+	}
+#endif
+
+#if !USE_MONO_OUTPUT
+	memset((uint8_t *) buf, 0, len * 4);  // Stereo: 2 channels * 2 bytes
+#endif
+
+	for(int s = 0; s < len; s++) {
+		// Render the audio
+
+		int32_t l, r;
+
+		_FrameMOD(mp, mp->samplepos + s, &l, &r, !USE_MONO_OUTPUT || USE_STEREO_PWM);
+
 #if USE_MONO_OUTPUT
-		// Direct delta-sigma modulation to 8-bit PWM with oversampling
-		// Scale mono (signed 32-bit) to unsigned 16-bit centered at 32768
-		uint32_t sample16 = ((mono >> 16) + 32768) & 0xFFFF;
-
-		// Split into integer (PWM value 0-255) and fractional part for delta-sigma
-		register uint32_t p = sample16 >> 8;           // Upper 8 bits
-		register uint32_t f = sample16 << 16;          // Lower 8 bits as fraction
-		register uint32_t a = g_dsm_residual;          // Accumulator
-		__asm__ volatile (
-			"add   %0, %0, %2\n\t"     // accu += fraction
-			"sltu  t0, %0, %2\n\t"     // t0 = carry
-			"add   t0, t0, %1\n\t"     // t0 = pwm + carry
-			"sb    t0, 0(%3)\n\t"      // store byte
-			"add   %0, %0, %2\n\t"
-			"sltu  t0, %0, %2\n\t"
-			"add   t0, t0, %1\n\t"
-			"sb    t0, 1(%3)\n\t"
-			"add   %0, %0, %2\n\t"
-			"sltu  t0, %0, %2\n\t"
-			"add   t0, t0, %1\n\t"
-			"sb    t0, 2(%3)\n\t"
-			"add   %0, %0, %2\n\t"
-			"sltu  t0, %0, %2\n\t"
-			"add   t0, t0, %1\n\t"
-			"sb    t0, 3(%3)\n\t"
-			"add   %0, %0, %2\n\t"
-			"sltu  t0, %0, %2\n\t"
-			"add   t0, t0, %1\n\t"
-			"sb    t0, 4(%3)\n\t"
-			"add   %0, %0, %2\n\t"
-			"sltu  t0, %0, %2\n\t"
-			"add   t0, t0, %1\n\t"
-			"sb    t0, 5(%3)\n\t"
-			"add   %0, %0, %2\n\t"
-			"sltu  t0, %0, %2\n\t"
-			"add   t0, t0, %1\n\t"
-			"sb    t0, 6(%3)\n\t"
-			"add   %0, %0, %2\n\t"
-			"sltu  t0, %0, %2\n\t"
-			"add   t0, t0, %1\n\t"
-			"sb    t0, 7(%3)\n\t"
-			: "+r" (a)
-			: "r" (p), "r" (f), "r" (buf)
-			: "t0", "memory"
-		);
-		g_dsm_residual = a;
-		buf += 8;
+		// Direct delta-sigma modulation to 8-bit PWM with oversampling,
+		// one modulator per PWM channel
+		for(int c = 0; c < (USE_STEREO_PWM ? 2 : 1); c++) {
+#if USE_STEREO_PWM
+			// Panned like the 16-bit stereo output, times the gain
+			int32_t v = ((c ? r : l) / 65536 * mp->mixgain) >> 11;
+			volatile uint8_t *out = buf + (c ? (PWM_RIGHT_BUFFER ? PWM_RIGHT_BUFFER : 1) : 0);
+#else
+			int32_t v = (l * mp->mixgain) >> 12;  // 131072 / 2 channels at unity gain
+			volatile uint8_t *out = buf;
+#endif
+
+			// Scale to unsigned 16-bit centered at 32768, clipped on the
+			// ticks whose mix can leave the range (see _HeadroomMOD())
+			int32_t u = v + 32768;
+
+			if(mp->saturate)
+				u = (u < 0) ? 0 : (u > 32768 + PWM_PEAK) ? 32768 + PWM_PEAK : u;
+
+			uint32_t sample16 = u & 0xFFFF;
+
+#if USE_DSM_INTERPOLATION
+			// Ramp from the previous sample to this one, 16.8 fixed point
+			uint32_t x = (uint32_t) mp->dsmlast[c] << 8;
+			int32_t d = ((int32_t) sample16 - mp->dsmlast[c]) * 256 / OSR;
+			uint32_t a = mp->dsmresidual[c];
+
+			for(int i = 0; i < OSR; i++) {
+				x += d;
+
+				// Integer part (PWM value 0-255) and fraction for delta-sigma
+				uint32_t f = x << 16;
+
+				a += f;
+				out[i * PWM_STEP] = (x >> 16) + (a < f);
+			}
+
+			mp->dsmlast[c] = sample16;
 #else
-		buf[s * 2] = l / 65536;
-		buf[s * 2 + 1] = r / 65536;
+			// Split into integer (PWM value 0-255) and fractional part for delta-sigma
+			register uint32_t p = sample16 >> 8;           // Upper 8 bits
+			register uint32_t f = sample16 << 24;          // Lower 8 bits as fraction
+			register uint32_t a = mp->dsmresidual[c];      // Accumulator
+#if defined(__riscv) && OSR == 8
+			__asm__ volatile (
+				"add   %0, %0, %2\n\t"     // accu += fraction
+				"sltu  t0, %0, %2\n\t"     // t0 = carry
+				"add   t0, t0, %1\n\t"     // t0 = pwm + carry
+				"sb    t0, 0(%3)\n\t"      // store byte
+				"add   %0, %0, %2\n\t"
+				"sltu  t0, %0, %2\n\t"
+				"add   t0, t0, %1\n\t"
+				"sb    t0, %4(%3)\n\t"
+				"add   %0, %0, %2\n\t"
+				"sltu  t0, %0, %2\n\t"
+				"add   t0, t0, %1\n\t"
+				"sb    t0, %5(%3)\n\t"
+				"add   %0, %0, %2\n\t"
+				"sltu  t0, %0, %2\n\t"
+				"add   t0, t0, %1\n\t"
+				"sb    t0, %6(%3)\n\t"
+				"add   %0, %0, %2\n\t"
+				"sltu  t0, %0, %2\n\t"
+				"add   t0, t0, %1\n\t"
+				"sb    t0, %7(%3)\n\t"
+				"add   %0, %0, %2\n\t"
+				"sltu  t0, %0, %2\n\t"
+				"add   t0, t0, %1\n\t"
+				"sb    t0, %8(%3)\n\t"
+				"add   %0, %0, %2\n\t"
+				"sltu  t0, %0, %2\n\t"
+				"add   t0, t0, %1\n\t"
+				"sb    t0, %9(%3)\n\t"
+				"add   %0, %0, %2\n\t"
+				"sltu  t0, %0, %2\n\t"
+				"add   t0, t0, %1\n\t"
+				"sb    t0, %10(%3)\n\t"
+				: "+r" (a)
+				: "r" (p), "r" (f), "r" (out),
+				  "i" (PWM_STEP), "i" (2 * PWM_STEP), "i" (3 * PWM_STEP), "i" (4 * PWM_STEP),
+				  "i" (5 * PWM_STEP), "i" (6 * PWM_STEP), "i" (7 * PWM_STEP)
+				: "t0", "memory"
+			);
+#else
+			// Same modulator in C, for host builds and other oversampling ratios
+			for(int i = 0; i < OSR; i++) {
+				a += f;
+				out[i * PWM_STEP] = p + (a < f);
+			}
+#endif
+#endif
+			mp->dsmresidual[c] = a;
+		}
+
+		buf += OSR * PWM_STEP;
+#else
+		((volatile int16_t *) buf)[s * 2] = l / 65536;
+		((volatile int16_t *) buf)[s * 2 + 1] = r / 65536;
 #endif
 	}
 
-	return &mp;
+	mp->samplepos += len;
+
+	return mp;
 }
 
-ModPlayerStatus_t *InitMOD(const uint8_t *mod, uint32_t samplerate) {
-	// Hardcoded for 4-channel ProTracker MODs only
-	// Verify signature (M.K. or M!K!)
-	uint32_t signature = mod[1083] | (mod[1082] << 8) | (mod[1081] << 16) | (mod[1080] << 24);
-	if(signature != 0x4D2E4B2E && signature != 0x4D214B21) {
-		return NULL;  // Only accept 4-channel ProTracker MODs
+static const uint8_t output_size[4] = { 2, 4, 1, 2 };  // Bytes per value of MOD_FORMAT_*
+
+ModOutput_t *InitMODOutput(ModOutput_t *out, int format, int channels, int osr, int bits) {
+	memset(out, 0, sizeof(*out));
+
+	if(format < MOD_FORMAT_S16 || format > MOD_FORMAT_PWM16 || channels < 1 || channels > 2)
+		return NULL;
+
+	if(format >= MOD_FORMAT_PWM8) {
+		// One modulator per channel
+		if(osr < 1 || osr > 255 || bits < 1 || bits > 8 * output_size[format])
+			return NULL;
+
+		out->osr = osr;
+		out->bits = bits;
 	}
 
-	memset(&mp, 0, sizeof(mp));
+	out->format = format;
+	out->channels = channels;
+	out->last[0] = out->last[1] = 32768;  // Ramps start from silence
 
-	mp.channels = 4;  // Hardcoded to 4 channels
+	return out;
+}
 
-	mp.samplerate = samplerate;
-	mp.paularate = (3546895 / samplerate) << 16;
+static void _PullFrameMOD(ModPlayerStatus_t *mp, ModOutput_t *out) {
+	// Renders the next frame into `out->frame`, as 16-bit values
+	int32_t l, r;
 
-	mp.orders = mod[950];
-	mp.ordertable = mod + 952;
+	if(out->channels == 2) {
+		_FrameMOD(mp, mp->samplepos, &l, &r, 1);
 
-	mp.maxpattern = 0;
+		out->frame[0] = l / 65536;
+		out->frame[1] = r / 65536;
+	} else {
+		_FrameMOD(mp, mp->samplepos, &l, &r, 0);
 
-	for(int i = 0; i < 128; i++) {
-		if(mp.ordertable[i] >= mp.maxpattern) mp.maxpattern = mp.ordertable[i];
+		out->frame[0] = (l * 32768) >> 16;  // 131072 / 2 channels, as in RenderMOD()
 	}
-	mp.maxpattern++;
 
-	const int8_t *samplemem = ((const int8_t *) mod) + 1084 + 64 * 4 * 4 * mp.maxpattern;  // 4 channels hardcoded
-	mp.patterndata = mod + 1084;
+	mp->samplepos++;
+}
 
-	mp.sampleheaders = (SampleHeader_t *) (mod + 20);
+static inline void _PutValue(volatile uint8_t *p, int format, int32_t v) {
+	switch(format) {
+		case MOD_FORMAT_S16:   *(volatile int16_t *) p = v; break;
+		case MOD_FORMAT_FLOAT: *(volatile float *) p = v * (1.0f / 32768); break;
+		case MOD_FORMAT_PWM8:  *p = v; break;
+		case MOD_FORMAT_PWM16: *(volatile uint16_t *) p = v; break;
+	}
+}
 
-	for(int i = 0; i < 31; i++) {
-		const SampleHeader_t *sample = mp.sampleheaders + i;
+static inline int32_t _PullValue(ModOutput_t *out, int c, int k) {
+	// Value `k` of channel `c` in the current frame
+	if(!out->osr)
+		return out->frame[c];
 
-		uint16_t length = (sample->lengthhi << 8) | sample->lengthlo;
-		uint16_t looppoint = (sample->looppointhi << 8) | sample->looppointlo;
-		mp.samples[i].actuallength = (sample->looplengthhi << 8) | sample->looplengthlo;
+	// Delta-sigma modulation of the 16-bit frame to `bits`, as in RenderMOD()
+	uint32_t sample16 = (out->frame[c] + 32768) & 0xFFFF;
+	uint32_t x = sample16 << 8;  // 16.8 fixed point
 
-		mp.samples[i].data = samplemem;
-		samplemem += length * 2;
+	if(out->ramp) {
+		int32_t d = ((int32_t) sample16 - out->last[c]) * 256 / out->osr;
 
-		mp.samples[i].actuallength += looppoint;
+		x = ((uint32_t) out->last[c] << 8) + (k + 1) * d;
 
-		if(mp.samples[i].actuallength < 0x2) {
-			mp.samples[i].actuallength = length;
-			looppoint = 0xFFFF;
-			mp.samples[i].looplength = 0;
-		} else if(mp.samples[i].actuallength > length) {
-			looppoint /= 2;
-			mp.samples[i].actuallength -= looppoint;
-			mp.samples[i].looplength = mp.samples[i].actuallength - looppoint;
-		} else {
-			mp.samples[i].looplength = mp.samples[i].actuallength - looppoint;
-		}
+		if(k == out->osr - 1)
+			out->last[c] = sample16;
 	}
 
-	mp.maxtick = mp.speed = 6; mp.audiospeed = mp.samplerate / 50;
+	uint32_t f = (out->bits < 16) ? x << (8 + out->bits) : 0;
 
-	for(int i = 0; i < 4; i++) {  // Hardcoded 4 channels
-		mp.ch[i].samplegen.age = INT32_MAX;
+	out->residual[c] += f;
+	return (x >> (24 - out->bits)) + (out->residual[c] < f);
+}
+
+int PullMOD(ModPlayerStatus_t *mp, ModOutput_t *out, volatile void *buf, volatile void *buf2, int count) {
+	volatile uint8_t *dst = buf, *dst2 = buf2;
+	int stride = out->stride ? out->stride : output_size[out->format];
+	int planar = out->planar && out->channels == 2;
+	int interleaved = out->channels == 2 && !planar;
+	int values = (out->osr ? out->osr : 1) << interleaved;
+
+	for(int n = 0; n < count; n++) {
+		if(out->pending == 0) {
+			_PullFrameMOD(mp, out);
+			out->pending = values;
+		}
+
+		int i = values - out->pending--;  // Index of the value in its frame
+		int c = interleaved ? i & 1 : 0;  // and its channel
+
+		_PutValue(dst, out->format, _PullValue(out, c, i >> interleaved));
+		dst += stride;
+
+		if(planar) {
+			_PutValue(dst2, out->format, _PullValue(out, 1, i));
+			dst2 += stride;
+		}
 	}
 
-	return &mp;
+	return count;
 }
 
-ModPlayerStatus_t *JumpMOD(int order) {
-	int neworder = mp.order;
+ModPlayerStatus_t *InitMOD(ModPlayerStatus_t *mp, const ModFile_t *mod, uint32_t size, uint32_t samplerate) {
+	memset(mp, 0, sizeof(*mp));
+
+	mp->samplerate = samplerate;
+	mp->temposcale = mp->pitchscale = 0x10000;
+	_RecalculatePaulaRate(mp);
+	SetGainMOD(mp, 0x10000);
+
+#if USE_DSM_INTERPOLATION
+	// The first ramp starts from silence
+	for(int c = 0; c < (USE_STEREO_PWM ? 2 : 1); c++)
+		mp->dsmlast[c] = 32768;
+#endif
+
+#if EVENT_QUEUE_SIZE
+	mp->eventmask = 0xFFFFFFFF;
+#endif
 
-	ModPlayerStatus_t old_mp = mp;
+	if(!_LoadMOD(mp, mod, size))
+		return NULL;
 
-	memset(&mp, 0, sizeof(mp));
+	return mp;
+}
 
-	mp.orders = old_mp.orders;
-	mp.maxpattern = old_mp.maxpattern;
-	mp.samplerate = old_mp.samplerate;
-	mp.paularate = old_mp.paularate;
+#if USE_SAMPLE_BANK
+void SetSampleBankMOD(const int8_t *bank, uint32_t size) {
+	_bank = bank;
+	_banksize = bank ? size : 0;
+}
+#endif
 
-	mp.channels = old_mp.channels;
-	mp.sampleheaders = old_mp.sampleheaders;
+ModPlayerStatus_t *QueueMOD(ModPlayerStatus_t *mp, const ModFile_t *mod, uint32_t size, int mode, uint32_t gain) {
+	mp->nextmode = mode;
+	mp->nextsize = size;
+	mp->nextgain = gain;
+	__atomic_store_n(&mp->nextmod, mod, __ATOMIC_RELEASE);
 
-	mp.patterndata = old_mp.patterndata;
-	mp.ordertable = old_mp.ordertable;
+	return mp;
+}
 
-	memcpy(mp.samples, old_mp.samples, sizeof(mp.samples));
+ModPlayerStatus_t *CrossfadeMOD(ModPlayerStatus_t *mp, ModPlayerStatus_t *from, uint32_t samples) {
+	if(samples == 0) samples = 1;
 
-	mp.maxtick = mp.speed = 6; mp.audiospeed = mp.samplerate / 50;
+	// Continue the output stream of the instance being faded out
+	mp->samplepos = from->samplepos;
+	memcpy(mp->dsmresidual, from->dsmresidual, sizeof(mp->dsmresidual));
+#if USE_DSM_INTERPOLATION
+	memcpy(mp->dsmlast, from->dsmlast, sizeof(mp->dsmlast));
+#endif
 
-	for(int i = 0; i < 4; i++) {  // Hardcoded 4 channels
-		mp.ch[i].samplegen.age = INT32_MAX;
-	}
+	// Gain of `from` relative to ours, at most 1.5x so that the blend in
+	// _CrossfadeMOD() cannot overflow
+	mp->faderatio = (from->mixgain << 11) / mp->mixgain;
+	if(mp->faderatio > 3072)
+		mp->faderatio = 3072;
+
+	mp->fadegain = 0;
+	mp->fadestep = (1 << 30) / samples;
+	if(mp->fadestep == 0) mp->fadestep = 1;
+
+	__atomic_store_n(&mp->fadefrom, from, __ATOMIC_RELEASE);
+
+	return mp;
+}
+
+ModPlayerStatus_t *SetTempoMOD(ModPlayerStatus_t *mp, uint32_t scale) {
+	if(scale < 0x100) scale = 0x100;
+	if(scale > 0x40000) scale = 0x40000;
+
+	mp->temposcale = scale;
+	_RecalculateTempo(mp);
+
+	return mp;
+}
+
+ModPlayerStatus_t *SetPitchMOD(ModPlayerStatus_t *mp, uint32_t scale) {
+	if(scale < 0x1000) scale = 0x1000;
+	if(scale > 0x40000) scale = 0x40000;
+
+	mp->pitchscale = scale;
+	_RecalculatePaulaRate(mp);
+
+	return mp;
+}
+
+ModPlayerStatus_t *SetGainMOD(ModPlayerStatus_t *mp, uint32_t gain) {
+	if(gain < 0x1000) gain = 0x1000;
+	if(gain > 0x80000) gain = 0x80000;
+
+	// Clip until the next tick checks the headroom at the new gain
+	mp->saturate = 1;
+	mp->gain = gain;
+	__atomic_store_n(&mp->mixgain, gain >> 5, __ATOMIC_RELEASE);
+
+	return mp;
+}
+
+#if EVENT_QUEUE_SIZE
+int PollEventMOD(ModPlayerStatus_t *mp, ModEvent_t *ev) {
+	uint8_t tail = mp->eventtail;
+
+	if(tail == __atomic_load_n(&mp->eventhead, __ATOMIC_ACQUIRE))
+		return 0;
+
+	*ev = mp->events[tail & (EVENT_QUEUE_SIZE - 1)];
+
+	// Hand the slot back to the producer only after it has been copied
+	__atomic_store_n(&mp->eventtail, tail + 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+ModPlayerStatus_t *SetEventMaskMOD(ModPlayerStatus_t *mp, uint32_t mask) {
+	mp->eventmask = mask;
+
+	return mp;
+}
+#endif
+
+ModPlayerStatus_t *JumpMOD(ModPlayerStatus_t *mp, int order) {
+	int neworder = mp->order;
+
+#if EVENT_QUEUE_SIZE
+	// Do not report the rows skipped over while seeking
+	uint32_t eventmask = mp->eventmask;
+	mp->eventmask = 0;
+#endif
+
+	// Keep a queued song aside, so that the seek does not switch to it
+	const ModFile_t *nextmod = __atomic_exchange_n(&mp->nextmod, NULL, __ATOMIC_ACQUIRE);
+
+	_LoadMOD(mp, mp->mod, mp->size);
 
 	switch(order) {
 		case -2:
@@ -682,27 +1973,223 @@ ModPlayerStatus_t *JumpMOD(int order) {
 			break;
 
 		case -1:
-			if(neworder < mp.orders - 1) neworder++;
+			if(neworder < mp->orders - 1) neworder++;
 			break;
 
 		default:
 			if(order < 0) order = 0;
-			if(order >= mp.orders) order = mp.orders - 1;
+			if(order >= mp->orders) order = mp->orders - 1;
 
 			neworder = order;
 			break;
 	}
 
-	int oldorder = 0;
+	// Stop if the song loops back before it gets there (also by jumping to
+	// its own order), and after as many ticks as LengthMOD() walks at most
+	for(int ticks = 0; mp->order < neworder && !mp->loops && ticks < (1 << 20); ticks++)
+		ProcessMOD(mp);
+
+#if EVENT_QUEUE_SIZE
+	mp->eventorder = -1;
+	mp->eventmask = eventmask;
+#endif
+
+	__atomic_store_n(&mp->nextmod, nextmod, __ATOMIC_RELEASE);
+
+	return mp;
+}
+
+ModPlayerStatus_t *SaveMOD(ModPlayerStatus_t *mp, ModSnapshot_t *snap) {
+	// Cleared first, so that the padding of equal states is equal too
+	memset(snap, 0, sizeof(*snap));
+
+	snap->version = MOD_SNAPSHOT_VERSION;
+	snap->size = mp->size;
+	snap->samplerate = mp->samplerate;
+
+	snap->samplepos = mp->samplepos;
+	snap->audiotick = mp->audiotick;
+	snap->audiotickerr = mp->audiotickerr;
+	snap->random = mp->random;
+	snap->loops = mp->loops;
+	snap->temposcale = mp->temposcale;
+	snap->pitchscale = mp->pitchscale;
+
+	snap->tick = mp->tick;
+	snap->maxtick = mp->maxtick;
+	snap->order = mp->order;
+	snap->row = mp->row;
+	snap->speed = mp->speed;
+	snap->bpm = mp->bpm;
+	snap->skiporderrequest = mp->skiporderrequest;
+	snap->skiporderdestrow = mp->skiporderdestrow;
+	snap->patlooprow = mp->patlooprow;
+	snap->patloopcycle = mp->patloopcycle;
+	snap->ledfilter = mp->ledfilter;
+
+	for(int c = 0; c < (USE_STEREO_PWM ? 2 : 1); c++) {
+		snap->dsmresidual[c] = mp->dsmresidual[c];
+#if USE_DSM_INTERPOLATION
+		snap->dsmlast[c] = mp->dsmlast[c];
+#endif
+	}
+
+	for(int i = 0; i < 4; i++) {  // Hardcoded 4 channels
+		const PaulaChannel_t *pch = &mp->paula[i];
+		ModSnapshotChannel_t *sch = &snap->paula[i];
+
+		// A channel only ever plays the sample of its tracker channel, see
+		// _DecodeCellMOD(), so the sample is not saved
+		sch->playing = pch->sample != NULL;
+		sch->currentptr = pch->currentptr;
+		sch->currentsubptr = pch->currentsubptr;
+		sch->period = pch->period;
+		sch->age = pch->age;
+		sch->volume = pch->volume;
+		sch->muted = pch->muted;
+	}
 
-	while(mp.order < neworder) {
-		ProcessMOD();
+	memcpy(snap->ch, mp->ch, sizeof(snap->ch));
 
-		if(oldorder > mp.order)
-			break;
-		else
-			oldorder = mp.order;
+	return mp;
+}
+
+ModPlayerStatus_t *RestoreMOD(ModPlayerStatus_t *mp, const ModSnapshot_t *snap) {
+	if(snap->version != MOD_SNAPSHOT_VERSION || snap->size != mp->size || snap->samplerate != mp->samplerate)
+		return NULL;
+
+	// What addresses the song or divides must be in range, see InitMOD()
+	if(snap->order >= mp->orders || snap->row >= 0x40 || snap->skiporderrequest >= mp->orders ||
+	   snap->skiporderdestrow >= 0x40 || snap->patlooprow >= 0x40 ||
+	   !snap->speed || snap->tick >= snap->maxtick || snap->bpm < 0x20 ||
+	   snap->temposcale < 0x100 || snap->temposcale > 0x40000 ||
+	   snap->pitchscale < 0x1000 || snap->pitchscale > 0x40000)
+		return NULL;
+
+	for(int i = 0; i < 4; i++)  // Hardcoded 4 channels
+		if(snap->ch[i].sample >= 31)
+			return NULL;
+
+	// Start over as JumpMOD() does: clears the channels, the cells decoded
+	// ahead and, with USE_STORAGE, the blocks and stream windows
+	_LoadMOD(mp, mp->mod, mp->size);
+
+	mp->fadefrom = NULL;
+
+	mp->samplepos = snap->samplepos;
+	mp->audiotick = snap->audiotick;
+	mp->audiotickerr = snap->audiotickerr;
+	mp->random = snap->random;
+	mp->loops = snap->loops;
+	mp->temposcale = snap->temposcale;
+	mp->pitchscale = snap->pitchscale;
+
+	mp->tick = snap->tick;
+	mp->maxtick = snap->maxtick;
+	mp->order = snap->order;
+	mp->row = snap->row;
+	mp->speed = snap->speed;
+	mp->bpm = snap->bpm;
+	mp->skiporderrequest = snap->skiporderrequest;
+	mp->skiporderdestrow = snap->skiporderdestrow;
+	mp->patlooprow = snap->patlooprow;
+	mp->patloopcycle = snap->patloopcycle;
+	mp->ledfilter = snap->ledfilter;
+
+	_RecalculateTempo(mp);
+	_RecalculatePaulaRate(mp);
+
+	for(int c = 0; c < (USE_STEREO_PWM ? 2 : 1); c++) {
+		mp->dsmresidual[c] = snap->dsmresidual[c];
+#if USE_DSM_INTERPOLATION
+		mp->dsmlast[c] = snap->dsmlast[c];
+#endif
+	}
+
+	memcpy(mp->ch, snap->ch, sizeof(snap->ch));
+
+	for(int i = 0; i < 4; i++) {  // Hardcoded 4 channels
+		PaulaChannel_t *pch = &mp->paula[i];
+		const ModSnapshotChannel_t *sch = &snap->paula[i];
+
+		if(sch->playing)
+			_SetSampleMOD(mp, pch, mp->ch[i].sample, 1);
+
+		pch->currentptr = sch->currentptr;
+		pch->currentsubptr = sch->currentsubptr;
+		pch->period = sch->period;
+		pch->age = sch->age;
+		pch->volume = sch->volume;
+		pch->muted = sch->muted;
+	}
+
+#if USE_MONO_OUTPUT
+	_HeadroomMOD(mp);  // The restored tick has already been processed
+#endif
+
+#if EVENT_QUEUE_SIZE
+	mp->eventorder = -1;
+#endif
+
+	return mp;
+}
+
+uint32_t LengthMOD(ModPlayerStatus_t *mp, const ModFile_t *mod, uint32_t size, uint32_t samplerate) {
+	if(!InitMOD(mp, mod, size, samplerate))
+		return 0;
+
+#if EVENT_QUEUE_SIZE
+	mp->eventmask = 0;
+#endif
+
+	// Walk the song tick by tick without rendering, until it loops back.
+	// The tick in which the loop is detected is still part of the song
+	uint32_t length = 0;
+
+	for(int ticks = 0; !mp->loops && ticks < (1 << 20); ticks++) {
+		_ProcessTickMOD(mp, length);
+		length += mp->audiotick;
 	}
 
-	return &mp;
+	return length;
+}
+
+uint32_t GainMOD(ModPlayerStatus_t *mp, const ModFile_t *mod, uint32_t size, uint32_t samplerate) {
+	uint32_t length = LengthMOD(mp, mod, size, samplerate);
+
+	if(!length || !InitMOD(mp, mod, size, samplerate))
+		return 0;
+
+#if EVENT_QUEUE_SIZE
+	mp->eventmask = 0;
+#endif
+
+	// Mix the song up to its loop point at unity gain, as RenderMOD() does,
+	// and find the largest level on either side
+	int32_t peak = 1;
+
+	for(uint32_t s = 0; s < length; s++) {
+		int32_t l, r;
+
+		_FrameMOD(mp, s, &l, &r, USE_STEREO_PWM);
+
+#if USE_STEREO_PWM
+		l /= 65536;
+		r /= 65536;
+#else
+		l = r = (l * 32768) >> 16;
+#endif
+
+		if(l < 0) l = -l;
+		if(r < 0) r = -r;
+		if(l > peak) peak = l;
+		if(r > peak) peak = r;
+	}
+
+	uint32_t gain = ((uint64_t) PWM_PEAK << 16) / peak;
+
+	if(gain < 0x1000) gain = 0x1000;
+	if(gain > 0x80000) gain = 0x80000;
+
+	return gain;
 }
@@ -2,46 +2,104 @@
 #define MODPLAY_H_INCLUDED
 #include <stdint.h>
 
+// Bytes of SRAM per player instance for caching sample loops, 0 disables the cache.
+// Looping samples are then played from SRAM instead of flash once they reach
+// their loop, see InitMOD()
+#ifndef SAMPLE_CACHE_SIZE
+#define SAMPLE_CACHE_SIZE 0
+#endif
+
+// Set to 1 to read songs through a ModStorage_t (e.g. from SPI flash or an
+// SD card) instead of from memory, see InitMOD()
+#ifndef USE_STORAGE
+#define USE_STORAGE 0
+#endif
+
+// Set to 1 to also play songs packed by tools/modbank, which keep their
+// sample data in a bank shared by several songs, see SetSampleBankMOD()
+#ifndef USE_SAMPLE_BANK
+#define USE_SAMPLE_BANK 0
+#endif
+
+#if USE_STORAGE
+// Block cache for the song structure (headers and patterns), per player instance
+#ifndef STORAGE_BLOCK_SIZE
+#define STORAGE_BLOCK_SIZE 64
+#endif
+
+#ifndef STORAGE_BLOCKS
+#define STORAGE_BLOCKS 4
+#endif
+
+// Bytes of sample data buffered per channel
+#ifndef STREAM_WINDOW
+#define STREAM_WINDOW 64
+#endif
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Sampler state of a channel, read and written by the mixer for every output
+// sample. The fields used on every sample come first
 typedef struct {
 	const int8_t *sample;
-	uint32_t age;
 	uint32_t currentptr;
+	int32_t currentsubptr; // only lower 16 bits are used in generation
+	uint32_t period;
 	uint32_t length;
 	uint32_t looplength;
-	uint32_t period;
-	int32_t volume;
-	int32_t currentsubptr; // only lower 16 bits are used in generation
+	uint32_t age;
+	uint8_t volume;
 	int8_t muted;
-} PaulaChannel_t;
-
-typedef struct {
+#if SAMPLE_CACHE_SIZE
+	// Start of the sample in the MOD file. In the loop of a cached sample
+	// `sample` points to the copy in SRAM instead, offset so that the loop
+	// indices stay the same: only indices in the loop may be read then
 	const int8_t *data;
-	uint16_t actuallength;
-	uint16_t looplength;
-} Sample_t;
+#endif
+#if USE_STORAGE
+	// Offset of the sample in the song, and the part of the song held in the
+	// stream window of the channel. `sample` points into the window, offset
+	// so that only indices within it may be read
+	uint32_t offset;
+	uint32_t windowstart, windowend;
+#endif
+} PaulaChannel_t;
 
 typedef struct {
-	int32_t val;
+	int16_t val;
 	uint8_t waveform;
 	uint8_t phase;
 	uint8_t speed;
 	uint8_t depth;
 } Oscillator_t;
 
+// Tracker state of a channel, only used by ProcessMOD() once per tick
 typedef struct {
-	uint32_t note;
-	uint8_t sample, eff, effval;
+	int32_t period;
+	int16_t note, slidenote;
+	int16_t volume;
 
+	uint8_t sample, eff, effval;
 	uint8_t slideamount, sampleoffset;
-	short volume;
-	int32_t slidenote;
-
-	int32_t period;
 
 	Oscillator_t vibrato, tremolo;
-	PaulaChannel_t samplegen;
 } TrackerChannel_t;
 
+// Pattern cell of a channel decoded for the first tick of its row, with what
+// it needs from the sample headers
+typedef struct {
+	const int8_t *data;       // Sample data, if `relocate` (not with USE_STORAGE)
+	uint32_t length, looplength;  // Sampler setup of `sample`, bytes
+	int16_t note;             // Period of the cell, 0 = none
+	int16_t period;           // and with the finetune applied
+	uint8_t sample;           // 1..31, 0 = none
+	uint8_t relocate;         // The channel switches to another sample
+	uint8_t volume, eff, effval;
+} ModCell_t;
+
 typedef struct /*__attribute__((packed))*/ {
 	char name[22];
 	uint8_t lengthhi;
@@ -54,38 +112,432 @@ typedef struct /*__attribute__((packed))*/ {
 	uint8_t looplengthlo;
 } SampleHeader_t;
 
+// Channels allocated per player instance, only 4-channel MODs are played
 #ifndef CHANNELS
-#define CHANNELS 32
+#define CHANNELS 4
 #endif
 
+// Set to 1 together with USE_MONO_OUTPUT (modplay.c) for stereo delta-sigma PWM
+// output: two modulators, one per timer compare channel, see RenderMOD()
+#ifndef USE_STEREO_PWM
+#define USE_STEREO_PWM 0
+#endif
+
+// Set to 1 together with USE_MONO_OUTPUT to ramp linearly from one mixed sample
+// to the next across the OSR duty values of the delta-sigma modulator, instead
+// of holding each sample. The player can then mix at a lower rate for the same
+// PWM rate, e.g. 11025 Hz with OSR 16 instead of 22050 Hz with OSR 8
+#ifndef USE_DSM_INTERPOLATION
+#define USE_DSM_INTERPOLATION 0
+#endif
+
+// Set to 1 to decode the cells of the next row on the ticks before it, so
+// that the first tick of a row only applies them, see ProcessMOD()
+#ifndef USE_ROW_PREDECODE
+#define USE_ROW_PREDECODE 0
+#endif
+
+// Number of entries in the event queue, must be a power of two (0 disables events)
+#ifndef EVENT_QUEUE_SIZE
+#define EVENT_QUEUE_SIZE 8
+#endif
+
+enum {
+	MOD_EVENT_ROW,      // a new row starts, `value` is unused
+	MOD_EVENT_ORDER,    // a new order starts, `value` is the pattern number
+	MOD_EVENT_SYNC,     // 8xx effect on `channel`, `value` is xx
+	MOD_EVENT_SYNC_E8,  // E8x effect on `channel`, `value` is x
+};
+
+#if USE_STORAGE
+typedef struct ModStorage {
+	// Reads `len` bytes at `offset` of the MOD file into `buf`, returns 0 on
+	// failure. Called from RenderMOD(), so it must not block for long. Cache
+	// blocks are read whole and may reach past the end of the file
+	int (*read)(const struct ModStorage *st, uint32_t offset, void *buf, uint32_t len);
+	void *user;         // free for the read function
+} ModStorage_t;
+
+// A song is passed as its storage
+typedef ModStorage_t ModFile_t;
+#else
+// A song is passed as the MOD file in memory
+typedef uint8_t ModFile_t;
+#endif
+
+typedef struct {
+	uint32_t timestamp; // output sample at which the event becomes audible
+	uint8_t type, channel, order, row, value;
+} ModEvent_t;
+
+enum {
+	MOD_SWITCH_END,     // switch when the current song loops back
+	MOD_SWITCH_ORDER,   // switch at the next order boundary
+};
+
+// Output formats of PullMOD()
+enum {
+	MOD_FORMAT_S16,     // signed 16-bit PCM
+	MOD_FORMAT_FLOAT,   // 32-bit float PCM, full scale is +-1.0
+	MOD_FORMAT_PWM8,    // delta-sigma modulated PWM duty values, 8 bits per value
+	MOD_FORMAT_PWM16,   // the same with 16 bits per value, e.g. for 16-bit DMA transfers
+};
+
+typedef struct {
+	// Format, set up by InitMODOutput()
+	uint8_t format, channels, osr, bits;
+
+	// Layout, may be changed by the caller after InitMODOutput()
+	uint8_t planar;     // stereo: left and right go to separate buffers
+	int16_t stride;     // bytes from one value to the next in a buffer, 0 = packed
+	uint8_t ramp;       // PWM formats: ramp between frames as USE_DSM_INTERPOLATION does
+
+	// Frame being written, so that frames can be split across calls
+	uint8_t pending;    // values of the frame still to be written
+	int16_t frame[2];
+	uint32_t residual[2];  // delta-sigma accumulators of the PWM formats, per channel
+	uint16_t last[2];   // previous frame of `ramp`, unsigned 16-bit
+} ModOutput_t;
+
+// Layout version of ModSnapshot_t, RestoreMOD() rejects other versions
+#define MOD_SNAPSHOT_VERSION 1
+
+// Sampler state of a channel in a snapshot. A playing channel plays the
+// sample of its tracker channel, whose length and loop come from the song
+typedef struct {
+	uint32_t currentptr, period, age;
+	uint16_t currentsubptr;
+	uint8_t volume, playing;
+	int8_t muted;
+} ModSnapshotChannel_t;
+
+// Playback state of an instance, see SaveMOD(). Plain data of fixed size
+// without pointers, to be kept in flash or backup memory by the caller
 typedef struct {
+	uint32_t version;   // MOD_SNAPSHOT_VERSION
+	uint32_t size, samplerate;  // song and output rate of the instance
+
+	// Song position and timing
+	uint32_t samplepos, audiotick, audiotickerr, random, loops;
+	uint32_t temposcale, pitchscale;
+	uint16_t tick, maxtick;
+	uint8_t order, row, speed, bpm;
+	int8_t skiporderrequest;
+	uint8_t skiporderdestrow, patlooprow, patloopcycle, ledfilter;
+
+	// Delta-sigma modulators, the second one for USE_STEREO_PWM
+	uint16_t dsmlast[2];
+	uint32_t dsmresidual[2];
+
+	ModSnapshotChannel_t paula[4];
+	TrackerChannel_t ch[4];
+} ModSnapshot_t;
+
+typedef struct ModPlayerStatus {
+	// Mixer state, kept together at the start of the instance
+	PaulaChannel_t paula[CHANNELS];
+	uint32_t audiotick, samplepos;
+
+	// Delta-sigma residual accumulators for PWM output, left and right with USE_STEREO_PWM
+	uint32_t dsmresidual[USE_STEREO_PWM ? 2 : 1];
+#if USE_DSM_INTERPOLATION
+	uint16_t dsmlast[USE_STEREO_PWM ? 2 : 1];  // previous mixed sample, unsigned 16-bit
+#endif
+
+	// Gain of the PWM output in 1/2048 (see SetGainMOD), and whether the
+	// mix can leave the output range before the next tick
+	int32_t mixgain;
+	int saturate;
+
+	// Crossfading (CrossfadeMOD)
+	struct ModPlayerStatus *fadefrom;
+	uint32_t fadegain, fadestep;
+	int32_t faderatio;  // gain of `fadefrom` over this instance's, in 1/2048
+
+	// Tracker state, only used once per tick
 	int channels, orders, maxpattern, order, row, tick, maxtick, speed,
 		skiporderrequest, skiporderdestrow,
 		patlooprow, patloopcycle;
 
-	uint32_t samplerate, paularate, audiospeed, audiotick, random;
+	int loops;  // number of times the song has looped back since it started
+	int ledfilter;  // Amiga LED filter state as set by E0x, only used by renderers that emulate it
+
+	uint32_t samplerate, paularate, audiospeed, random;
+
+	// Exact tick timing: each tick lasts audiospeed + audiospeedrem / audiospeedden
+	// samples, the remainder is carried in audiotickerr (Bresenham style)
+	uint32_t audiospeedrem, audiospeedden, audiotickerr;
+
+	// Runtime speed and gain control (16.16 fixed point, 0x10000 = 1.0)
+	int bpm;
+	uint32_t temposcale, pitchscale, gain;
+
+	// Output sample at which the tick currently being processed starts,
+	// `samplepos` above counts the output samples rendered since InitMOD
+	uint32_t eventtime;
+
+#if EVENT_QUEUE_SIZE
+	// Single producer (ProcessMOD) / single consumer (PollEventMOD) ring
+	ModEvent_t events[EVENT_QUEUE_SIZE];
+	uint8_t eventhead, eventtail;
+	int eventorder;
+	uint32_t eventmask, eventsdropped;
+#endif
+
+	// Song switching (QueueMOD), file lengths in bytes and the gain of the
+	// queued song (0 keeps the current one)
+	const ModFile_t *mod, *nextmod;
+	uint32_t size, nextsize, nextgain;
+	int nextmode;
+
+	// Samples whose data runs past the end of the file (bit n for sample n),
+	// their lengths and loops are cut to the file by _SetSampleMOD()
+	uint32_t truncated;
+
+#if USE_SAMPLE_BANK
+	int banked;  // the samples of the song are in the sample bank
+#endif
 
 	TrackerChannel_t ch[CHANNELS];
 
+#if USE_ROW_PREDECODE
+	// The first `decoded` cells of the row at `decodedorder`/`decodedrow`,
+	// decoded ahead, and the cells decoded since InitMOD (for tools/modcost)
+	ModCell_t nextrow[4];
+	int decoded, decodedorder, decodedrow;
+	uint32_t cellsdecoded;
+#endif
+
+#if SAMPLE_CACHE_SIZE
+	// Copies of the loops of the most played looping samples, and the offset
+	// of each sample's loop in `samplecache` (-1 if not cached)
+	int8_t samplecache[SAMPLE_CACHE_SIZE];
+	int16_t cacheoffset[31];
+#endif
+
+	// Sample addresses and loops are looked up in the headers of the
+	// MOD file when a channel switches samples, they are not copied
 	const uint8_t *patterndata, *ordertable;
 	const SampleHeader_t *sampleheaders;
-	Sample_t samples[31];
+
+#if USE_STORAGE
+	// Copies of what is read on every row, and the offset of every sample
+	// in the song (`patterndata` and `sampleheaders` are unused)
+	uint8_t orderbuf[128];
+	uint32_t sampledata[31];
+
+	// Next row, fetched one row ahead (`rowtag` is 64 * pattern + row + 1, 0 = empty)
+	uint8_t rowbuf[16];
+	uint32_t rowtag;
+
+	// Block cache, `blocktag` is the block number + 1 (0 = empty)
+	uint8_t blocks[STORAGE_BLOCKS][STORAGE_BLOCK_SIZE];
+	uint32_t blocktag[STORAGE_BLOCKS];
+	uint8_t blocknext;
+
+	// Stream windows of the channels, and samples to go until one needs to be refilled
+	int8_t window[CHANNELS][STREAM_WINDOW];
+	uint32_t streamtick;
+
+	// Statistics: block cache hits and misses, window fills, storage reads
+	// that failed (their data reads as zero)
+	uint32_t blockhits, blockmisses, windowfills, readerrors;
+#endif
 } ModPlayerStatus_t;
 
 /*
- * ModPlayerStatus_t *InitMOD(const uint8_t *mod, uint32_t samplerate);
+ * All functions operate on a player instance owned by the caller, so that
+ * several songs can be played (or rendered offline) at the same time.
+ */
+
+/*
+ * ModPlayerStatus_t *InitMOD(ModPlayerStatus_t *mp, const ModFile_t *mod, uint32_t size, uint32_t samplerate);
  * 
- * Initializes the MOD player with the given mod file and samplerate.
+ * Initializes the player instance `*mp` with the given mod file of `size`
+ * bytes and samplerate. Returns `mp`, or NULL if the file is not a 4-channel
+ * ProTracker MOD, has no orders, or ends before the last pattern.
+ *
+ * Everything else in the file is made safe to play here, once: the order
+ * count is limited to 128, samples that run past the end of the file are
+ * cut to it, and so are their loops (a loop that starts past the new end is
+ * dropped). Pattern breaks to rows past 63 go to row 0, and sample offsets
+ * (9xx) past the end of a loop start inside it. The player then never reads
+ * outside the file, even for untrusted files, and every channel keeps
+ * `looplength` either 0 or within `length`, and `currentptr < length` after
+ * WrapChannelMOD(). The mixers rely on this instead of checking bounds.
+ *
+ * With USE_STORAGE, `mod` is a ModStorage_t that the song is read from,
+ * here and in every other function that takes a song, and `size` the
+ * length of the song in the storage. Only the order table and the sample
+ * offsets are kept in the instance. Patterns and sample headers go through
+ * a cache of STORAGE_BLOCKS blocks, and each row is fetched on the tick
+ * before it is played. Every channel streams its sample into a window of
+ * STREAM_WINDOW bytes. A refill is due when the channel's step has carried
+ * it past the window. A loop that fits into the window together with the
+ * read position is kept there. Requires USE_LINEAR_INTERPOLATION=0, the
+ * interpolation partner of the last sample of a loop lies outside the
+ * window.
+ *
+ * With SAMPLE_CACHE_SIZE, the loops of the looping samples that are
+ * triggered most often in the song are copied to SRAM, as many as fit.
+ * Loading a different song (also through QueueMOD()) refills the cache,
+ * which scans all patterns of the song once.
+ *
+ * With USE_SAMPLE_BANK, songs packed by tools/modbank are accepted as well.
+ * They carry the signature MOD_BANK_SIGNATURE and end after the last
+ * pattern, and their sample headers give the offset of the sample data in
+ * the bank set with SetSampleBankMOD(). Samples that run past the end of
+ * the bank are cut to it like those of a plain MOD to the end of its file.
+ * Not with USE_STORAGE.
  */
 
-ModPlayerStatus_t *InitMOD(const uint8_t *mod, uint32_t samplerate);
+ModPlayerStatus_t *InitMOD(ModPlayerStatus_t *mp, const ModFile_t *mod, uint32_t size, uint32_t samplerate);
+
+#if USE_SAMPLE_BANK
+
+// Signature of a song packed by tools/modbank, in place of M.K.: the last 4
+// bytes of the name of each sample header hold the offset of its data in
+// the sample bank (big-endian), and the length and loop are those played
+#define MOD_BANK_SIGNATURE 0x42414E4B  // "BANK"
+
+/*
+ * void SetSampleBankMOD(const int8_t *bank, uint32_t size);
+ *
+ * Sets the sample bank of `size` bytes that packed songs take their sample
+ * data from, for all instances. Call it before InitMOD() or QueueMOD() with
+ * a packed song; packed songs are rejected while no bank is set.
+ */
+
+void SetSampleBankMOD(const int8_t *bank, uint32_t size);
+
+#endif
+
+/*
+ * ModPlayerStatus_t *QueueMOD(ModPlayerStatus_t *mp, const ModFile_t *mod, uint32_t size, int mode, uint32_t gain);
+ *
+ * Queues another MOD file of `size` bytes to be played by `*mp` without a
+ * gap. It is checked like in InitMOD() when the switch happens.
+ *
+ * With `mode` = MOD_SWITCH_END, the switch happens when the current song
+ * loops back. With MOD_SWITCH_ORDER, it happens at the next order boundary.
+ * Output rate, speed control and event settings carry over to the new song.
+ * So does the gain, unless `gain` is not 0: then it is set with
+ * SetGainMOD() in the switch, so the new song starts at its own gain.
+ * A file that is not a valid MOD is ignored and the current song goes on.
+ *
+ * Safe to call while RenderMOD() runs in an interrupt.
+ */
+
+ModPlayerStatus_t *QueueMOD(ModPlayerStatus_t *mp, const ModFile_t *mod, uint32_t size, int mode, uint32_t gain);
+
+/*
+ * ModPlayerStatus_t *CrossfadeMOD(ModPlayerStatus_t *mp, ModPlayerStatus_t *from, uint32_t samples);
+ *
+ * Starts a linear crossfade from the instance `*from` to `*mp`, lasting
+ * `samples` output samples.
+ *
+ * `*mp` must have been set up with InitMOD(), and its gain set (SetGainMOD())
+ * if it has one: each song fades at its own gain, `*from` at most 1.5x
+ * louder than `*mp`. From now on, only `*mp` is
+ * passed to RenderMOD(), which keeps rendering `*from` underneath until the
+ * fade is over and then clears `mp->fadefrom`. Only after that may `*from`
+ * be reused. Both instances are mixed sample by sample while the fade runs,
+ * so it costs about as much as rendering the two songs on their own (1.9 to
+ * 2.2x a single song with the device configuration, measured on the host).
+ * With the stereo block mixer the fade falls back to the sample-by-sample
+ * mixer, which makes it about 2.6x a single song.
+ */
+
+ModPlayerStatus_t *CrossfadeMOD(ModPlayerStatus_t *mp, ModPlayerStatus_t *from, uint32_t samples);
+
+/*
+ * ModPlayerStatus_t *SetTempoMOD(ModPlayerStatus_t *mp, uint32_t scale);
+ *
+ * Scales the playback tempo without touching the pitch.
+ *
+ * `scale` is a 16.16 fixed point factor applied on top of the song's
+ * own BPM (0x10000 = original tempo, 0x18000 = 1.5x faster).
+ * Valid range is 1/256 to 4x, values outside are clamped. The full
+ * 16-bit fraction is used, the tick length is exact to the sample over time.
+ *
+ * The new tempo takes effect at the next tick. It can be called
+ * continuously, e.g. to follow an external clock.
+ */
+
+ModPlayerStatus_t *SetTempoMOD(ModPlayerStatus_t *mp, uint32_t scale);
+
+/*
+ * ModPlayerStatus_t *SetPitchMOD(ModPlayerStatus_t *mp, uint32_t scale);
+ *
+ * Scales the playback pitch without touching the tempo.
+ *
+ * `scale` is a 16.16 fixed point frequency factor (0x10000 = original
+ * pitch, 0x20000 = one octave up, 69433 = one semitone up).
+ * Valid range is 1/16 to 4x, values outside are clamped.
+ *
+ * The new pitch takes effect at the next tick.
+ */
+
+ModPlayerStatus_t *SetPitchMOD(ModPlayerStatus_t *mp, uint32_t scale);
+
+/*
+ * ModPlayerStatus_t *SetGainMOD(ModPlayerStatus_t *mp, uint32_t gain);
+ *
+ * Scales the PWM output of RenderMOD() (USE_MONO_OUTPUT), e.g. by the
+ * gain GainMOD() found for the song.
+ *
+ * `gain` is a 16.16 fixed point factor (0x10000 = the fixed level of
+ * the mixer, half of full scale in mono). Valid range is 1/16 to 8x,
+ * values outside are clamped. Ticks on which the mix can exceed the
+ * output range at this gain are clipped, the others are converted as
+ * they are, so the gain only costs time where it is needed. The 16-bit
+ * stereo output, PullMOD() and modplay.hpp are not scaled.
+ *
+ * The new gain takes effect at once. It stays set when the instance
+ * switches songs (QueueMOD()) or restores a snapshot.
+ */
+
+ModPlayerStatus_t *SetGainMOD(ModPlayerStatus_t *mp, uint32_t gain);
+
+#if EVENT_QUEUE_SIZE
+
+/*
+ * int PollEventMOD(ModPlayerStatus_t *mp, ModEvent_t *ev);
+ *
+ * Fetches the oldest pending event into `*ev`.
+ * Returns 1 if an event was fetched, 0 if the queue is empty.
+ *
+ * Events are queued by ProcessMOD() on row changes, order changes and
+ * on the 8xx and E8x effects, which are otherwise unused by the player.
+ * The queue is lock-free, so events can be polled from the main loop
+ * while RenderMOD() runs in an interrupt. If the queue is full, new
+ * events are dropped and counted in `eventsdropped`.
+ *
+ * `ev->timestamp` is the position in the output stream (in samples
+ * since InitMOD, see `samplepos`) at which the event becomes audible.
+ * Comparing it against the sample currently read by the output DMA
+ * gives the exact delay until the event should be acted upon.
+ */
+
+int PollEventMOD(ModPlayerStatus_t *mp, ModEvent_t *ev);
+
+/*
+ * ModPlayerStatus_t *SetEventMaskMOD(ModPlayerStatus_t *mp, uint32_t mask);
+ *
+ * Selects which events are queued, bit n enables event type n
+ * (e.g. `1 << MOD_EVENT_SYNC`). All events are enabled by InitMOD().
+ */
+
+ModPlayerStatus_t *SetEventMaskMOD(ModPlayerStatus_t *mp, uint32_t mask);
+
+#endif
 
 #ifndef USING_EXTERNAL_RENDERING
 
 /*
- * ModPlayerStatus_t *RenderMOD(uint8_t *buf, int len);
+ * ModPlayerStatus_t *RenderMOD(ModPlayerStatus_t *mp, uint8_t *buf, int len);
  *
- * Renders a buffer from the MOD given to InitMOD() to `*buf`.
+ * Renders a buffer from the instance `*mp` to `*buf`.
  *
  * NOTE: `len` specifies the number of audio samples, NOT PWM samples or bytes.
  *
@@ -108,16 +560,87 @@ ModPlayerStatus_t *InitMOD(const uint8_t *mod, uint32_t samplerate);
  * (e.g., with OSR=8: len * 8 bytes for 8x oversampled PWM output).
  * All channels are mixed equally without panning, then converted to
  * 8-bit PWM values (0-255) suitable for direct DMA output to a timer.
+ *
+ * STEREO PWM (USE_MONO_OUTPUT=1, USE_STEREO_PWM=1):
+ * The channels are panned as in the 16-bit stereo output, and left and
+ * right run through a delta-sigma modulator each, for two compare channels
+ * of the timer. With PWM_RIGHT_BUFFER=0 (default) the values of both are
+ * interleaved, left first, for one DMA channel that writes both compare
+ * registers in a burst: `*buf` needs `len` * OSR * 2 bytes. Otherwise the
+ * left values fill `len` * OSR bytes at `buf` and the right values the
+ * same number of bytes at `buf` + PWM_RIGHT_BUFFER, for one DMA channel
+ * per compare register.
+ *
+ * With USE_DSM_INTERPOLATION=1, the OSR duty values of a sample ramp from
+ * the previous mixed sample to this one, which delays the output by one
+ * sample. Meant for mixing at a lower rate with a larger OSR.
+ *
+ * With USE_CONSTANT_TIME=1 (set in front of modplay.c), every sample costs
+ * the same whether channels play or not, and loops wrap in bounded time, so
+ * a block only costs more when a tick falls into it. The output is the same
+ * unless a channel steps over its whole loop within one sample, see
+ * WrapChannelOnceMOD().
  */
 
-ModPlayerStatus_t *RenderMOD(volatile uint8_t *buf, int len);
+ModPlayerStatus_t *RenderMOD(ModPlayerStatus_t *mp, volatile uint8_t *buf, int len);
 
 #endif
 
+/*
+ * ModOutput_t *InitMODOutput(ModOutput_t *out, int format, int channels, int osr, int bits);
+ *
+ * Sets up the output descriptor `*out` for PullMOD(): MOD_FORMAT_* and 1
+ * (mono) or 2 (stereo) channels. The PWM formats have `osr` values per
+ * audio frame and channel, and duty values from 0 to 2^`bits` - 1 (`bits`
+ * up to the width of the format), with one modulator per channel. `osr`
+ * and `bits` are ignored otherwise.
+ * Returns `out`, or NULL if the combination is not supported.
+ *
+ * The layout defaults to packed values, stereo interleaved left/right.
+ * Set `out->planar` for separate left and right buffers, and `out->stride`
+ * to the distance in bytes between two values of a buffer, e.g. 4 to write
+ * 16-bit values into every other halfword. Set `out->ramp` to interpolate
+ * the PWM formats between frames like USE_DSM_INTERPOLATION.
+ */
+
+ModOutput_t *InitMODOutput(ModOutput_t *out, int format, int channels, int osr, int bits);
+
+/*
+ * int PullMOD(ModPlayerStatus_t *mp, ModOutput_t *out, volatile void *buf, volatile void *buf2, int count);
+ *
+ * Renders `count` values in the format of `*out` from the instance `*mp`
+ * straight to `*buf` (and the right channel to `*buf2` with planar stereo,
+ * otherwise `buf2` is unused). Returns `count`.
+ *
+ * A value is one sample of one channel for interleaved stereo, one frame
+ * for mono and planar stereo. The PWM formats count duty values the same
+ * way, `osr` per frame and channel. `count` need not be a multiple of a frame: the rest
+ * of a split frame is written first on the next call. Each `*out` belongs
+ * to one instance and should not be mixed with RenderMOD() calls on it.
+ *
+ * Levels match RenderMOD(): stereo as its 16-bit output, mono as its mono
+ * output. The PWM formats run the same delta-sigma modulator, so
+ * MOD_FORMAT_PWM8 with `osr` = OSR and `bits` = 8 gives exactly the
+ * RenderMOD() output with USE_MONO_OUTPUT, in mono, and in interleaved
+ * stereo that of USE_STEREO_PWM. Samples are mixed one by one, as RenderMOD() does
+ * on the device, also in desktop builds with the block mixer.
+ */
+
+int PullMOD(ModPlayerStatus_t *mp, ModOutput_t *out, volatile void *buf, volatile void *buf2, int count);
+
+/*
+ * typedef ModPlayerStatus_t *(*ModRenderer_t)(ModPlayerStatus_t *mp, volatile uint8_t *buf, int len);
+ *
+ * A renderer with the signature of RenderMOD(), e.g. to switch between
+ * RenderMOD() and the kernels of modplay.hpp at runtime.
+ */
+
+typedef ModPlayerStatus_t *(*ModRenderer_t)(ModPlayerStatus_t *mp, volatile uint8_t *buf, int len);
+
 #ifdef USING_EXTERNAL_RENDERING
 
 /*
- * ModPlayerStatus_t *ProcessMOD();
+ * ModPlayerStatus_t *ProcessMOD(ModPlayerStatus_t *mp);
  * 
  * Advances to the next tick of the MOD file.
  * 
@@ -135,14 +658,97 @@ ModPlayerStatus_t *RenderMOD(volatile uint8_t *buf, int len);
  * and want to create your own, or you want to use this library
  * on system with actual hardware samplers (such as the Commodore Amiga
  * or the Sony PlayStation).
+ *
+ * The first tick of a row decodes the pattern cells of all channels and
+ * looks up their samples, which makes it the slowest. With
+ * USE_ROW_PREDECODE=1, the cells of the next row are decoded on the ticks
+ * before it instead, at most one channel per tick while enough ticks are
+ * left (speeds below 5 decode more per tick, speed 1 on the first tick).
+ * The first tick of the row then only applies them. Pattern breaks and
+ * jumps are known from the first tick of the current row on, song switches
+ * and JumpMOD() drop what was decoded. This costs 4 ModCell_t per instance.
  */
 
-ModPlayerStatus_t *ProcessMOD();
+ModPlayerStatus_t *ProcessMOD(ModPlayerStatus_t *mp);
+
+/*
+ * int AdvanceMOD(ModPlayerStatus_t *mp, int len);
+ *
+ * Timing helper for external renderers that mix the channel state in
+ * `mp->paula[..]` themselves.
+ *
+ * Calls ProcessMOD() if a tick is due at the current output position
+ * and returns how many of the next `len` output samples can be rendered
+ * before the next tick (at least 1). The caller renders exactly that many
+ * samples, stepping each channel with WrapChannelMOD()/StepChannelMOD(),
+ * then calls AdvanceMOD() again. Tick lengths and `samplepos` advance
+ * exactly as in RenderMOD().
+ */
+
+int AdvanceMOD(ModPlayerStatus_t *mp, int len);
 
 #endif
 
 /*
- * ModPlayerStatus_t *JumpMOD(int order);
+ * int WrapChannelMOD(PaulaChannel_t *pch);
+ * void StepChannelMOD(PaulaChannel_t *pch);
+ *
+ * Sampler helpers shared by the built-in mixers and external renderers.
+ * WrapChannelMOD() moves the read position of a looping sample back into
+ * the loop, and returns 0 if a one-shot sample has finished playing (the
+ * channel is silent then). StepChannelMOD() advances the read position
+ * by one output sample.
+ *
+ * WrapChannelOnceMOD() does the same in bounded time, for renderers that
+ * must cost the same on every block (USE_CONSTANT_TIME): it steps back over
+ * the loop at most once. That is exact while a channel steps no further
+ * than its loop length per output sample. A step over several loops, e.g.
+ * a 2-byte loop at a high pitch, restarts the loop instead, which shifts
+ * its phase.
+ */
+
+static inline int WrapChannelMOD(PaulaChannel_t *pch) {
+	// If the single-shot sample has finished playing, skip this channel
+
+	if((pch->looplength == 0) && (pch->currentptr >= pch->length))
+		return 0;
+
+	// If it is a looping sample, wrap around to the loop point
+
+	while(pch->currentptr >= pch->length)
+		pch->currentptr -= pch->looplength;
+
+	return 1;
+}
+
+static inline int WrapChannelOnceMOD(PaulaChannel_t *pch) {
+	if(pch->currentptr >= pch->length) {
+		if(pch->looplength == 0)
+			return 0;
+
+		pch->currentptr -= pch->looplength;
+
+		if(pch->currentptr >= pch->length)
+			pch->currentptr = pch->length - pch->looplength;
+	}
+
+	return 1;
+}
+
+static inline void StepChannelMOD(PaulaChannel_t *pch) {
+	pch->currentsubptr += pch->period;
+
+	if(pch->currentsubptr >= 0x10000) {
+		pch->currentptr += pch->currentsubptr >> 16;
+		pch->currentsubptr &= 0xFFFF;
+	}
+
+	if(pch->age < INT32_MAX)
+		pch->age++;
+}
+
+/*
+ * ModPlayerStatus_t *JumpMOD(ModPlayerStatus_t *mp, int order);
  * 
  * Jumps to a given order in the MOD file.
  * 
@@ -159,6 +765,67 @@ ModPlayerStatus_t *ProcessMOD();
  * pattern data after the skip.
  */
 
-ModPlayerStatus_t *JumpMOD(int order);
+ModPlayerStatus_t *JumpMOD(ModPlayerStatus_t *mp, int order);
+
+/*
+ * ModPlayerStatus_t *SaveMOD(ModPlayerStatus_t *mp, ModSnapshot_t *snap);
+ * ModPlayerStatus_t *RestoreMOD(ModPlayerStatus_t *mp, const ModSnapshot_t *snap);
+ *
+ * SaveMOD() writes the playback state of `*mp` to `*snap`: the position in
+ * the song down to the output sample, the tracker and sampler state of
+ * every channel, tempo and pitch control and the delta-sigma modulators.
+ * Call it between two render calls, e.g. with the render IRQ disabled.
+ *
+ * RestoreMOD() continues playback from a snapshot in an instance that was
+ * set up with InitMOD() for the same song and output rate, e.g. after a
+ * reset. The output is the same as if the saved instance had rendered on.
+ * Nothing is simulated, the cost is that of reloading the song structure
+ * as JumpMOD() does, and of finding the samples of the playing channels.
+ * A queued song, a running crossfade and the events still in the queue are
+ * not part of the snapshot, and the order is reported again.
+ *
+ * Returns `mp`, or NULL if the snapshot has another MOD_SNAPSHOT_VERSION,
+ * song size or output rate, which leaves `*mp` as it was. So is a snapshot
+ * whose position, samples or speed are out of range for the song, so that
+ * a damaged one cannot make the player read outside the song. Its other
+ * values are taken as they are, check the snapshot before (e.g. with a CRC)
+ * to rule out damage.
+ */
+
+ModPlayerStatus_t *SaveMOD(ModPlayerStatus_t *mp, ModSnapshot_t *snap);
+ModPlayerStatus_t *RestoreMOD(ModPlayerStatus_t *mp, const ModSnapshot_t *snap);
+
+/*
+ * uint32_t LengthMOD(ModPlayerStatus_t *mp, const ModFile_t *mod, uint32_t size, uint32_t samplerate);
+ *
+ * Returns the play time of the given mod file at `samplerate`, in output
+ * samples, from the start until it loops back for the first time (see
+ * `loops`). Returns 0 if the file is not a valid MOD (see InitMOD()).
+ *
+ * The song is only walked through tick by tick, not rendered, so this
+ * costs a small fraction of playing it. `*mp` is used as scratch space
+ * and is left at the loop point.
+ */
+
+uint32_t LengthMOD(ModPlayerStatus_t *mp, const ModFile_t *mod, uint32_t size, uint32_t samplerate);
+
+/*
+ * uint32_t GainMOD(ModPlayerStatus_t *mp, const ModFile_t *mod, uint32_t size, uint32_t samplerate);
+ *
+ * Returns the gain for SetGainMOD() that brings the loudest sample of
+ * the given mod file to full scale of the PWM output, as a 16.16 factor
+ * clamped to its range. Returns 0 if the file is not a valid MOD.
+ *
+ * The song is mixed once up to its loop point (see LengthMOD()) with the
+ * mixer of the build, which costs about as much as playing it: meant for
+ * the host, where the result is stored with the song (see the Makefile),
+ * or for init time on a fast target. `*mp` is used as scratch space.
+ */
+
+uint32_t GainMOD(ModPlayerStatus_t *mp, const ModFile_t *mod, uint32_t size, uint32_t samplerate);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
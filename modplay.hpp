@@ -0,0 +1,211 @@
+#ifndef MODPLAY_HPP_INCLUDED
+#define MODPLAY_HPP_INCLUDED
+
+/*
+ * Header-only C++ front end for the renderer.
+ *
+ * RenderMOD() is configured with preprocessor flags, so a build contains
+ * exactly one renderer. Here the same mixer and output stages are templates
+ * over the channel count, interpolation, output format and oversampling
+ * ratio, so that one firmware can hold several fully specialised renderers
+ * (e.g. a cheap one and one with interpolation) and pick one at runtime.
+ *
+ * The tracker itself (ProcessMOD() and friends) stays in modplay.c, which is
+ * compiled as C as usual. It must be built with the same CHANNELS and
+ * EVENT_QUEUE_SIZE as the C++ code, these change the layout of
+ * ModPlayerStatus_t. Every kernel is exported with a C ABI through
+ * MODPLAY_RENDERER(), which matches ModRenderer_t:
+ *
+ *   // renderers.cpp
+ *   #include "modplay.hpp"
+ *
+ *   MODPLAY_RENDERER(RenderMODFast, 4, modplay::Interpolation::None, modplay::Output::MonoPWM, 8)
+ *   MODPLAY_RENDERER(RenderMODSmooth, 4, modplay::Interpolation::Linear, modplay::Output::MonoPWM, 8)
+ *
+ *   // main.c
+ *   ModPlayerStatus_t *RenderMODFast(ModPlayerStatus_t *mp, volatile uint8_t *buf, int len);
+ *   ModPlayerStatus_t *RenderMODSmooth(ModPlayerStatus_t *mp, volatile uint8_t *buf, int len);
+ *
+ *   ModRenderer_t render = smooth ? RenderMODSmooth : RenderMODFast;
+ *   render(&mp, buf, len);
+ *
+ * A kernel produces exactly the output of RenderMOD() built with the
+ * matching flags (USE_MONO_OUTPUT, USE_LINEAR_INTERPOLATION, OSR), including
+ * crossfades, tick timing and events. The TEST bounds asserts of modplay.c
+ * are not compiled in. Requires C++17.
+ */
+
+// The kernels drive the tracker through AdvanceMOD()
+#ifndef USING_EXTERNAL_RENDERING
+#define USING_EXTERNAL_RENDERING
+#endif
+
+#include "modplay.h"
+
+namespace modplay {
+
+enum class Interpolation {
+	None,               // nearest sample, as USE_LINEAR_INTERPOLATION=0
+	Linear,             // linear interpolation, as USE_LINEAR_INTERPOLATION=1
+};
+
+enum class Output {
+	Stereo16,           // 16-bit interleaved stereo, `len` * 4 bytes
+	MonoPWM,            // 8-bit delta-sigma PWM values, `len` * Osr bytes
+};
+
+template<Interpolation I>
+static inline int32_t ChannelSample(const PaulaChannel_t *pch) {
+	// Render the current sample, the position must already be wrapped
+	if constexpr (I == Interpolation::Linear) {
+		uint32_t nextptr = pch->currentptr + 1;
+
+		// A loop is never longer than the sample (see InitMOD), one step back suffices
+		if(nextptr >= pch->length)
+			nextptr = pch->looplength ? nextptr - pch->looplength : pch->currentptr;
+
+		int32_t sample1 = pch->sample[pch->currentptr];
+		int32_t sample2 = pch->sample[nextptr];
+
+		return (sample1 * (0x10000 - pch->currentsubptr) +
+			sample2 * pch->currentsubptr) * pch->volume / 65536;
+	} else {
+		return pch->sample[pch->currentptr] * pch->volume;
+	}
+}
+
+template<int Channels, Interpolation I, Output O>
+static inline void MixSample(ModPlayerStatus_t *mp, int32_t &a, int32_t &b) {
+	// Sums the channels panned to the left (0 and 3) into `a` and the ones
+	// panned to the right (1 and 2) into `b`. Mono output sums all into `a`
+	for(int ch = 0; ch < Channels; ch++) {
+		PaulaChannel_t *pch = &mp->paula[ch];
+
+		if(!pch->sample || !WrapChannelMOD(pch))
+			continue;
+
+		if(!pch->muted) {
+			int32_t sample = ChannelSample<I>(pch);
+
+			if constexpr (O == Output::MonoPWM)
+				a += sample;
+			else if((ch & 3) == 1 || (ch & 3) == 2)
+				b += sample;
+			else
+				a += sample;
+		}
+
+		StepChannelMOD(pch);
+	}
+}
+
+template<int Channels, Interpolation I, Output O>
+static inline void MixFrame(ModPlayerStatus_t *mp, int32_t &l, int32_t &r) {
+	// One output sample before scaling, the same sums as _MixMOD()
+	int32_t a = 0, b = 0;
+
+	MixSample<Channels, I, O>(mp, a, b);
+
+	if constexpr (O == Output::MonoPWM) {
+		l = a;
+	} else {
+		l = a * 65536 + b * 21845;
+		r = a * 21845 + b * 65536;
+	}
+}
+
+template<int Channels, Interpolation I, Output O>
+static inline void Crossfade(ModPlayerStatus_t *mp, int32_t &l, int32_t &r) {
+	// Mixes in the instance being faded out, see _CrossfadeMOD()
+	ModPlayerStatus_t *from = mp->fadefrom;
+	int32_t fl = 0, fr = 0;
+
+	AdvanceMOD(from, 1);
+	MixFrame<Channels, I, O>(from, fl, fr);
+
+	// Linear fade, gain in 1.15 fixed point
+	int32_t gain = mp->fadegain >> 15;
+
+	if constexpr (O == Output::MonoPWM) {
+		l = (l * gain + fl * (32768 - gain)) >> 15;
+	} else {
+		l = (l >> 15) * gain + (fl >> 15) * (32768 - gain);
+		r = (r >> 15) * gain + (fr >> 15) * (32768 - gain);
+	}
+
+	mp->fadegain += mp->fadestep;
+	if(mp->fadegain >= (1 << 30))
+		mp->fadefrom = nullptr;
+}
+
+/*
+ * ModPlayerStatus_t *Render<Channels, I, O, Osr>(ModPlayerStatus_t *mp, volatile uint8_t *buf, int len);
+ *
+ * Renders `len` audio samples from the instance `*mp` to `*buf`, like
+ * RenderMOD(). Only the first `Channels` channels are mixed. `Osr` is the
+ * oversampling ratio of the PWM output and ignored for stereo output. The
+ * PWM output is mono and holds each sample for `Osr` duty values, whatever
+ * USE_STEREO_PWM and USE_DSM_INTERPOLATION say.
+ */
+
+template<int Channels, Interpolation I, Output O, int Osr = 8>
+ModPlayerStatus_t *Render(ModPlayerStatus_t *mp, volatile uint8_t *buf, int len) {
+	static_assert(Channels >= 1 && Channels <= CHANNELS, "Channels must be between 1 and CHANNELS");
+	static_assert(Osr >= 1, "Osr must be at least 1");
+
+	uint32_t dsm = mp->dsmresidual[0];
+
+	for(int s = 0; s < len; ) {
+		// Runs up to the next tick need no tick check per sample
+		int n = AdvanceMOD(mp, len - s);
+
+		for(; n > 0; n--, s++) {
+			int32_t l, r = 0;
+
+			MixFrame<Channels, I, O>(mp, l, r);
+
+			if(mp->fadefrom)
+				Crossfade<Channels, I, O>(mp, l, r);
+
+			if constexpr (O == Output::MonoPWM) {
+				// Delta-sigma modulation to 8-bit PWM, as in RenderMOD(). The
+				// loop is unrolled for the constant Osr and keeps the
+				// residual in a register
+				int32_t mono = l * 32768;  // 131072 / 2 channels
+				uint32_t sample16 = ((mono >> 16) + 32768) & 0xFFFF;
+				uint32_t p = sample16 >> 8;
+				uint32_t f = sample16 << 24;
+
+				for(int i = 0; i < Osr; i++) {
+					dsm += f;
+					buf[i] = p + (dsm < f);
+				}
+
+				buf += Osr;
+			} else {
+				((volatile int16_t *) buf)[s * 2] = l / 65536;
+				((volatile int16_t *) buf)[s * 2 + 1] = r / 65536;
+			}
+		}
+	}
+
+	mp->dsmresidual[0] = dsm;
+
+	return mp;
+}
+
+}
+
+/*
+ * MODPLAY_RENDERER(name, Channels, Interpolation, Output[, Osr])
+ *
+ * Defines `name` as an extern "C" function of type ModRenderer_t that runs
+ * the kernel Render<Channels, Interpolation, Output, Osr>.
+ */
+
+#define MODPLAY_RENDERER(name, ...) \
+	extern "C" ModPlayerStatus_t *name(ModPlayerStatus_t *mp, volatile uint8_t *buf, int len) { \
+		return modplay::Render<__VA_ARGS__>(mp, buf, len); \
+	}
+
+#endif
@@ -0,0 +1,231 @@
+#define USING_EXTERNAL_RENDERING  // Mixes the channels itself, timed by AdvanceMOD()
+#include "modplay_hq.h"
+#include <math.h>
+#include <string.h>
+
+// Host-only renderer: needs floating point, math.h and ~150kb of tables
+
+#define HQ_BLOCK      256  // Samples mixed per instance before crossfading and filtering
+
+#define SINC_TAPS     16   // Kernel length in source samples
+#define SINC_PHASES   256  // Fractional positions per source sample (linearly interpolated)
+#define SINC_CUTOFFS  9    // Kernels for cutoffs of 2^(-k/4), k = 0..8 (down to 1/4 Nyquist)
+
+typedef float v4sf __attribute__((vector_size(16)));
+
+// One more phase than needed, so that interpolation never reads past the table
+static v4sf sinc_table[SINC_CUTOFFS][SINC_PHASES + 1][SINC_TAPS / 4];
+static uint32_t sinc_maxstep[SINC_CUTOFFS];    // Largest 16.16 step each kernel is used for
+static int sinc_table_state = 0;
+
+static double _BlackmanHarris(double t) {
+	return 0.35875 - 0.48829 * cos(2 * M_PI * t) + 0.14128 * cos(4 * M_PI * t) - 0.01168 * cos(6 * M_PI * t);
+}
+
+static void _InitSincTable(void) {
+	// Built once for all instances, other threads wait until it is ready
+	int state = 0;
+
+	if(!__atomic_compare_exchange_n(&sinc_table_state, &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+		while(__atomic_load_n(&sinc_table_state, __ATOMIC_ACQUIRE) != 2);
+		return;
+	}
+
+	for(int k = 0; k < SINC_CUTOFFS; k++) {
+		double fc = pow(2.0, -k / 4.0);
+
+		sinc_maxstep[k] = (k == SINC_CUTOFFS - 1) ? UINT32_MAX : 0x10000 / fc;
+
+		for(int p = 0; p <= SINC_PHASES; p++) {
+			double frac = (double) p / SINC_PHASES;
+			float h[SINC_TAPS];
+			double sum = 0;
+
+			// Tap n is the source sample at offset n - (SINC_TAPS / 2 - 1) from the current one
+			for(int n = 0; n < SINC_TAPS; n++) {
+				double x = n - (SINC_TAPS / 2 - 1) - frac;
+				double y = fc * x * M_PI;
+
+				h[n] = fc * (y == 0 ? 1.0 : sin(y) / y) * _BlackmanHarris((x + SINC_TAPS / 2) / SINC_TAPS);
+				sum += h[n];
+			}
+
+			// Unity gain at DC for every phase
+			for(int n = 0; n < SINC_TAPS; n++) h[n] /= sum;
+
+			memcpy(sinc_table[k][p], h, sizeof(h));
+		}
+	}
+
+	__atomic_store_n(&sinc_table_state, 2, __ATOMIC_RELEASE);
+}
+
+// The taps reach outside the loop, so read the MOD file and not the sample cache
+#if SAMPLE_CACHE_SIZE
+#define _SAMPLE_DATA(pch) ((pch)->data)
+#else
+#define _SAMPLE_DATA(pch) ((pch)->sample)
+#endif
+
+static inline float _SampleTap(const PaulaChannel_t *pch, int32_t j) {
+	// Sample value at index `j`, continuing into the loop or silence past the end
+	if(j >= (int32_t) pch->length) {
+		if(!pch->looplength) return 0;
+
+		j = pch->length - pch->looplength + (j - pch->length) % pch->looplength;
+	}
+
+	return (j < 0) ? 0 : _SAMPLE_DATA(pch)[j];
+}
+
+static inline float _SincSample(const PaulaChannel_t *pch) {
+	// Pick the widest kernel whose cutoff is still below the Nyquist
+	// frequency of the output, relative to the source sample rate
+	int k = 0;
+
+	while(pch->period > sinc_maxstep[k]) k++;
+
+	int32_t first = (int32_t) pch->currentptr - (SINC_TAPS / 2 - 1);
+	float x[SINC_TAPS];
+
+	if(first >= 0 && first + SINC_TAPS <= (int32_t) pch->length) {
+		for(int n = 0; n < SINC_TAPS; n++) x[n] = _SAMPLE_DATA(pch)[first + n];
+	} else {
+		for(int n = 0; n < SINC_TAPS; n++) x[n] = _SampleTap(pch, first + n);
+	}
+
+	uint32_t phase = pch->currentsubptr >> 8;
+	float frac = (pch->currentsubptr & 0xFF) * (1.0f / 256);
+
+	const v4sf *h0 = sinc_table[k][phase];
+	const v4sf *h1 = sinc_table[k][phase + 1];
+	v4sf acc = { 0, 0, 0, 0 };
+
+	for(int n = 0; n < SINC_TAPS / 4; n++) {
+		v4sf xv;
+		memcpy(&xv, &x[n * 4], sizeof(xv));
+
+		acc += xv * (h0[n] + (h1[n] - h0[n]) * frac);
+	}
+
+	return acc[0] + acc[1] + acc[2] + acc[3];
+}
+
+ModFloatOutput_t *InitMODFloat(ModFloatOutput_t *out, int filter, uint32_t samplerate) {
+	_InitSincTable();
+
+	memset(out, 0, sizeof(*out));
+	out->filter = filter;
+
+	// Fixed RC low-pass of the Amiga output stage
+	double rc_freq = (filter == MOD_FILTER_A1200) ? 34400 : 4420;
+	out->rc_coef = 1 - exp(-2 * M_PI * rc_freq / samplerate);
+
+	// LED filter: 12 dB/oct Butterworth at 3.275 kHz (bilinear transform)
+	double led_freq = 3275;
+	if(led_freq > 0.45 * samplerate) led_freq = 0.45 * samplerate;
+
+	double k = tan(M_PI * led_freq / samplerate);
+	double q = M_SQRT1_2;
+	double norm = 1 / (1 + k / q + k * k);
+
+	out->led_b[0] = k * k * norm;
+	out->led_b[1] = 2 * out->led_b[0];
+	out->led_b[2] = out->led_b[0];
+	out->led_a[0] = 2 * (k * k - 1) * norm;
+	out->led_a[1] = (1 - k / q + k * k) * norm;
+
+	return out;
+}
+
+static inline float _FilterOutput(ModFloatOutput_t *out, int ledfilter, int side, float x) {
+	if(out->filter == MOD_FILTER_NONE) return x;
+
+	float y = out->rc_state[side] += out->rc_coef * (x - out->rc_state[side]);
+
+	if(ledfilter) {
+		float *z = out->led_state[side];
+		float in = y;
+
+		y = out->led_b[0] * in + z[0];
+		z[0] = out->led_b[1] * in - out->led_a[0] * y + z[1];
+		z[1] = out->led_b[2] * in - out->led_a[1] * y;
+	}
+
+	return y;
+}
+
+static void _MixFloat(ModPlayerStatus_t *mp, float *buf, int len) {
+	// Renders `len` unfiltered stereo samples of `*mp`
+	const float majorchmul = 1.0f / 32768;        // same levels as the 16-bit output
+	const float minorchmul = 1.0f / 32768 / 3;
+
+	for(int s = 0; s < len; ) {
+		int n = AdvanceMOD(mp, len - s);
+
+		for(; n > 0; n--, s++) {
+			float l = 0, r = 0;
+
+			for(int ch = 0; ch < 4; ch++) {  // Hardcoded 4 channels
+				PaulaChannel_t *pch = &mp->paula[ch];
+
+				if(!pch->sample || !WrapChannelMOD(pch))
+					continue;
+
+				if(!pch->muted) {
+					float sample = _SincSample(pch) * pch->volume;
+
+					if((ch & 3) == 1 || (ch & 3) == 2) {
+						l += sample * minorchmul;
+						r += sample * majorchmul;
+					} else {
+						l += sample * majorchmul;
+						r += sample * minorchmul;
+					}
+				}
+
+				StepChannelMOD(pch);
+			}
+
+			buf[s * 2] = l;
+			buf[s * 2 + 1] = r;
+		}
+	}
+}
+
+ModPlayerStatus_t *RenderMODFloat(ModPlayerStatus_t *mp, ModFloatOutput_t *out, float *buf, int len) {
+	for(int s = 0; s < len; s += HQ_BLOCK) {
+		int n = (len - s < HQ_BLOCK) ? len - s : HQ_BLOCK;
+		float *block = buf + s * 2;
+
+		_MixFloat(mp, block, n);
+
+		// Linear crossfade from `mp->fadefrom`, same gain curve as RenderMOD()
+		ModPlayerStatus_t *from = mp->fadefrom;
+
+		if(from) {
+			float fade[HQ_BLOCK * 2];
+
+			_MixFloat(from, fade, n);
+
+			for(int i = 0; i < n; i++) {
+				float gain = (mp->fadegain < (1 << 30)) ? mp->fadegain * (1.0f / (1 << 30)) : 1.0f;
+
+				block[i * 2] = block[i * 2] * gain + fade[i * 2] * (1 - gain);
+				block[i * 2 + 1] = block[i * 2 + 1] * gain + fade[i * 2 + 1] * (1 - gain);
+
+				if(mp->fadegain < (1 << 30)) mp->fadegain += mp->fadestep;
+			}
+
+			if(mp->fadegain >= (1 << 30))
+				mp->fadefrom = NULL;
+		}
+
+		for(int i = 0; i < n; i++) {
+			block[i * 2] = _FilterOutput(out, mp->ledfilter, 0, block[i * 2]);
+			block[i * 2 + 1] = _FilterOutput(out, mp->ledfilter, 1, block[i * 2 + 1]);
+		}
+	}
+
+	return mp;
+}
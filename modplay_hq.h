@@ -0,0 +1,60 @@
+#ifndef MODPLAY_HQ_H_INCLUDED
+#define MODPLAY_HQ_H_INCLUDED
+#include "modplay.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * High quality floating point renderer, for host builds only.
+ *
+ * Renders the same player state as RenderMOD(), but resamples every
+ * channel with a band-limited windowed-sinc interpolator and outputs
+ * 32-bit float stereo. It is meant for offline previews and as the
+ * reference that the fixed-point device renderers are measured against.
+ */
+
+enum {
+	MOD_FILTER_NONE,    // no output filter
+	MOD_FILTER_A500,    // A500: fixed 4.4 kHz RC low-pass plus LED filter (E0x)
+	MOD_FILTER_A1200,   // A1200: fixed 34 kHz RC low-pass plus LED filter (E0x)
+};
+
+typedef struct {
+	int filter;
+	float rc_coef, rc_state[2];
+
+	// LED filter: 2nd order Butterworth biquad, transposed direct form II
+	float led_b[3], led_a[2], led_state[2][2];
+} ModFloatOutput_t;
+
+/*
+ * ModFloatOutput_t *InitMODFloat(ModFloatOutput_t *out, int filter, uint32_t samplerate);
+ *
+ * Sets up the output stage state `*out` for the given filter emulation
+ * (MOD_FILTER_*) and output samplerate, which must match the samplerate
+ * given to InitMOD().
+ */
+
+ModFloatOutput_t *InitMODFloat(ModFloatOutput_t *out, int filter, uint32_t samplerate);
+
+/*
+ * ModPlayerStatus_t *RenderMODFloat(ModPlayerStatus_t *mp, ModFloatOutput_t *out, float *buf, int len);
+ *
+ * Renders `len` stereo samples from the instance `*mp` to `*buf`, which
+ * must have room for `len` * 2 floats (interleaved left/right).
+ *
+ * Panning and levels match the 16-bit stereo output of RenderMOD(),
+ * scaled so that full scale is +-1.0. Tick timing, events, song switching
+ * and crossfades (CrossfadeMOD) work as with RenderMOD(), since both use
+ * the same tick and channel stepping code.
+ */
+
+ModPlayerStatus_t *RenderMODFloat(ModPlayerStatus_t *mp, ModFloatOutput_t *out, float *buf, int len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
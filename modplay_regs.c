@@ -0,0 +1,425 @@
+#define USING_EXTERNAL_RENDERING  // Walks the tracker with ProcessMOD() to record streams
+#include "modplay_regs.h"
+#include <string.h>
+
+#if USE_STORAGE || SAMPLE_CACHE_SIZE
+#error "RecordMODRegs() finds the samples in the MOD file through PaulaChannel_t.sample"
+#endif
+
+// Records and replays Paula register streams, see modplay_regs.h. Replaying
+// needs no tracker code, and reads the stream in place
+
+static inline uint32_t _Read16(const uint8_t *p) {
+	return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t _Read32(const uint8_t *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static int _ReadByte(ModRegs_t *rs, uint32_t *val) {
+	if(rs->offset >= rs->size) return 0;
+
+	*val = rs->data[rs->offset++];
+	return 1;
+}
+
+static int _ReadVarint(ModRegs_t *rs, uint32_t *val) {
+	uint32_t byte;
+
+	*val = 0;
+
+	for(int shift = 0; shift < 32; shift += 7) {
+		if(!_ReadByte(rs, &byte)) return 0;
+
+		*val |= (byte & 0x7F) << shift;
+		if(!(byte & 0x80)) return 1;
+	}
+
+	return 0;
+}
+
+static void _AdvanceMODRegs(ModRegs_t *rs) {
+	// Moves the read positions on by one tick of an ideal Paula at PAL
+	// clock: 3546895 / period bytes per second for 2.5 / bpm seconds
+	for(int i = 0; i < 4; i++) {  // Hardcoded 4 channels
+		ModRegsChannel_t *ch = &rs->ch[i];
+
+		if(!ch->period || !rs->bpm || ch->position >= ch->length) continue;
+
+		uint64_t pos = ((uint64_t) ch->position << 16 | ch->fraction) +
+			(uint64_t) 3546895 * 5 * 32768 / (rs->bpm * ch->period);
+
+		if((pos >> 16) >= ch->length && ch->looplength) {
+			uint64_t end = (uint64_t) ch->length << 16, loop = (uint64_t) ch->looplength << 16;
+
+			pos = end - loop + (pos - end) % loop;
+		}
+
+		ch->position = (pos >> 16 < ch->length) ? (uint32_t) (pos >> 16) : ch->length;
+		ch->fraction = (pos >> 16 < ch->length) ? (uint16_t) pos : 0;
+	}
+}
+
+static int _ReadTickMODRegs(ModRegs_t *rs) {
+	// Decodes one tick record into the channel state
+	uint32_t flags, val;
+
+	if(rs->tick >= rs->ticks || !_ReadByte(rs, &flags)) return 0;
+
+	if(flags & MOD_REGS_TICK_TEMPO) {
+		if(!_ReadByte(rs, &val)) return 0;
+		rs->bpm = val;
+	}
+
+	rs->ledfilter = !!(flags & MOD_REGS_TICK_FILTER);
+
+	for(int i = 0; i < 4; i++) {  // Hardcoded 4 channels
+		ModRegsChannel_t *ch = &rs->ch[i];
+		uint32_t changed;
+
+		ch->changed = 0;
+
+		if(!(flags & (1 << i))) continue;
+		if(!_ReadByte(rs, &changed)) return 0;
+
+		if(changed & MOD_REGS_SAMPLE) {
+			if(!_ReadByte(rs, &val) || val > 30) return 0;
+
+			ch->sample = val;
+			ch->start = rs->samplestart[val];
+			ch->length = rs->samplelength[val] * 2;
+			ch->looplength = rs->sampleloop[val] * 2;
+		}
+
+		if(changed & MOD_REGS_PERIOD) {
+			if(rs->offset + 2 > rs->size) return 0;
+
+			ch->period = _Read16(rs->data + rs->offset);
+			rs->offset += 2;
+		}
+
+		if((changed & MOD_REGS_VOLUME) && !_ReadByte(rs, &val)) return 0;
+		if(changed & MOD_REGS_VOLUME) ch->volume = (val > 64) ? 64 : val;
+
+		if(changed & MOD_REGS_TRIGGER) {
+			if(!_ReadVarint(rs, &val)) return 0;
+
+			ch->position = val >> 1;
+			ch->keep = val & 1;
+			if(!ch->keep) ch->fraction = 0;
+		}
+
+		if(changed & MOD_REGS_POSITION) {
+			if(!_ReadVarint(rs, &ch->position) || rs->offset + 2 > rs->size) return 0;
+
+			ch->fraction = _Read16(rs->data + rs->offset);
+			rs->offset += 2;
+		}
+
+		// Keyframe positions are only reported after a seek, when playing on
+		// the sampler knows better
+		ch->changed = changed & ~MOD_REGS_POSITION;
+	}
+
+	rs->tick++;
+	return 1;
+}
+
+ModRegs_t *InitMODRegs(ModRegs_t *rs, const uint8_t *data, uint32_t size) {
+	memset(rs, 0, sizeof(*rs));
+
+	if(size < 24 || memcmp(data, "MODR", 4) || data[4] != MOD_REGS_VERSION || data[6] != 4)
+		return NULL;
+
+	uint32_t header = data[5];
+
+	rs->data = data;
+	rs->size = size;
+	rs->ticks = _Read32(data + 8);
+	rs->looptick = _Read32(data + 12);
+	rs->index = _Read32(data + 16);
+	rs->keyframes = _Read32(data + 20);
+
+	if(header < 24 || header + 31 * 8 > size || rs->index > size || rs->keyframes > (size - rs->index) / 8)
+		return NULL;
+
+	for(int i = 0; i < 31; i++) {
+		const uint8_t *p = data + header + 8 * i;
+
+		rs->samplestart[i] = _Read32(p);
+		rs->samplelength[i] = _Read16(p + 4);
+		rs->sampleloop[i] = _Read16(p + 6);
+	}
+
+	rs->offset = header + 31 * 8;
+
+	for(int i = 0; i < 4; i++) {  // Hardcoded 4 channels
+		rs->ch[i].sample = 0xFF;
+	}
+
+	return rs;
+}
+
+int TickMODRegs(ModRegs_t *rs) {
+	return _ReadTickMODRegs(rs);
+}
+
+int SeekMODRegs(ModRegs_t *rs, uint32_t tick) {
+	if(tick >= rs->ticks) return 0;
+
+	// Last keyframe up to `tick`
+	int lo = 0, hi = rs->keyframes;
+
+	while(hi - lo > 1) {
+		int mid = (lo + hi) / 2;
+
+		if(_Read32(rs->data + rs->index + 8 * mid) <= tick) lo = mid;
+		else hi = mid;
+	}
+
+	if(!rs->keyframes || _Read32(rs->data + rs->index + 8 * lo) > tick) return 0;
+
+	rs->tick = _Read32(rs->data + rs->index + 8 * lo);
+	rs->offset = _Read32(rs->data + rs->index + 8 * lo + 4);
+
+	// Read forward to `tick`, moving the read positions along, and report
+	// every value as changed
+	for(;;) {
+		if(!_ReadTickMODRegs(rs)) return 0;
+		if(rs->tick > tick) break;
+
+		_AdvanceMODRegs(rs);
+	}
+
+	for(int i = 0; i < 4; i++) {  // Hardcoded 4 channels
+		rs->ch[i].changed = MOD_REGS_SAMPLE | MOD_REGS_PERIOD | MOD_REGS_VOLUME | MOD_REGS_POSITION;
+	}
+
+	return 1;
+}
+
+void ApplyMODRegs(const ModRegs_t *rs, PaulaChannel_t *paula, const uint8_t *mod, uint32_t paularate) {
+	for(int i = 0; i < 4; i++) {  // Hardcoded 4 channels
+		const ModRegsChannel_t *ch = &rs->ch[i];
+		PaulaChannel_t *pch = &paula[i];
+
+		if((ch->changed & MOD_REGS_SAMPLE) && ch->sample <= 30) {
+			pch->sample = (const int8_t *) mod + ch->start;
+			pch->length = ch->length;
+			pch->looplength = ch->looplength;
+#if SAMPLE_CACHE_SIZE
+			pch->data = pch->sample;
+#endif
+		}
+
+		if(ch->changed & MOD_REGS_PERIOD)
+			pch->period = ch->period ? paularate / ch->period : 0;
+
+		if(ch->changed & MOD_REGS_VOLUME)
+			pch->volume = ch->volume;
+
+		if(ch->changed & MOD_REGS_TRIGGER) {
+			pch->currentptr = ch->position;
+			if(!ch->keep) pch->currentsubptr = 0;
+			pch->age = 0;
+		}
+
+		if(ch->changed & MOD_REGS_POSITION) {
+			pch->currentptr = ch->position;
+			pch->currentsubptr = ch->fraction;
+		}
+	}
+}
+
+typedef struct {
+	uint8_t *out;
+	uint32_t pos, top, size;  // Records grow from the start, the index from the end
+} _RegsWriter_t;
+
+static void _Put(_RegsWriter_t *w, uint32_t val, int bytes) {
+	for(int i = 0; i < bytes; i++, val >>= 8) {
+		if(w->pos < w->top) w->out[w->pos] = val;
+		w->pos++;
+	}
+}
+
+static void _PutVarint(_RegsWriter_t *w, uint32_t val) {
+	while(val >= 0x80) {
+		_Put(w, (val & 0x7F) | 0x80, 1);
+		val >>= 7;
+	}
+
+	_Put(w, val, 1);
+}
+
+uint32_t RecordMODRegs(ModPlayerStatus_t *mp, const uint8_t *mod, uint32_t size, uint8_t *out, uint32_t outsize, uint32_t keyframeticks) {
+	_RegsWriter_t w = { out, 0, outsize, outsize };
+	const uint32_t header = 24, records = header + 31 * 8;
+	ModRegs_t model;
+
+	if(outsize < records || !InitMOD(mp, mod, size, 44100))
+		return 0;
+
+#if EVENT_QUEUE_SIZE
+	mp->eventmask = 0;
+#endif
+
+	// Header and sample table are written at the end, once all are known.
+	// `model` reads every record back, and keeps the values the sampler has
+	memset(out, 0, records);
+	memcpy(out, "MODR", 4);
+	out[4] = MOD_REGS_VERSION;
+	out[5] = header;
+	out[6] = 4;  // Hardcoded 4 channels
+
+	InitMODRegs(&model, out, outsize);
+	model.ticks = UINT32_MAX;
+
+	w.pos = records;
+
+	uint32_t tick, keyframes = 0;
+
+	for(tick = 0; !mp->loops && tick < (1 << 20); tick++) {
+		// A trigger clears `age` and may clear the fraction of the position
+		for(int i = 0; i < 4; i++) {  // Hardcoded 4 channels
+			mp->paula[i].age = 1;
+			mp->paula[i].currentsubptr = 1;
+		}
+
+		ProcessMOD(mp);
+
+		int keyframe = keyframeticks ? (tick % keyframeticks == 0) : (tick == 0);
+		uint32_t start = w.pos, flags = keyframe ? MOD_REGS_TICK_KEYFRAME : 0;
+
+		if(keyframe) {
+			// Index entries grow down from the end of `out`
+			if(w.top < w.pos + 8)
+				return 0;
+
+			w.top -= 8;
+
+			for(int i = 0; i < 4; i++) {
+				out[w.top + i] = tick >> (8 * i);
+				out[w.top + 4 + i] = start >> (8 * i);
+			}
+
+			keyframes++;
+		}
+
+		_Put(&w, 0, 1);  // Flags, filled in below
+
+		if(keyframe || mp->bpm != model.bpm) {
+			flags |= MOD_REGS_TICK_TEMPO;
+			_Put(&w, mp->bpm, 1);
+		}
+
+		if(mp->ledfilter) flags |= MOD_REGS_TICK_FILTER;
+
+		for(int i = 0; i < 4; i++) {  // Hardcoded 4 channels
+			const PaulaChannel_t *pch = &mp->paula[i];
+			const TrackerChannel_t *tch = &mp->ch[i];
+			ModRegsChannel_t *ch = &model.ch[i];
+			uint32_t changed = 0;
+
+			int32_t period = tch->period ? tch->period + (tch->vibrato.val >> 7) : 0;
+
+			if(tch->period && period < 1) period = 1;
+			if(period > 0xFFFF) period = 0xFFFF;
+
+			if(pch->sample && (keyframe || tch->sample != ch->sample)) {
+				// The sampler holds the sample as it was cut to the file
+				int n = tch->sample;
+
+				model.samplestart[n] = (const uint8_t *) pch->sample - mod;
+				model.samplelength[n] = pch->length / 2;
+				model.sampleloop[n] = pch->looplength / 2;
+				changed |= MOD_REGS_SAMPLE;
+			}
+
+			if(keyframe || (uint32_t) period != ch->period) changed |= MOD_REGS_PERIOD;
+			if(keyframe || pch->volume != ch->volume) changed |= MOD_REGS_VOLUME;
+			if(pch->age == 0) changed |= MOD_REGS_TRIGGER;
+			if(keyframe) changed |= MOD_REGS_POSITION;
+
+			if(!changed) continue;
+
+			flags |= 1 << i;
+			_Put(&w, changed, 1);
+
+			if(changed & MOD_REGS_SAMPLE) _Put(&w, tch->sample, 1);
+			if(changed & MOD_REGS_PERIOD) _Put(&w, period, 2);
+			if(changed & MOD_REGS_VOLUME) _Put(&w, pch->volume, 1);
+			if(changed & MOD_REGS_TRIGGER) _PutVarint(&w, pch->currentptr << 1 | (pch->currentsubptr != 0));
+
+			if(changed & MOD_REGS_POSITION) {
+				// Where the ideal Paula is after this tick's trigger
+				uint32_t position = ch->position, fraction = ch->fraction;
+
+				if(changed & MOD_REGS_TRIGGER) {
+					position = pch->currentptr;
+					if(!pch->currentsubptr) fraction = 0;
+				}
+
+				_PutVarint(&w, position);
+				_Put(&w, fraction, 2);
+			}
+		}
+
+		if(start < w.top) out[start] = flags;
+
+		// Let the model read the record, then move it on by one tick
+		model.offset = start;
+		model.size = (w.pos < w.top) ? w.pos : w.top;
+
+		if(w.pos > w.top || !TickMODRegs(&model))
+			return 0;
+
+		_AdvanceMODRegs(&model);
+	}
+
+	// Find the first tick of the row the song loops back to
+	int looporder = mp->order, looprow = mp->row;
+	uint32_t looptick = 0;
+
+	InitMOD(mp, mod, size, 44100);
+
+#if EVENT_QUEUE_SIZE
+	mp->eventmask = 0;
+#endif
+
+	while(looptick < tick && (mp->order != looporder || mp->row != looprow || mp->tick != 0)) {
+		ProcessMOD(mp);
+		looptick++;
+	}
+
+	if(looptick >= tick) looptick = 0;
+
+	// Header, sample table and the index after the records, in tick order
+	uint32_t index = w.pos;
+
+	for(int i = 0; i < 8; i++) out[8 + i] = (i < 4 ? tick : looptick) >> (8 * (i & 3));
+	for(int i = 0; i < 8; i++) out[16 + i] = (i < 4 ? index : keyframes) >> (8 * (i & 3));
+
+	for(int n = 0; n < 31; n++) {
+		uint8_t *p = out + header + 8 * n;
+		uint32_t start = model.samplestart[n];
+
+		p[0] = start; p[1] = start >> 8; p[2] = start >> 16; p[3] = start >> 24;
+		p[4] = model.samplelength[n]; p[5] = model.samplelength[n] >> 8;
+		p[6] = model.sampleloop[n]; p[7] = model.sampleloop[n] >> 8;
+	}
+
+	for(uint32_t k = 0; k < keyframes / 2; k++) {
+		// The entries were written downwards, reverse them in place first
+		uint8_t entry[8], *a = out + w.top + 8 * k, *b = out + outsize - 8 * (k + 1);
+
+		memcpy(entry, a, 8);
+		memcpy(a, b, 8);
+		memcpy(b, entry, 8);
+	}
+
+	memmove(out + index, out + w.top, 8 * keyframes);
+
+	return index + 8 * keyframes;
+}
@@ -0,0 +1,166 @@
+#ifndef MODPLAY_REGS_H_INCLUDED
+#define MODPLAY_REGS_H_INCLUDED
+#include "modplay.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Paula register streams: recording and replay.
+ *
+ * A register stream holds what ProcessMOD() hands to the sampler on every
+ * tick: sample, Amiga period, volume and (re)triggers per channel, plus
+ * the tempo and the LED filter. It is recorded offline (tools/modregs)
+ * and replayed without the tracker. Each tick becomes a few register
+ * writes to a hardware sampler, an FPGA voice engine or a remote mixer.
+ * Sample data is not part of the stream. It stays in the MOD file, and
+ * the stream refers to it by offset.
+ *
+ * Format, version 1, all values little-endian:
+ *
+ *   header     "MODR", u8 version, u8 header size (24), u8 channels (4),
+ *              u8 flags (0), u32 ticks, u32 loop tick, u32 index offset,
+ *              u32 keyframes
+ *   samples    31 x { u32 start of the data in the MOD file, u16 length
+ *              and u16 loop length in words }, cut to the file like
+ *              InitMOD() does, the loop at the end of the sample
+ *   ticks      one record per tick, see below
+ *   index      keyframes x { u32 tick, u32 offset of its record }
+ *
+ * A tick record starts with a byte of MOD_REGS_TICK_* flags: one bit per
+ * channel that has changed, then the BPM (u8) if MOD_REGS_TICK_TEMPO is
+ * set. Each changed channel follows as a byte of MOD_REGS_* flags and the
+ * values they announce, in this order:
+ *
+ *   MOD_REGS_SAMPLE    u8 sample (0..30)
+ *   MOD_REGS_PERIOD    u16 Amiga period, 0 stops the channel
+ *   MOD_REGS_VOLUME    u8 volume (0..64)
+ *   MOD_REGS_TRIGGER   varint (position << 1 | keep), restarts the channel
+ *                      at `position` bytes. Without `keep`, the fraction of
+ *                      the read position is reset as well (E9x, EDx)
+ *   MOD_REGS_POSITION  varint position, u16 fraction (16.16 bytes), the
+ *                      read position at the start of the tick
+ *
+ * Keyframes (MOD_REGS_TICK_KEYFRAME) list every channel with all its
+ * values and its read position, as an ideal Paula at PAL clock would have
+ * it. Decoding can start at any keyframe, which makes the stream seekable
+ * by tick. Varints are unsigned LEB128. A reader only accepts streams of
+ * its own version. Later versions may make the header longer, and readers
+ * skip it by its header size.
+ */
+
+#define MOD_REGS_VERSION    1
+
+enum {
+	MOD_REGS_TICK_CHANNELS = 0x0F,      // bit n: channel n changed
+	MOD_REGS_TICK_TEMPO = 0x10,         // a u8 BPM follows
+	MOD_REGS_TICK_FILTER = 0x20,        // LED filter on (E0x), on every tick
+	MOD_REGS_TICK_KEYFRAME = 0x40,      // all channels follow, with positions
+};
+
+enum {
+	MOD_REGS_SAMPLE = 0x01,
+	MOD_REGS_PERIOD = 0x02,
+	MOD_REGS_VOLUME = 0x04,
+	MOD_REGS_TRIGGER = 0x08,
+	MOD_REGS_POSITION = 0x10,
+};
+
+typedef struct {
+	uint32_t start;           // Data of the sample in the MOD file, in bytes
+	uint32_t length;          // Bytes from `start`
+	uint32_t looplength;      // Bytes at the end of the sample, 0 for one-shots
+	uint32_t position;        // Read position of a trigger or keyframe, in bytes
+	uint16_t fraction;        // and its fraction (keyframes only)
+	uint16_t period;          // Amiga period, 0 when stopped
+	uint8_t sample;           // 0..30, 0xFF before the first sample
+	uint8_t volume;           // 0..64
+	uint8_t changed;          // MOD_REGS_* values set by the last tick
+	uint8_t keep;             // Trigger keeps the fraction of the read position
+} ModRegsChannel_t;
+
+typedef struct {
+	const uint8_t *data;
+	uint32_t size;
+
+	// From the header
+	uint32_t ticks, looptick, index, keyframes;
+	uint32_t samplestart[31];
+	uint16_t samplelength[31], sampleloop[31];  // Words
+
+	// State after the last tick read
+	uint32_t tick;            // Ticks read so far
+	uint32_t offset;          // Record of the next tick
+	uint8_t bpm, ledfilter;
+	ModRegsChannel_t ch[4];
+} ModRegs_t;
+
+/*
+ * ModRegs_t *InitMODRegs(ModRegs_t *rs, const uint8_t *data, uint32_t size);
+ *
+ * Sets up `*rs` to replay the register stream of `size` bytes at `data`
+ * from the start. Returns `rs`, or NULL if it is not a register stream of
+ * MOD_REGS_VERSION, or if its header or index lie outside `size`.
+ */
+
+ModRegs_t *InitMODRegs(ModRegs_t *rs, const uint8_t *data, uint32_t size);
+
+/*
+ * int TickMODRegs(ModRegs_t *rs);
+ *
+ * Reads the next tick into `rs->ch[..]`, `rs->bpm` and `rs->ledfilter`.
+ * The `changed` flags of each channel say which values to write to the
+ * sampler. Returns 1, or 0 at the end of the stream (or if the stream is
+ * cut short). The next tick is due 2.5 / `rs->bpm` seconds later.
+ */
+
+int TickMODRegs(ModRegs_t *rs);
+
+/*
+ * int SeekMODRegs(ModRegs_t *rs, uint32_t tick);
+ *
+ * Reads tick `tick` as if the stream had been played up to it: starts at
+ * the last keyframe up to it and reads forward from there. All `changed`
+ * flags are set, and `position` and `fraction` hold the read positions of
+ * the ideal Paula. The next TickMODRegs() reads the tick after it. Returns
+ * 1, or 0 if `tick` lies past the end.
+ *
+ * To loop the song, seek to `rs->looptick` at the end of the stream.
+ */
+
+int SeekMODRegs(ModRegs_t *rs, uint32_t tick);
+
+/*
+ * void ApplyMODRegs(const ModRegs_t *rs, PaulaChannel_t *paula, const uint8_t *mod, uint32_t paularate);
+ *
+ * Writes the changes of the last tick to the software sampler channels
+ * `paula[0..3]`, e.g. for a mixer that runs elsewhere: `mod` is the MOD
+ * file the stream was recorded from, `paularate` the PAL clock divided by
+ * the output rate, 16.16 (3546895 * 65536 / samplerate). Mix with
+ * WrapChannelMOD()/StepChannelMOD() as with AdvanceMOD().
+ */
+
+void ApplyMODRegs(const ModRegs_t *rs, PaulaChannel_t *paula, const uint8_t *mod, uint32_t paularate);
+
+/*
+ * uint32_t RecordMODRegs(ModPlayerStatus_t *mp, const uint8_t *mod, uint32_t size, uint8_t *out, uint32_t outsize, uint32_t keyframeticks);
+ *
+ * Records the register stream of the MOD file `mod` of `size` bytes into
+ * `out`, from the start until the song loops back (see LengthMOD()), with a
+ * keyframe every `keyframeticks` ticks (0: only at the start). `*mp` is used
+ * to walk the song with ProcessMOD(). Returns the length of the stream, or 0
+ * if the file is not a valid MOD or the stream does not fit into `outsize`
+ * bytes. Needs a build without USE_STORAGE and SAMPLE_CACHE_SIZE.
+ *
+ * The stream is independent of the output rate. Tempo changes from
+ * SetTempoMOD() and pitch changes from SetPitchMOD() are not part of it.
+ */
+
+uint32_t RecordMODRegs(ModPlayerStatus_t *mp, const uint8_t *mod, uint32_t size, uint8_t *out, uint32_t outsize, uint32_t keyframeticks);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,310 @@
+/*
+ * Sample bank packer for a set of embedded songs
+ *
+ * Collects the sample data of all songs as far as the player plays it: a
+ * looping sample ends with its loop, and a sample that runs past the end
+ * of its file is cut there (see _SampleLengthMOD() in modplay.c). Every
+ * sample is then stored once in a bank shared by all songs. Identical
+ * samples share their data, and so does a sample that is contained in a
+ * longer one, e.g. the same sample with a shorter loop or with its tail
+ * after the loop trimmed. Longer samples go into the bank first, so that
+ * the shorter ones can be found in them.
+ *
+ * Every song is written to `outdir` with its patterns, the signature
+ * MOD_BANK_SIGNATURE ("BANK") and no sample data. Its sample headers hold
+ * the offset of the data in the bank (in the last 4 bytes of the name) and
+ * the length and loop the player plays, so that a player built with
+ * USE_SAMPLE_BANK renders the packed song exactly like the original. The
+ * bank is written to `outdir`/bank.bin.
+ *
+ * The report lists the size of every song before and after packing, and
+ * the flash the set takes as plain MODs and as packed songs with the bank.
+ *
+ * Usage: modbank [-o outdir] file.mod...
+ *
+ *   -o   directory for the packed songs and the bank (default .), the
+ *        songs keep their file names
+ *
+ * Only 4-channel ProTracker MODs (M.K. or M!K!) are packed.
+ */
+
+#define _GNU_SOURCE                    // memmem()
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_SONGS       64
+#define BANK_SIGNATURE  "BANK"         // MOD_BANK_SIGNATURE of modplay.h
+
+typedef struct {
+	uint32_t start;                    // Offset of the data in the file
+	uint32_t bytes, loopbytes;         // Played length and loop, as the player sets them up
+	const uint8_t *data;
+	uint8_t pad[4];                    // Data of a one-word loop, doubled
+	uint32_t bankoffset;
+} Sample_t;
+
+typedef struct {
+	const char *path;
+	uint8_t *mod;
+	uint32_t size, patternend;         // File size and end of the patterns
+	Sample_t samples[31];
+} Song_t;
+
+static Song_t g_songs[MAX_SONGS];
+static int g_numsongs;
+static const char *g_outdir = ".";
+
+static uint8_t *g_bank;
+static uint32_t g_banksize;
+
+// Placed samples, to tell identical ones from those found inside another
+static struct { uint32_t offset, bytes; } g_placed[MAX_SONGS * 31];
+static int g_numplaced;
+
+static uint16_t get16(const uint8_t *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static void put16(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+/*
+ * Played length and loop of a sample from its header, cut to the end of
+ * the file, as in _SampleLengthMOD() and _LoadMOD() of modplay.c
+ */
+static void sample_length(const Song_t *song, const uint8_t *sh, uint32_t start, uint32_t *bytes, uint32_t *loopbytes)
+{
+	uint16_t length = get16(sh + 22);
+	uint16_t looppoint = get16(sh + 26);
+	uint16_t actuallength = get16(sh + 28) + looppoint;
+	uint16_t looplength;
+
+	if (actuallength < 0x2) {
+		actuallength = length;
+		looplength = 0;
+	} else if (actuallength > length) {
+		looppoint /= 2;
+		actuallength -= looppoint;
+		looplength = actuallength - looppoint;
+	} else {
+		looplength = actuallength - looppoint;
+	}
+
+	if (looplength > actuallength)
+		looplength = 0;
+
+	if (start + actuallength * 2 > song->size) {
+		uint32_t words = (start < song->size) ? (song->size - start) / 2 : 0;
+
+		if (actuallength > words) {
+			uint32_t loopstart = actuallength - looplength;
+
+			looplength = (loopstart < words) ? words - loopstart : 0;
+			actuallength = words;
+		}
+	}
+
+	*bytes = actuallength * 2;
+	*loopbytes = looplength * 2;
+}
+
+static int load_song(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+
+	if (!f) {
+		fprintf(stderr, "%s: not found\n", path);
+		return 0;
+	}
+
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	Song_t *song = &g_songs[g_numsongs];
+	song->path = path;
+	song->mod = malloc(size > 0 ? size : 1);
+	song->size = size;
+
+	int ok = size >= 1084 && fread(song->mod, 1, size, f) == (size_t) size;
+	fclose(f);
+
+	int maxpattern = 0;
+
+	if (ok) {
+		for (int i = 0; i < 128; i++)
+			if (song->mod[952 + i] > maxpattern) maxpattern = song->mod[952 + i];
+
+		song->patternend = 1084 + 1024 * (maxpattern + 1);
+	}
+
+	if (!ok || (memcmp(song->mod + 1080, "M.K.", 4) && memcmp(song->mod + 1080, "M!K!", 4)) ||
+	    !song->mod[950] || song->patternend > song->size) {
+		fprintf(stderr, "%s: not a 4-channel MOD\n", path);
+		free(song->mod);
+		return 0;
+	}
+
+	// The sample data follows the patterns, one sample after the other
+	uint32_t start = song->patternend;
+
+	for (int i = 0; i < 31; i++) {
+		const uint8_t *sh = song->mod + 20 + 30 * i;
+		Sample_t *s = &song->samples[i];
+
+		s->start = start;
+		sample_length(song, sh, start, &s->bytes, &s->loopbytes);
+		s->data = song->mod + start;
+
+		if (s->loopbytes && s->bytes < 4) {
+			// A header cannot loop a single word, two copies loop the same
+			memcpy(s->pad, s->data, 2);
+			memcpy(s->pad + 2, s->data, 2);
+			s->data = s->pad;
+			s->bytes = s->loopbytes = 4;
+		}
+
+		start += get16(sh + 22) * 2;
+	}
+
+	g_numsongs++;
+	return 1;
+}
+
+static int by_length(const void *a, const void *b)
+{
+	const Sample_t *sa = *(Sample_t * const *) a, *sb = *(Sample_t * const *) b;
+
+	// Longest first, then in the order of the songs for a stable bank
+	if (sa->bytes != sb->bytes) return (sb->bytes > sa->bytes) - (sb->bytes < sa->bytes);
+	return (sa > sb) - (sa < sb);
+}
+
+static int write_file(const char *name, const void *data, uint32_t len)
+{
+	char path[4096];
+	const char *base = strrchr(name, '/');
+
+	snprintf(path, sizeof(path), "%s/%s", g_outdir, base ? base + 1 : name);
+
+	FILE *f = fopen(path, "wb");
+	int ok = f && fwrite(data, 1, len, f) == len;
+
+	if (f) ok &= !fclose(f);
+	if (!ok) fprintf(stderr, "%s: cannot write\n", path);
+
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	int opt, failed = 0;
+
+	while ((opt = getopt(argc, argv, "o:")) != -1) {
+		switch (opt) {
+			case 'o': g_outdir = optarg; break;
+			default:
+				fprintf(stderr, "usage: %s [-o outdir] file.mod...\n", argv[0]);
+				return 2;
+		}
+	}
+
+	if (optind >= argc || argc - optind > MAX_SONGS) {
+		fprintf(stderr, "usage: %s [-o outdir] file.mod... (at most %d)\n", argv[0], MAX_SONGS);
+		return 2;
+	}
+
+	for (int i = optind; i < argc; i++) failed += !load_song(argv[i]);
+
+	if (failed) return 1;
+
+	// Place the samples, longest first
+	static Sample_t *order[MAX_SONGS * 31];
+	uint32_t played = 0, trimmed = 0;
+	int n = 0, identical = 0, contained = 0;
+
+	for (int i = 0; i < g_numsongs; i++) {
+		for (int j = 0; j < 31; j++) {
+			Sample_t *s = &g_songs[i].samples[j];
+			uint32_t stored = get16(g_songs[i].mod + 20 + 30 * j + 22) * 2;
+
+			if (s->bytes < stored) trimmed += stored - s->bytes;
+			if (s->bytes) order[n++] = s;
+			played += s->bytes;
+		}
+	}
+
+	qsort(order, n, sizeof(order[0]), by_length);
+
+	for (int i = 0; i < n; i++) {
+		Sample_t *s = order[i];
+		const uint8_t *at = g_banksize ? memmem(g_bank, g_banksize, s->data, s->bytes) : NULL;
+
+		if (at) {
+			s->bankoffset = at - g_bank;
+
+			int same = 0;
+			for (int k = 0; k < g_numplaced && !same; k++)
+				same = g_placed[k].offset == s->bankoffset && g_placed[k].bytes == s->bytes;
+
+			identical += same;
+			contained += !same;
+		} else {
+			g_bank = realloc(g_bank, g_banksize + s->bytes);
+			memcpy(g_bank + g_banksize, s->data, s->bytes);
+			s->bankoffset = g_banksize;
+			g_banksize += s->bytes;
+		}
+
+		g_placed[g_numplaced].offset = s->bankoffset;
+		g_placed[g_numplaced++].bytes = s->bytes;
+	}
+
+	// Write the packed songs: patterns only, headers pointing into the bank
+	uint32_t before = 0, after = g_banksize;
+
+	printf("%8s %8s  file\n", "before", "after");
+
+	for (int i = 0; i < g_numsongs; i++) {
+		Song_t *song = &g_songs[i];
+
+		memcpy(song->mod + 1080, BANK_SIGNATURE, 4);
+
+		for (int j = 0; j < 31; j++) {
+			uint8_t *sh = song->mod + 20 + 30 * j;
+			const Sample_t *s = &song->samples[j];
+
+			sh[18] = s->bankoffset >> 24;
+			sh[19] = s->bankoffset >> 16;
+			sh[20] = s->bankoffset >> 8;
+			sh[21] = s->bankoffset;
+
+			// Length and loop as played, a loop of one word means none
+			put16(sh + 22, s->bytes / 2);
+			put16(sh + 26, s->loopbytes ? (s->bytes - s->loopbytes) / 2 : 0);
+			put16(sh + 28, s->loopbytes ? s->loopbytes / 2 : 1);
+		}
+
+		failed += !write_file(song->path, song->mod, song->patternend);
+
+		printf("%8u %8u  %s\n", song->size, song->patternend, song->path);
+		before += song->size;
+		after += song->patternend;
+	}
+
+	failed += !write_file("bank.bin", g_bank ? g_bank : (uint8_t *) "", g_banksize);
+
+	printf("%8s %8u  sample bank: %u bytes played in %d samples, %d identical to another, %d inside a longer one, %u bytes after loops trimmed\n",
+	       "", g_banksize, played, n, identical, contained, trimmed);
+	printf("%8u %8u  total flash of %d songs, %.1f%% saved\n", before, after, g_numsongs,
+	       before ? 100.0 * (before - (double) after) / before : 0.0);
+
+	return failed ? 1 : 0;
+}
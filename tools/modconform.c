@@ -0,0 +1,546 @@
+/*
+ * Effect conformance check
+ *
+ * Builds one tiny MOD per effect or edge case in memory, plays it tick by
+ * tick through ProcessMOD (via AdvanceMOD) and compares the per-tick trace
+ * of every channel against expected values: the period as played
+ * (including vibrato), the volume (including tremolo), the sample
+ * position, the song position and the tick length.
+ *
+ * The expected values follow ProTracker, as derived by hand in the
+ * comments of each case. Where the player intentionally computes something
+ * differently (arpeggio and finetune use frequency ratios instead of the
+ * ProTracker period tables and can be one period off), the player's
+ * value is expected and the comment says so.
+ *
+ * Usage: modconform [-v] [-w dir] [case...]
+ *
+ *   -v   print the trace of every case that is run
+ *   -w   also write the MOD of every case to `dir`, e.g. to listen to it
+ *
+ * Without arguments all cases are run. Returns non-zero if any case fails.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#define USING_EXTERNAL_RENDERING
+#include "modplay.h"
+#include "modgen.h"
+
+#define SAMPLERATE       22050
+#define MAX_TRACE        64            // Ticks traced per case
+
+enum {
+	EXPECT_PERIOD,                     // period as played on `ch`, 0 = stopped
+	EXPECT_VOLUME,                     // volume of `ch` (0-64)
+	EXPECT_PTR,                        // sample position of `ch`, in bytes
+	EXPECT_POS,                        // order `value` and row `value2`
+	EXPECT_LEN,                        // tick length in samples
+	EXPECT_LED,                        // LED filter state
+};
+
+typedef struct {
+	int index;                         // Tick since the start of the song
+	int what, ch, value, value2;
+} Expect_t;
+
+#define PERIOD(i, ch, v)     { i, EXPECT_PERIOD, ch, v, 0 }
+#define VOLUME(i, ch, v)     { i, EXPECT_VOLUME, ch, v, 0 }
+#define PTR(i, ch, v)        { i, EXPECT_PTR, ch, v, 0 }
+#define POS(i, order, row)   { i, EXPECT_POS, 0, order, row }
+#define LEN(i, v)            { i, EXPECT_LEN, 0, v, 0 }
+#define LED(i, v)            { i, EXPECT_LED, 0, v, 0 }
+
+typedef struct {
+	const char *name;
+	void (*build)(Song_t *song);
+	int numexpect;
+	const Expect_t *expect;
+} Case_t;
+
+// State of one tick, right after ProcessMOD
+typedef struct {
+	int order, row, tick, len, led;
+	int period[4], volume[4], ptr[4];
+} Trace_t;
+
+#define C2  428
+#define G2  285
+
+/*
+ * Every case starts from one pattern in one order, speed 6 at 125 BPM
+ * (441 samples per tick at 22050 Hz, so tick `t` of row `r` has index
+ * r * 6 + t). Sample 1: 1024-byte looped sawtooth at volume 64, sample 2:
+ * the same at volume 32, sample 3: the same with finetune +1
+ */
+static void base_song(Song_t *song)
+{
+	set_sample(song, 1, 1024, 0, 1024, 1);
+	set_sample(song, 2, 1024, 0, 1024, 1);
+	set_sample(song, 3, 1024, 0, 1024, 1);
+
+	song->samples[1].volume = 32;
+	song->samples[2].finetune = 1;
+
+	set_order(song, 0, 0);
+}
+
+#define CASE(name, ...) \
+	static const Expect_t expect_##name[] = { __VA_ARGS__ }; \
+	static void build_##name(Song_t *song)
+
+#define ENTRY(name, title) \
+	{ title, build_##name, sizeof(expect_##name) / sizeof(Expect_t), expect_##name }
+
+// 0xy: note, note + x, note + y semitones on ticks 0, 1, 2 and again.
+// ProTracker's table has 360 (D#2) for +3, the player's ratio gives 359
+CASE(arpeggio,
+	PERIOD(0, 0, C2), PERIOD(1, 0, 359), PERIOD(2, 0, G2),
+	PERIOD(3, 0, C2), PERIOD(4, 0, 359), PERIOD(5, 0, G2))
+{
+	base_song(song);
+	set_cell(song, 0, 0, 0, C2, 1, 0x0, 0x37);
+}
+
+// 1xx: period - xx on every tick but the first of a row
+CASE(porta_up,
+	PERIOD(0, 0, 428), PERIOD(1, 0, 424), PERIOD(5, 0, 408),
+	PERIOD(6, 0, 408), PERIOD(7, 0, 404))
+{
+	base_song(song);
+	set_cell(song, 0, 0, 0, C2, 1, 0x1, 0x04);
+	set_cell(song, 0, 1, 0, 0, 0, 0x1, 0x04);
+}
+
+// 2xx: period + xx on every tick but the first of a row
+CASE(porta_down,
+	PERIOD(0, 0, 428), PERIOD(1, 0, 436), PERIOD(5, 0, 468))
+{
+	base_song(song);
+	set_cell(song, 0, 0, 0, C2, 1, 0x2, 0x08);
+}
+
+// 3xx: slide towards the note by xx per tick without retriggering it,
+// stop exactly on the note; 300 keeps the previous speed. The sample
+// position runs on: 7 ticks at period 428 are 1160 bytes, wrapped to 136
+CASE(tone_porta,
+	PERIOD(6, 0, 428), PERIOD(7, 0, 396), PERIOD(10, 0, 300), PERIOD(11, 0, G2),
+	PERIOD(12, 0, G2), PERIOD(13, 0, G2),
+	PTR(7, 0, 136))
+{
+	base_song(song);
+	set_cell(song, 0, 0, 0, C2, 1, 0x0, 0x00);
+	set_cell(song, 0, 1, 0, G2, 0, 0x3, 0x20);
+	set_cell(song, 0, 2, 0, 0, 0, 0x3, 0x00);
+}
+
+// 5xy: tone portamento at the previous speed plus volume slide
+CASE(tone_porta_volslide,
+	PERIOD(11, 0, 348), PERIOD(12, 0, 348), PERIOD(13, 0, 332), PERIOD(16, 0, G2), PERIOD(17, 0, G2),
+	VOLUME(12, 0, 64), VOLUME(13, 0, 60), VOLUME(17, 0, 44))
+{
+	base_song(song);
+	set_cell(song, 0, 0, 0, C2, 1, 0x0, 0x00);
+	set_cell(song, 0, 1, 0, G2, 0, 0x3, 0x10);
+	set_cell(song, 0, 2, 0, 0, 0, 0x5, 0x04);
+}
+
+// 4xy: sine vibrato, speed 4 (phase steps of 4/64) and depth 8:
+// period + sine * 8 / 128. A new row keeps the phase and the current offset
+CASE(vibrato,
+	PERIOD(0, 0, 428), PERIOD(1, 0, 434), PERIOD(2, 0, 439), PERIOD(3, 0, 442),
+	PERIOD(4, 0, 443), PERIOD(5, 0, 442), PERIOD(6, 0, 442), PERIOD(7, 0, 439),
+	PERIOD(9, 0, 428), PERIOD(10, 0, 421), PERIOD(11, 0, 416))
+{
+	base_song(song);
+	set_cell(song, 0, 0, 0, C2, 1, 0x4, 0x48);
+	set_cell(song, 0, 1, 0, 0, 0, 0x4, 0x00);
+}
+
+// 6xy: vibrato goes on with its previous settings, plus volume slide
+CASE(vibrato_volslide,
+	PERIOD(6, 0, 442), PERIOD(7, 0, 439), PERIOD(9, 0, 428), PERIOD(11, 0, 416),
+	VOLUME(6, 0, 32), VOLUME(7, 0, 28), VOLUME(11, 0, 12))
+{
+	base_song(song);
+	set_cell(song, 0, 0, 0, C2, 2, 0x4, 0x48);
+	set_cell(song, 0, 1, 0, 0, 0, 0x6, 0x04);
+}
+
+// 7xy: sine tremolo, speed 4 and depth 8: volume + sine * 8 / 64
+CASE(tremolo,
+	VOLUME(0, 0, 32), VOLUME(1, 0, 44), VOLUME(2, 0, 54), VOLUME(3, 0, 61),
+	VOLUME(4, 0, 63), VOLUME(5, 0, 61))
+{
+	base_song(song);
+	set_cell(song, 0, 0, 0, C2, 2, 0x7, 0x48);
+}
+
+// Axy: volume - y or + x on every tick but the first, clamped to 0-64
+CASE(volslide,
+	VOLUME(0, 0, 32), VOLUME(1, 0, 28), VOLUME(5, 0, 12),
+	VOLUME(6, 0, 12), VOLUME(7, 0, 15), VOLUME(11, 0, 27),
+	VOLUME(12, 0, 27), VOLUME(13, 0, 42), VOLUME(14, 0, 57), VOLUME(15, 0, 64), VOLUME(17, 0, 64))
+{
+	base_song(song);
+	set_cell(song, 0, 0, 0, C2, 2, 0xA, 0x04);
+	set_cell(song, 0, 1, 0, 0, 0, 0xA, 0x30);
+	set_cell(song, 0, 2, 0, 0, 0, 0xA, 0xF0);
+}
+
+// 9xx: start the note at xx * 256 bytes, 900 reuses the last offset.
+// 441 samples at period 428 step 165 bytes into the sample
+CASE(sample_offset,
+	PTR(0, 0, 512), PTR(1, 0, 677), PTR(6, 0, 512), PTR(12, 0, 0))
+{
+	base_song(song);
+	set_cell(song, 0, 0, 0, C2, 1, 0x9, 0x02);
+	set_cell(song, 0, 1, 0, C2, 1, 0x9, 0x00);
+	set_cell(song, 0, 2, 0, C2, 1, 0x0, 0x00);
+}
+
+// Bxx: go to order xx after the current row
+CASE(position_jump,
+	POS(12, 0, 2), POS(18, 2, 0), POS(24, 2, 1))
+{
+	base_song(song);
+	set_order(song, 1, 1);
+	set_order(song, 2, 2);
+	set_cell(song, 0, 2, 0, 0, 0, 0xB, 0x02);
+}
+
+// Dxx: go to row xx (decimal) of the next order after the current row
+CASE(pattern_break,
+	POS(6, 0, 1), POS(12, 1, 12), POS(18, 1, 13))
+{
+	base_song(song);
+	set_order(song, 1, 1);
+	set_cell(song, 0, 1, 0, 0, 0, 0xD, 0x12);
+}
+
+// Bxx and Dxx on the same row: row of Dxx in the order of Bxx
+CASE(jump_and_break,
+	POS(6, 2, 5))
+{
+	base_song(song);
+	set_order(song, 1, 1);
+	set_order(song, 2, 2);
+	set_cell(song, 0, 0, 0, 0, 0, 0xB, 0x02);
+	set_cell(song, 0, 0, 1, 0, 0, 0xD, 0x05);
+}
+
+// E1x/E2x: period -/+ x once, on the first tick of the row
+CASE(fine_porta,
+	PERIOD(0, 0, 425), PERIOD(5, 0, 425), PERIOD(6, 0, 427), PERIOD(11, 0, 427))
+{
+	base_song(song);
+	set_cell(song, 0, 0, 0, C2, 1, 0xE, 0x13);
+	set_cell(song, 0, 1, 0, 0, 0, 0xE, 0x22);
+}
+
+// E5x overrides the sample's finetune for the note on its row. ProTracker's
+// tables have 433 (finetune -1) and 425 (+1), the player's ratios give 431 and 424
+CASE(finetune,
+	PERIOD(0, 0, 431), PERIOD(6, 0, 424), PERIOD(12, 0, C2))
+{
+	base_song(song);
+	set_cell(song, 0, 0, 0, C2, 1, 0xE, 0x5F);
+	set_cell(song, 0, 1, 0, C2, 3, 0x0, 0x00);
+	set_cell(song, 0, 2, 0, C2, 1, 0x0, 0x00);
+}
+
+// E60 marks the loop start, E6x repeats from there x more times. At speed 1:
+// rows 0, 1, 2, 3, 1, 2, 3, 1, 2, 3, 4. The loop must not touch the
+// tremolo waveform (E7x): the tremolo on row 4 is still a sine, so it
+// starts at phase 0 with offset 0
+CASE(pattern_loop,
+	POS(0, 0, 0), POS(3, 0, 3), POS(4, 0, 1), POS(7, 0, 1), POS(9, 0, 3), POS(10, 0, 4),
+	VOLUME(10, 0, 32))
+{
+	base_song(song);
+	set_cell(song, 0, 0, 1, 0, 0, 0xF, 0x01);
+	set_cell(song, 0, 1, 0, 0, 0, 0xE, 0x60);
+	set_cell(song, 0, 3, 0, 0, 0, 0xE, 0x62);
+	set_cell(song, 0, 4, 0, C2, 2, 0x7, 0x48);
+}
+
+// EEx: the row lasts x + 1 times as long. Its notes are not triggered
+// again, but its per-tick effects go on through the delay as in
+// ProTracker: 17 slides of 4 on ticks 1 to 17
+CASE(pattern_delay,
+	POS(6, 0, 1), POS(23, 0, 1), POS(24, 0, 2),
+	PERIOD(23, 1, 360), PERIOD(24, 1, 360))
+{
+	base_song(song);
+	set_cell(song, 0, 0, 1, C2, 1, 0x0, 0x00);
+	set_cell(song, 0, 1, 0, 0, 0, 0xE, 0xE2);
+	set_cell(song, 0, 1, 1, 0, 0, 0x1, 0x04);
+}
+
+// E9x: restart the sample every x ticks
+CASE(retrigger,
+	PTR(0, 0, 0), PTR(1, 0, 165), PTR(3, 0, 0), PTR(4, 0, 165))
+{
+	base_song(song);
+	set_cell(song, 0, 0, 0, C2, 1, 0xE, 0x93);
+}
+
+// EAx/EBx: volume + / - x once, on the first tick of the row
+CASE(fine_volslide,
+	VOLUME(0, 0, 36), VOLUME(5, 0, 36), VOLUME(6, 0, 28), VOLUME(11, 0, 28))
+{
+	base_song(song);
+	set_cell(song, 0, 0, 0, C2, 2, 0xE, 0xA4);
+	set_cell(song, 0, 1, 0, 0, 0, 0xE, 0xB8);
+}
+
+// ECx: volume 0 from tick x on
+CASE(note_cut,
+	VOLUME(0, 0, 64), VOLUME(1, 0, 64), VOLUME(2, 0, 0), VOLUME(5, 0, 0))
+{
+	base_song(song);
+	set_cell(song, 0, 0, 0, C2, 1, 0xE, 0xC2);
+}
+
+// EDx: the note starts on tick x, the previous one plays until then.
+// One tick at period 285 is 248 bytes
+CASE(note_delay,
+	PERIOD(6, 0, C2), PERIOD(8, 0, C2), PERIOD(9, 0, G2), PTR(9, 0, 0), PTR(10, 0, 248))
+{
+	base_song(song);
+	set_cell(song, 0, 0, 0, C2, 1, 0x0, 0x00);
+	set_cell(song, 0, 1, 0, G2, 1, 0xE, 0xD3);
+}
+
+// Cxx: volume xx, at most 64
+CASE(set_volume,
+	VOLUME(0, 0, 32), VOLUME(6, 0, 64))
+{
+	base_song(song);
+	set_cell(song, 0, 0, 0, C2, 1, 0xC, 0x20);
+	set_cell(song, 0, 1, 0, 0, 0, 0xC, 0x50);
+}
+
+// Fxx below 0x20: ticks per row
+CASE(speed,
+	POS(2, 0, 0), POS(3, 0, 1), POS(6, 0, 2))
+{
+	base_song(song);
+	set_cell(song, 0, 0, 0, 0, 0, 0xF, 0x03);
+}
+
+// Fxx from 0x20: BPM, a tick lasts samplerate * 2.5 / BPM samples with the
+// fraction spread over the ticks: 441 at 125, 220.5 at 250, 1722.66 at 32
+CASE(tempo,
+	LEN(0, 441), LEN(6, 220), LEN(7, 221), LEN(8, 220), LEN(11, 221),
+	LEN(12, 1722), LEN(13, 1723))
+{
+	base_song(song);
+	set_cell(song, 0, 0, 0, 0, 0, 0xF, 0x7D);
+	set_cell(song, 0, 1, 0, 0, 0, 0xF, 0xFA);
+	set_cell(song, 0, 2, 0, 0, 0, 0xF, 0x20);
+}
+
+// E0x: x = 0 turns the LED filter on, 1 off
+CASE(led_filter,
+	LED(0, 1), LED(5, 1), LED(6, 0))
+{
+	base_song(song);
+	set_cell(song, 0, 0, 0, 0, 0, 0xE, 0x00);
+	set_cell(song, 0, 1, 0, 0, 0, 0xE, 0x01);
+}
+
+// A note without a sample number plays at the new period with the
+// current sample; a sample number alone resets the volume only
+CASE(note_without_sample,
+	PERIOD(6, 0, G2), PTR(6, 0, 0), VOLUME(6, 0, 32),
+	PERIOD(12, 0, G2), VOLUME(12, 0, 64))
+{
+	base_song(song);
+	set_cell(song, 0, 0, 0, C2, 2, 0x0, 0x00);
+	set_cell(song, 0, 1, 0, G2, 0, 0x0, 0x00);
+	set_cell(song, 0, 2, 0, 0, 1, 0x0, 0x00);
+}
+
+static const Case_t cases[] = {
+	ENTRY(arpeggio, "0xy-arpeggio"),
+	ENTRY(porta_up, "1xx-porta-up"),
+	ENTRY(porta_down, "2xx-porta-down"),
+	ENTRY(tone_porta, "3xx-tone-porta"),
+	ENTRY(vibrato, "4xy-vibrato"),
+	ENTRY(tone_porta_volslide, "5xy-porta-volslide"),
+	ENTRY(vibrato_volslide, "6xy-vibrato-volslide"),
+	ENTRY(tremolo, "7xy-tremolo"),
+	ENTRY(sample_offset, "9xx-sample-offset"),
+	ENTRY(volslide, "Axy-volslide"),
+	ENTRY(position_jump, "Bxx-position-jump"),
+	ENTRY(set_volume, "Cxx-set-volume"),
+	ENTRY(pattern_break, "Dxx-pattern-break"),
+	ENTRY(jump_and_break, "BD-jump-and-break"),
+	ENTRY(led_filter, "E0x-led-filter"),
+	ENTRY(fine_porta, "E12-fine-porta"),
+	ENTRY(finetune, "E5x-finetune"),
+	ENTRY(pattern_loop, "E6x-pattern-loop"),
+	ENTRY(retrigger, "E9x-retrigger"),
+	ENTRY(fine_volslide, "EAB-fine-volslide"),
+	ENTRY(note_cut, "ECx-note-cut"),
+	ENTRY(note_delay, "EDx-note-delay"),
+	ENTRY(pattern_delay, "EEx-pattern-delay"),
+	ENTRY(speed, "Fxx-speed"),
+	ENTRY(tempo, "Fxx-tempo"),
+	ENTRY(note_without_sample, "note-without-sample"),
+};
+
+#define NUM_CASES        ((int)(sizeof(cases) / sizeof(cases[0])))
+
+static Song_t g_song;
+static uint8_t g_mod[MAX_MOD_SIZE];
+static size_t g_modsize;
+static Trace_t g_trace[MAX_TRACE];
+
+static int g_verbose = 0;
+static const char *g_outdir = NULL;
+
+/*
+ * Plays the first MAX_TRACE ticks of the song in g_mod into g_trace
+ */
+static void trace_song(void)
+{
+	static ModPlayerStatus_t mp;
+
+	InitMOD(&mp, g_mod, g_modsize, SAMPLERATE);
+
+	for (int i = 0; i < MAX_TRACE; i++) {
+		Trace_t *t = &g_trace[i];
+
+		// Position of the tick that ProcessMOD is about to process
+		t->order = mp.order;
+		t->row = mp.row;
+		t->tick = mp.tick;
+
+		// One tick: AdvanceMOD stops where the next one starts
+		t->len = AdvanceMOD(&mp, 1 << 30);
+		t->led = mp.ledfilter;
+
+		for (int ch = 0; ch < 4; ch++) {
+			PaulaChannel_t *pch = &mp.paula[ch];
+
+			t->period[ch] = mp.ch[ch].period ? mp.ch[ch].period + (mp.ch[ch].vibrato.val >> 7) : 0;
+			t->volume[ch] = pch->volume;
+			t->ptr[ch] = pch->currentptr;
+
+			// Step through the tick as the mixer does
+			for (int s = 0; s < t->len && pch->sample; s++) {
+				if (!WrapChannelMOD(pch)) break;
+				StepChannelMOD(pch);
+			}
+
+			// Report wrapped positions, as the mixer would read them
+			if (pch->sample) WrapChannelMOD(pch);
+		}
+	}
+}
+
+static void print_trace(int upto)
+{
+	printf("  tick ord row  t  len led  period/volume/ptr ch0..ch3\n");
+
+	for (int i = 0; i < upto && i < MAX_TRACE; i++) {
+		const Trace_t *t = &g_trace[i];
+
+		printf("  %4d %3d %3d %2d %4d %3d ", i, t->order, t->row, t->tick, t->len, t->led);
+
+		for (int ch = 0; ch < 4; ch++) printf("  %3d/%2d/%4d", t->period[ch], t->volume[ch], t->ptr[ch]);
+
+		printf("\n");
+	}
+}
+
+static int check_case(const Case_t *c)
+{
+	static const char *names[] = { "period", "volume", "ptr", "pos", "len", "led" };
+	int failed = 0, last = 0;
+
+	memset(&g_song, 0, sizeof(g_song));
+	snprintf(g_song.title, sizeof(g_song.title), "%s", c->name);
+	c->build(&g_song);
+	g_modsize = PackMOD(&g_song, g_mod);
+
+	if (g_outdir) {
+		char path[4096];
+
+		snprintf(path, sizeof(path), "%s/%s.mod", g_outdir, c->name);
+		if (!WriteMOD(&g_song, path)) fprintf(stderr, "%s: cannot write\n", path);
+	}
+
+	trace_song();
+
+	for (int i = 0; i < c->numexpect; i++) {
+		const Expect_t *e = &c->expect[i];
+		const Trace_t *t = &g_trace[e->index];
+		int got = 0, got2 = 0;
+
+		switch (e->what) {
+			case EXPECT_PERIOD: got = t->period[e->ch]; break;
+			case EXPECT_VOLUME: got = t->volume[e->ch]; break;
+			case EXPECT_PTR:    got = t->ptr[e->ch]; break;
+			case EXPECT_POS:    got = t->order; got2 = t->row; break;
+			case EXPECT_LEN:    got = t->len; break;
+			case EXPECT_LED:    got = t->led; break;
+		}
+
+		if (e->index > last) last = e->index;
+		if (got == e->value && got2 == e->value2) continue;
+
+		if (!failed) printf("FAIL  %s\n", c->name);
+		failed = 1;
+
+		if (e->what == EXPECT_POS)
+			printf("  tick %d: expected order %d row %d, got order %d row %d\n", e->index, e->value, e->value2, got, got2);
+		else
+			printf("  tick %d, channel %d: expected %s %d, got %d\n", e->index, e->ch, names[e->what], e->value, got);
+	}
+
+	if (!failed) printf("ok    %s\n", c->name);
+	if (failed || g_verbose) print_trace(last + 2);
+
+	return !failed;
+}
+
+int main(int argc, char **argv)
+{
+	int opt, run = 0, passed = 0;
+
+	while ((opt = getopt(argc, argv, "vw:")) != -1) {
+		switch (opt) {
+			case 'v': g_verbose = 1; break;
+			case 'w': g_outdir = optarg; break;
+			default:
+				fprintf(stderr, "usage: %s [-v] [-w dir] [case...]\n", argv[0]);
+				return 2;
+		}
+	}
+
+	for (int i = 0; i < NUM_CASES; i++) {
+		int selected = optind >= argc;
+
+		for (int a = optind; a < argc; a++) selected |= !strcmp(argv[a], cases[i].name);
+		if (!selected) continue;
+
+		passed += check_case(&cases[i]);
+		run++;
+	}
+
+	if (!run) {
+		fprintf(stderr, "no such case\n");
+		return 2;
+	}
+
+	printf("%d of %d cases passed\n", passed, run);
+
+	return passed == run ? 0 : 1;
+}
@@ -0,0 +1,459 @@
+/*
+ * Offline CPU cost predictor for the render IRQ on the device
+ *
+ * Walks a song with ProcessMOD (through AdvanceMOD) and steps the channels
+ * exactly like the mixer does, without producing audio. For every IRQ
+ * block it records what the mixer has to do: active voices, loop wraps,
+ * ticks, row decodes, channels running an effect and period to step
+ * conversions. A cost model turns
+ * these counts into cycles for each supported MCU.
+ *
+ * Usage: modcost [-r samplerate] [-b block] [-i] [-f] [-s scale] [-l limit%] [-c spread%] [-g] file.mod...
+ *
+ *   -r   output sample rate (default 22050, as in main.c)
+ *   -b   samples rendered per IRQ (default 64, half of BUF_SAMPLES in main.c)
+ *   -i   model a build with USE_LINEAR_INTERPOLATION=1
+ *   -f   model RenderMOD/ProcessMOD running from flash instead of SRAM
+ *   -s   multiply all predictions, to calibrate against a device measurement
+ *   -l   mark orders whose peak exceeds this share of the IRQ period (default 80)
+ *   -c   print the shortest and longest IRQ, and fail if they are further
+ *        apart than this share of the average IRQ
+ *   -g   play every song at the gain GainMOD() finds for it, as main.c
+ *        does with the gains in songs.h, which adds clipping to the ticks
+ *        whose mix can exceed the output range
+ *
+ * The output is one line per order with the average voices, the loop
+ * wraps and the largest channel step of its slowest block, and the average
+ * and peak CPU load per MCU, followed by the predicted peak of the song.
+ *
+ * Cost model: the instruction counts below were taken from the hot paths of
+ * modplay.c (RenderMOD with the delta-sigma modulator, _MixMOD,
+ * WrapChannelMOD/StepChannelMOD and ProcessMOD) in the configuration of
+ * main.c. The cycles per instruction were then fitted to the profiler
+ * output in README.md (CH32V002 at 48 MHz playing test.mod: 936 us per
+ * 128 samples from SRAM, 1434 us from flash, measured before main.c used
+ * USE_PERIOD_TABLE). Cores without a multiplier
+ * (CH32V003) pay a libgcc __mulsi3 call per multiplication instead.
+ * The numbers are estimates, compare with the IRQ max printout of the
+ * device for a song before relying on small margins, and use -s to
+ * calibrate.
+ *
+ * Built with USE_STEREO_PWM, the model adds the second delta-sigma
+ * modulator per output sample and the panning of every voice to both
+ * sides, which costs a multiplication (a libgcc call on CH32V003). The
+ * header line shows what the second modulator alone costs per block.
+ *
+ * The modulator costs OSR duty values per output sample, build with the
+ * OSR of the device (default 8). Built with USE_DSM_INTERPOLATION, each
+ * modulator also ramps between samples, which costs a few instructions
+ * per sample and per duty value, and a division by OSR when that is not a
+ * power of 2. Mixing at a lower rate with a larger OSR (-r 11025 with
+ * OSR 16) halves the work per voice, while the duty values stay the same.
+ *
+ * Built with USE_ROW_PREDECODE, the pattern cells are counted on the
+ * ticks that decode them, before their row, and the start of the row
+ * only pays for applying them.
+ *
+ * Built with USE_CONSTANT_TIME, every channel slot is a voice on every
+ * sample, and a loop wraps at most once per sample.
+ *
+ * Built with SAMPLE_CACHE_SIZE, voices that play from the SRAM copy of
+ * their loop save the wait states of the sample load from flash, which
+ * the fitted CPI includes for every voice. The hit rate of the cache is
+ * printed per song.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#define USING_EXTERNAL_RENDERING
+#include "modplay.h"
+
+// Instructions per unit of work, RV32EC/RV32EmC
+#define INS_SAMPLE       42            // Per output sample: tick check, channel loop, scaling, DSM setup
+#define INS_PWM          4             // Per duty value (OSR per sample): DSM add, carry, add, store
+#define INS_VOICE        27            // Per active voice and sample: wrap check, load, volume, step
+#define INS_INTERP       19            // Per active voice and sample with linear interpolation
+#define INS_WRAP         7             // Per loop wrap of a voice
+#define INS_TICK         140           // Per tick: ProcessMOD entry, counters, volume clamping
+#define INS_DECODE       60            // Per pattern cell decoded: cell, sample header, finetune
+#define INS_APPLY        35            // Per channel at the start of a row: trigger, row effects
+#define INS_EFFECT       45            // Per channel running an effect, per tick
+#if USE_PERIOD_TABLE
+#define INS_PERIOD       18            // Per channel with a period, per tick (step table lookup)
+#else
+#define INS_PERIOD       150           // Per channel with a period, per tick (software division)
+#endif
+#define INS_MULCALL      38            // Per multiplication on cores without a multiplier
+#define INS_DSM          12            // Per output sample, setup of the second modulator of stereo PWM
+#define INS_PAN          6             // Per active voice and sample, stereo panning (and a multiplication)
+#define INS_RAMP         10            // Per output sample and modulator, ramp setup (USE_DSM_INTERPOLATION)
+#define INS_RAMP_PWM     3             // Per duty value with the ramp: step, split, fraction
+#define INS_DIVCALL      150           // Per division by OSR on cores without a multiplier
+#define INS_CLIP         5             // Per output sample and modulator on ticks that clip: compares, clamp
+
+#ifndef OSR
+#define OSR 8
+#endif
+
+#ifndef USE_STEREO_PWM
+#define USE_STEREO_PWM 0
+#endif
+
+#ifndef USE_DSM_INTERPOLATION
+#define USE_DSM_INTERPOLATION 0
+#endif
+
+#ifndef USE_CONSTANT_TIME
+#define USE_CONSTANT_TIME 0
+#endif
+
+// Delta-sigma modulators, and the division of the ramp step by a non-power of 2 OSR
+#define MODULATORS       (USE_STEREO_PWM ? 2 : 1)
+#define RAMP_DIVISION    (USE_DSM_INTERPOLATION && (OSR & (OSR - 1)))
+
+// Flash wait cycles per sample load, saved by voices playing from the sample
+// cache (one wait state at 48 MHz, plus the stall of the load-use pipeline)
+#define FLASH_LOAD_WAIT  2
+
+// Cycles per instruction, fitted to the profiler output in README.md
+#define CPI_SRAM         1.96
+#define CPI_FLASH        3.00
+
+#define MAX_ORDERS       128
+
+typedef struct {
+	const char *name;
+	uint32_t clock;                    // Hz
+	int hwmul;                         // Multiply instruction available
+} Mcu_t;
+
+static const Mcu_t mcus[] = {
+	{ "CH32V002", 48000000, 1 },       // QingKe V2C, RV32EmC
+	{ "CH32V003", 48000000, 0 },       // QingKe V2A, RV32EC
+	{ "CH32V006", 48000000, 1 },       // QingKe V2C, RV32EmC
+};
+
+#define NUM_MCUS         ((int)(sizeof(mcus) / sizeof(mcus[0])))
+
+// Work done while rendering one IRQ block
+typedef struct {
+	uint32_t voices;                   // Sum over samples of the active voices
+	uint32_t cached;                   // Voices of `voices` playing from the sample cache
+	uint32_t wraps;                    // Loop wraps of all voices
+	uint32_t ticks, rows, cells, effects, periods;  // `rows`: channels at the start of a row
+	uint32_t maxstep;                  // Largest channel step, 16.16
+	uint32_t clipped;                  // Samples rendered with clipping (SetGainMOD)
+	int order;                         // Order playing at the start of the block
+} Work_t;
+
+typedef struct {
+	int pattern;
+	uint32_t blocks;
+	double voices;                     // Sum of the average voices of each block
+	Work_t peakwork;                   // Counts of the slowest block
+	double cycles[NUM_MCUS], peak[NUM_MCUS];
+} OrderStats_t;
+
+static uint32_t g_samplerate = 22050;
+static int g_block = 64;
+static int g_interpolation = 0;
+static double g_cpi = CPI_SRAM;
+static double g_scale = 1.0;
+static double g_limit = 80;
+static double g_spread = 0;
+static int g_gain = 0;
+static int g_playing;                  // Order of the tick being played
+
+static double block_cycles(const Work_t *w, int samples, const Mcu_t *mcu)
+{
+	// Multiplications: volume per voice (two more with interpolation),
+	// one for the interpolation weight of every voice. With the ramp and
+	// an OSR that is not a power of 2, the division of the step by OSR is
+	// a multiplication by its reciprocal (a libgcc division on CH32V003)
+	double muls = w->voices * ((g_interpolation ? 3 : 1) + USE_STEREO_PWM);
+	double ins = samples * (double) (INS_SAMPLE + MODULATORS * OSR * INS_PWM) + w->voices * (double) INS_VOICE + w->wraps * (double) INS_WRAP +
+		w->ticks * (double) INS_TICK + w->rows * (double) INS_APPLY + w->cells * (double) INS_DECODE + w->effects * (double) INS_EFFECT +
+		w->periods * (double) INS_PERIOD;
+
+	if (g_interpolation) ins += w->voices * (double) INS_INTERP;
+	if (USE_STEREO_PWM) ins += samples * (double) INS_DSM + w->voices * (double) INS_PAN;
+	if (USE_DSM_INTERPOLATION) ins += samples * MODULATORS * (double) (INS_RAMP + OSR * INS_RAMP_PWM);
+	ins += w->clipped * MODULATORS * (double) INS_CLIP;
+	if (RAMP_DIVISION) muls += samples * MODULATORS;
+	if (!mcu->hwmul) ins += muls * INS_MULCALL;
+	if (!mcu->hwmul && RAMP_DIVISION) ins += samples * MODULATORS * (double) (INS_DIVCALL - INS_MULCALL);
+
+	return (ins * g_cpi - w->cached * (double) FLASH_LOAD_WAIT) * g_scale;
+}
+
+/*
+ * Renders `len` samples of `*mp` without output, counting the work in `*w`
+ */
+static void walk_block(ModPlayerStatus_t *mp, int len, Work_t *w)
+{
+	for (int s = 0; s < len; ) {
+		// ProcessMOD runs in the next AdvanceMOD call, and decodes a row on tick 0
+		int ticked = mp->audiotick <= 0;
+
+		if (ticked) {
+			w->ticks++;
+			if (mp->tick == 0) w->rows += 4;
+#if !USE_ROW_PREDECODE
+			if (mp->tick == 0) w->cells += 4;
+#endif
+
+			// ProcessMOD moves on to the position of the next tick
+			g_playing = mp->order;
+		}
+
+		if (s == 0) w->order = g_playing;
+
+#if USE_ROW_PREDECODE
+		// Cells are decoded on the ticks before their row
+		uint32_t decoded = mp->cellsdecoded;
+#endif
+		int n = AdvanceMOD(mp, len - s);
+
+#if USE_ROW_PREDECODE
+		w->cells += mp->cellsdecoded - decoded;
+#endif
+		if (mp->saturate) w->clipped += n;
+
+		if (ticked) {
+			// Per channel work of the tick just processed
+			for (int ch = 0; ch < 4; ch++) {
+				if (mp->ch[ch].eff || mp->ch[ch].effval) w->effects++;
+				if (mp->ch[ch].period) w->periods++;
+			}
+		}
+
+		for (int ch = 0; ch < 4; ch++) {
+			PaulaChannel_t *pch = &mp->paula[ch];
+
+			if (pch->period > w->maxstep) w->maxstep = pch->period;
+
+#if USE_CONSTANT_TIME
+			// Every slot is a voice, silent ones mix a stand-in
+			w->voices += n;
+
+			for (int i = 0; i < n && pch->sample; i++) {
+				uint32_t ptr = pch->currentptr;
+
+				if (!WrapChannelOnceMOD(pch)) break;
+
+				if (pch->currentptr != ptr) w->wraps++;
+#if SAMPLE_CACHE_SIZE
+				if (pch->sample != pch->data) w->cached++;
+#endif
+				StepChannelMOD(pch);
+			}
+#else
+			for (int i = 0; i < n && pch->sample; i++) {
+				uint32_t ptr = pch->currentptr;
+
+				if (!WrapChannelMOD(pch)) break;
+
+				if (pch->currentptr != ptr) w->wraps += (ptr - pch->currentptr) / pch->looplength;
+
+				w->voices++;
+#if SAMPLE_CACHE_SIZE
+				if (pch->sample != pch->data) w->cached++;
+#endif
+				StepChannelMOD(pch);
+			}
+#endif
+		}
+
+		s += n;
+	}
+}
+
+static int cost_song(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+
+	if (!f) {
+		fprintf(stderr, "%s: not found\n", path);
+		return 0;
+	}
+
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	uint8_t *mod = malloc(size > 0 ? size : 1);
+	int ok = size >= 1084 && fread(mod, 1, size, f) == (size_t) size;
+	fclose(f);
+
+	static ModPlayerStatus_t mp;
+
+	if (!ok || !InitMOD(&mp, mod, size, g_samplerate)) {
+		fprintf(stderr, "%s: not a 4-channel MOD\n", path);
+		free(mod);
+		return 0;
+	}
+
+	uint32_t length = LengthMOD(&mp, mod, size, g_samplerate);
+	uint32_t gain = g_gain ? GainMOD(&mp, mod, size, g_samplerate) : 0x10000;
+	InitMOD(&mp, mod, size, g_samplerate);
+	SetGainMOD(&mp, gain);
+	g_playing = 0;
+
+	static OrderStats_t orders[MAX_ORDERS];
+	double total[NUM_MCUS] = {0}, peak[NUM_MCUS] = {0}, least[NUM_MCUS];
+	int peakorder[NUM_MCUS] = {0};
+	uint32_t blocks = 0;
+	uint64_t voices = 0, cached = 0, clipped = 0;
+
+	memset(orders, 0, sizeof(orders));
+
+	// Cycles available per IRQ block
+	double budget[NUM_MCUS];
+	for (int m = 0; m < NUM_MCUS; m++) {
+		budget[m] = (double) mcus[m].clock * g_block / g_samplerate;
+		least[m] = budget[m] * 1e9;
+	}
+
+	for (uint32_t pos = 0; pos + g_block <= length; pos += g_block) {
+		Work_t w = {0};
+
+		walk_block(&mp, g_block, &w);
+
+		int order = w.order;
+		OrderStats_t *os = &orders[order];
+		os->pattern = mp.ordertable[order];
+		os->blocks++;
+		os->voices += (double) w.voices / g_block;
+		voices += w.voices;
+		cached += w.cached;
+		clipped += w.clipped;
+
+		for (int m = 0; m < NUM_MCUS; m++) {
+			double c = block_cycles(&w, g_block, &mcus[m]);
+
+			os->cycles[m] += c;
+			total[m] += c;
+
+			if (c > os->peak[m]) {
+				os->peak[m] = c;
+				if (m == 0) os->peakwork = w;
+			}
+
+			if (c > peak[m]) {
+				peak[m] = c;
+				peakorder[m] = order;
+			}
+
+			if (c < least[m]) least[m] = c;
+		}
+
+		blocks++;
+	}
+
+	if (!blocks) {
+		fprintf(stderr, "%s: shorter than one block\n", path);
+		free(mod);
+		return 0;
+	}
+
+	printf("%s: %u Hz, %d samples per IRQ (%.0f us), code in %s%s", path, g_samplerate, g_block,
+	       1e6 * g_block / g_samplerate, g_cpi == CPI_SRAM ? "SRAM" : "flash",
+	       g_interpolation ? ", linear interpolation" : "");
+
+	if (OSR != 8 || USE_DSM_INTERPOLATION) printf(", OSR %d%s", OSR, USE_DSM_INTERPOLATION ? " with ramp" : "");
+
+	if (USE_STEREO_PWM) {
+		printf(", stereo PWM (second modulator %.0f us per IRQ at %u MHz)", g_block * (INS_DSM + OSR * INS_PWM) * g_cpi * g_scale * 1e6 / mcus[0].clock,
+		       mcus[0].clock / 1000000);
+	}
+
+	printf("\n");
+
+	if (g_gain) printf("gain %.2f, %.1f%% of the samples rendered with clipping\n", gain / 65536.0, 100.0 * clipped / ((double) blocks * g_block));
+
+#if SAMPLE_CACHE_SIZE
+	printf("sample cache: %d bytes, %.1f%% of the voice samples read from SRAM\n", SAMPLE_CACHE_SIZE,
+	       voices ? 100.0 * cached / voices : 0.0);
+#endif
+
+	printf("order pat voices wraps  step ");
+	for (int m = 0; m < NUM_MCUS; m++) printf(" %8s avg/peak%%", mcus[m].name);
+	printf("\n");
+
+	for (int i = 0; i < MAX_ORDERS; i++) {
+		const OrderStats_t *os = &orders[i];
+		int over = 0;
+
+		if (!os->blocks) continue;
+
+		printf("%5d %3d %6.2f %5u %5.2f ", i, os->pattern, os->voices / os->blocks,
+		       os->peakwork.wraps, os->peakwork.maxstep / 65536.0);
+
+		for (int m = 0; m < NUM_MCUS; m++) {
+			double p = 100 * os->peak[m] / budget[m];
+
+			printf(" %9.1f /%6.1f", 100 * os->cycles[m] / os->blocks / budget[m], p);
+			over |= p > g_limit;
+		}
+
+		printf("%s\n", over ? "  !" : "");
+	}
+
+	int steady = 1;
+
+	for (int m = 0; m < NUM_MCUS; m++) {
+		double p = 100 * peak[m] / budget[m];
+
+		printf("%s: average %.1f%%, peak %.1f%% in order %d (%.0f us per IRQ)%s\n", mcus[m].name,
+		       100 * total[m] / blocks / budget[m], p, peakorder[m], peak[m] * 1e6 / mcus[m].clock,
+		       p > 100 ? ", DOES NOT FIT" : (p > g_limit ? ", over the limit" : ""));
+
+		if (g_spread > 0) {
+			// Spread of the IRQ duration, as (max - min) / avg of the profiler output
+			double spread = 100 * (peak[m] - least[m]) * blocks / total[m];
+
+			printf("%s: %.0f to %.0f us per IRQ, spread %.1f%%%s\n", mcus[m].name, least[m] * 1e6 / mcus[m].clock,
+			       peak[m] * 1e6 / mcus[m].clock, spread, spread > g_spread ? ", OVER THE SPREAD LIMIT" : "");
+			steady &= spread <= g_spread;
+		}
+	}
+
+	printf("\n");
+	free(mod);
+
+	return steady;
+}
+
+int main(int argc, char **argv)
+{
+	int opt, failed = 0;
+
+	while ((opt = getopt(argc, argv, "r:b:ifs:l:c:g")) != -1) {
+		switch (opt) {
+			case 'r': g_samplerate = atoi(optarg); break;
+			case 'b': g_block = atoi(optarg); break;
+			case 'i': g_interpolation = 1; break;
+			case 'f': g_cpi = CPI_FLASH; break;
+			case 's': g_scale = atof(optarg); break;
+			case 'l': g_limit = atof(optarg); break;
+			case 'c': g_spread = atof(optarg); break;
+			case 'g': g_gain = 1; break;
+			default:
+				fprintf(stderr, "usage: %s [-r samplerate] [-b block] [-i] [-f] [-s scale] [-l limit%%] [-c spread%%] [-g] file.mod...\n", argv[0]);
+				return 2;
+		}
+	}
+
+	if (optind >= argc || g_block < 1 || g_samplerate < 1000) {
+		fprintf(stderr, "usage: %s [-r samplerate] [-b block] [-i] [-f] [-s scale] [-l limit%%] [-c spread%%] [-g] file.mod...\n", argv[0]);
+		return 2;
+	}
+
+	for (int i = optind; i < argc; i++) failed += !cost_song(argv[i]);
+
+	return failed ? 1 : 0;
+}
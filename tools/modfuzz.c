@@ -0,0 +1,222 @@
+/*
+ * Fuzz harness for the MOD loader and the player
+ *
+ * Loads untrusted input with InitMOD and plays it: the player must never
+ * read outside the file, whatever its header, order table, patterns and
+ * sample headers say. Built with AddressSanitizer and UBSan (and the TEST
+ * asserts of modplay.c, which check that every channel stays inside its
+ * sample), any such read stops the run with a report.
+ *
+ * Every input is copied into a buffer of exactly its size, so that a read
+ * one byte past the end hits the redzone. It is played for a few seconds
+ * at four times the tempo, then from a random order (JumpMOD), and queued
+ * to itself to go through the song switch. Built with USE_STORAGE, the song
+ * is read through a ModStorage_t instead, which fails the run if the player
+ * reads from past the end of the song.
+ *
+ * Two ways to run it:
+ *
+ *   libFuzzer (clang):
+ *     clang -g -O1 -fsanitize=fuzzer,address,undefined -DLIBFUZZER -DTEST \
+ *         -I.. -o modfuzz modfuzz.c ../modplay.c
+ *     ./modfuzz -max_len=65536 corpus/
+ *
+ *   Standalone (any compiler with sanitizers, see `make fuzz`): mutates each
+ *   given song `runs` times, truncating it and overwriting random bytes of
+ *   the header, order table, patterns and sample data, and plays every
+ *   mutation.
+ *
+ * Usage: modfuzz [-n runs] [-s seed] file...
+ *
+ *   -n   mutations per song (default 500)
+ *   -s   seed of the mutations (default 1), the same seed gives the same inputs
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "modplay.h"
+
+#ifndef USE_MONO_OUTPUT
+#define USE_MONO_OUTPUT 0
+#endif
+
+#ifndef OSR
+#define OSR 8
+#endif
+
+#define SAMPLERATE      22050
+#define PLAY_SAMPLES    (3 * SAMPLERATE)
+#define BLOCK           256
+
+#if USE_STORAGE
+typedef struct {
+	const uint8_t *data;
+	size_t size;
+} Input_t;
+
+static int input_read(const ModStorage_t *st, uint32_t offset, void *buf, uint32_t len)
+{
+	const Input_t *in = st->user;
+
+	// The block cache reads whole blocks and may run over the end, but no
+	// read may start past it: all data the player needs lies before it
+	if (offset >= in->size) {
+		fprintf(stderr, "read of %u bytes at %u, past the end of the %zu-byte song\n", len, offset, in->size);
+		abort();
+	}
+
+	uint32_t n = (len < in->size - offset) ? len : in->size - offset;
+
+	memcpy(buf, in->data + offset, n);
+	memset((uint8_t *) buf + n, 0, len - n);
+
+	return 1;
+}
+#endif
+
+static void play(ModPlayerStatus_t *mp, int samples)
+{
+#if USE_MONO_OUTPUT
+	static uint8_t buf[BLOCK * OSR * 2];  // Two PWM channels with USE_STEREO_PWM
+#else
+	static int16_t buf[BLOCK * 2];
+#endif
+
+	for (int s = 0; s < samples; s += BLOCK)
+		RenderMOD(mp, (uint8_t *) buf, BLOCK);
+}
+
+/*
+ * Plays one input, returns 1 if InitMOD accepted it
+ */
+static int fuzz_one(const uint8_t *data, size_t size)
+{
+	static ModPlayerStatus_t mp;
+
+	// Exactly the size of the input, so that sanitizers catch reads past it
+	uint8_t *copy = malloc(size ? size : 1);
+	memcpy(copy, data, size);
+
+#if USE_STORAGE
+	Input_t in = { copy, size };
+	ModStorage_t st = { input_read, &in };
+	const ModFile_t *mod = &st;
+#else
+	const ModFile_t *mod = copy;
+#endif
+
+	int ok = InitMOD(&mp, mod, size, SAMPLERATE) != NULL;
+
+	if (ok) {
+		// Four times the tempo to get through more rows
+		SetTempoMOD(&mp, 0x40000);
+		play(&mp, PLAY_SAMPLES / 2);
+
+		JumpMOD(&mp, size % mp.orders);
+		QueueMOD(&mp, mod, size, MOD_SWITCH_ORDER, 0x20000);
+		play(&mp, PLAY_SAMPLES / 2);
+	}
+
+	free(copy);
+	return ok;
+}
+
+#ifdef LIBFUZZER
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	fuzz_one(data, size);
+	return 0;
+}
+#else
+static uint32_t g_random = 1;
+
+static uint32_t rnd(uint32_t n)
+{
+	// xorshift32, the same sequence on every host
+	g_random ^= g_random << 13;
+	g_random ^= g_random >> 17;
+	g_random ^= g_random << 5;
+
+	return g_random % n;
+}
+
+static size_t mutate(uint8_t *buf, const uint8_t *song, size_t size)
+{
+	memcpy(buf, song, size);
+
+	// Cut the song short, often into the samples, sometimes into the patterns
+	if (rnd(2)) size = rnd(4) ? size - rnd(size / 2 + 1) : 1084 + rnd(size - 1084 + 1);
+
+	for (int n = rnd(8) + 1; n > 0 && size > 0; n--) {
+		uint32_t at;
+
+		switch (rnd(4)) {
+			case 0: at = 20 + rnd(31 * 30); break;    // Sample headers
+			case 1: at = 950 + rnd(130); break;       // Order count and table
+			case 2: at = 1084 + rnd(4096); break;     // The first patterns
+			default: at = rnd(size); break;
+		}
+
+		if (at < size) buf[at] = rnd(4) ? rnd(256) : (rnd(2) ? 0xFF : 0x00);
+	}
+
+	return size;
+}
+
+int main(int argc, char **argv)
+{
+	int opt, runs = 500;
+
+	while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+		switch (opt) {
+			case 'n': runs = atoi(optarg); break;
+			case 's': g_random = strtoul(optarg, NULL, 0) | 1; break;
+			default:
+				fprintf(stderr, "usage: %s [-n runs] [-s seed] file...\n", argv[0]);
+				return 2;
+		}
+	}
+
+	if (optind >= argc || runs < 1) {
+		fprintf(stderr, "usage: %s [-n runs] [-s seed] file...\n", argv[0]);
+		return 2;
+	}
+
+	for (int i = optind; i < argc; i++) {
+		FILE *f = fopen(argv[i], "rb");
+
+		if (!f) {
+			fprintf(stderr, "%s: not found\n", argv[i]);
+			return 1;
+		}
+
+		fseek(f, 0, SEEK_END);
+		long size = ftell(f);
+		fseek(f, 0, SEEK_SET);
+
+		uint8_t *song = malloc(size > 0 ? size : 1), *buf = malloc(size > 0 ? size : 1);
+		int ok = size >= 1084 && fread(song, 1, size, f) == (size_t) size;
+		fclose(f);
+
+		if (!ok || !fuzz_one(song, size)) {
+			fprintf(stderr, "%s: not a 4-channel MOD\n", argv[i]);
+			return 1;
+		}
+
+		int accepted = 0;
+
+		for (int r = 0; r < runs; r++) accepted += fuzz_one(buf, mutate(buf, song, size));
+
+		printf("%s: %d mutations played, %d rejected by InitMOD\n", argv[i], accepted, runs - accepted);
+
+		free(song);
+		free(buf);
+	}
+
+	return 0;
+}
+#endif
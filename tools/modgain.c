@@ -0,0 +1,132 @@
+/*
+ * Per-song gain prescan for the PWM output
+ *
+ * Mixes every song once up to its loop point with GainMOD() and reports
+ * its loudest sample at the fixed level of the mixer, the gain that brings
+ * it to full scale, and the share of IRQ blocks that run with clipping
+ * enabled when the song is played at that gain (see SetGainMOD()). The
+ * firmware Makefile stores the gain of every embedded song in songs.h.
+ *
+ * Usage: modgain [-r samplerate] [-b block] [-q] file...
+ *
+ *   -r   output sample rate (default 22050, as in main.c)
+ *   -b   samples rendered per IRQ (default 64, half of BUF_SAMPLES in main.c)
+ *   -q   only print the gain of every song, as a 16.16 hex constant
+ *
+ * Build with the player configuration of the device, see `make gain`.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "modplay.h"
+
+#ifndef USE_MONO_OUTPUT
+#define USE_MONO_OUTPUT 0
+#endif
+
+#ifndef OSR
+#define OSR 8
+#endif
+
+// Bytes RenderMOD writes per output sample
+#define SAMPLE_BYTES    (USE_MONO_OUTPUT ? OSR * (USE_STEREO_PWM ? 2 : 1) : 4)
+
+#define MAX_BLOCK       1024
+
+static uint32_t g_samplerate = 22050;
+static int g_block = 64;
+static int g_quiet = 0;
+
+static int gain_song(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+
+	if (!f) {
+		fprintf(stderr, "%s: not found\n", path);
+		return 0;
+	}
+
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	uint8_t *mod = malloc(size > 0 ? size : 1);
+	int ok = size > 0 && fread(mod, 1, size, f) == (size_t) size;
+	fclose(f);
+
+	static ModPlayerStatus_t mp;
+	static uint8_t buf[MAX_BLOCK * SAMPLE_BYTES];
+	uint32_t length = ok ? LengthMOD(&mp, mod, size, g_samplerate) : 0;
+	uint32_t gain = length ? GainMOD(&mp, mod, size, g_samplerate) : 0;
+
+	if (!gain) {
+		fprintf(stderr, "%s: not a 4-channel MOD\n", path);
+		free(mod);
+		return 0;
+	}
+
+	if (g_quiet) {
+		printf("0x%X\n", gain);
+		free(mod);
+		return 1;
+	}
+
+	// Play the song at that gain and count the blocks that clip on any tick
+	uint32_t blocks = 0, clipping = 0;
+
+	InitMOD(&mp, mod, size, g_samplerate);
+	SetGainMOD(&mp, gain);
+
+	for (uint32_t pos = 0; pos < length; pos += g_block, blocks++) {
+		int n = (length - pos < (uint32_t) g_block) ? length - pos : g_block;
+		int clip = 0;
+
+		for (int s = 0; s < n; s++) {
+			RenderMOD(&mp, buf, 1);
+			clip |= mp.saturate;
+		}
+
+		clipping += clip;
+	}
+
+	// Peak at unity gain, in 1/32768 of full scale
+	double peak = 32512.0 * 65536 / gain;
+
+	printf("%7.0f %6.3f %+6.1f %7.1f%%  %s\n", peak, gain / 65536.0, 20 * log10(gain / 65536.0),
+	       100.0 * clipping / blocks, path);
+
+	free(mod);
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	int opt, failed = 0;
+
+	while ((opt = getopt(argc, argv, "r:b:q")) != -1) {
+		switch (opt) {
+			case 'r': g_samplerate = atoi(optarg); break;
+			case 'b': g_block = atoi(optarg); break;
+			case 'q': g_quiet = 1; break;
+			default:
+				fprintf(stderr, "usage: %s [-r samplerate] [-b block] [-q] file...\n", argv[0]);
+				return 2;
+		}
+	}
+
+	if (optind >= argc || g_samplerate < 1000 || g_block < 1 || g_block > MAX_BLOCK) {
+		fprintf(stderr, "usage: %s [-r samplerate] [-b block] [-q] file...\n", argv[0]);
+		return 2;
+	}
+
+	if (!g_quiet) printf("%7s %6s %6s %8s  file\n", "peak", "gain", "dB", "clipping");
+
+	for (int i = optind; i < argc; i++) failed += !gain_song(argv[i]);
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,143 @@
+/*
+ * Synthetic MOD generator
+ *
+ * Writes small 4-channel ProTracker MODs that exercise specific parts of
+ * the player, for benchmarks and regression checks.
+ *
+ * Usage: modgen [-l] preset out.mod
+ *
+ * Presets:
+ *   stress   worst case for the render IRQ within the ProTracker limits:
+ *            all channels retriggered on every row at the highest pitch,
+ *            2-byte loops, arpeggio/vibrato/tremolo changing period and
+ *            volume on every tick, E9x retrigger, speed 1 at 255 BPM
+ *            (a row decode on every tick) and a tempo change on every row
+ *   extreme  like stress, plus portamento far below the ProTracker period
+ *            limit, so that channels step over many samples per output
+ *            sample. Real songs cannot do this, it probes the mixer's
+ *            data-dependent loop wrap
+ *
+ * -l lists the presets.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "modgen.h"
+
+typedef struct {
+	const char *name;
+	const char *description;
+	void (*build)(Song_t *song);
+} Preset_t;
+
+static Song_t g_song;
+
+// ProTracker periods, finetune 0, C-1 to B-3
+static const int periods[36] = {
+	856, 808, 762, 720, 678, 640, 604, 570, 538, 508, 480, 453,
+	428, 404, 381, 360, 339, 320, 302, 285, 269, 254, 240, 226,
+	214, 202, 190, 180, 170, 160, 151, 143, 135, 127, 120, 113
+};
+
+#define PERIOD_MAX       113           // Highest ProTracker pitch (B-3)
+
+static void build_stress(Song_t *song)
+{
+	set_sample(song, 1, 4, 2, 2, 0);                 // 2-byte loop
+	set_sample(song, 2, 64, 0, 64, 1);               // short loop
+	set_sample(song, 3, 4096, 2048, 2048, 1);        // long loop
+
+	// The highest finetune gives the highest pitch
+	for (int i = 0; i < 3; i++) song->samples[i].finetune = 7;
+
+	// Pattern 0: speed 1 at 255 BPM, every tick decodes a full row
+	for (int row = 0; row < 64; row++) {
+		set_cell(song, 0, row, 0, PERIOD_MAX, 1, 0x0, 0x37);
+		set_cell(song, 0, row, 1, PERIOD_MAX, 2, 0x4, 0xFF);
+		set_cell(song, 0, row, 2, PERIOD_MAX, 3, 0x7, 0xFF);
+		set_cell(song, 0, row, 3, PERIOD_MAX, 1, 0x9, 0x01);
+	}
+
+	set_cell(song, 0, 0, 2, PERIOD_MAX, 3, 0xF, 0x01);
+	set_cell(song, 0, 0, 3, PERIOD_MAX, 1, 0xF, 0xFF);
+
+	// Pattern 1: speed 2, period and volume change on every tick, E91 retriggers
+	for (int row = 0; row < 64; row++) {
+		set_cell(song, 1, row, 0, PERIOD_MAX, 1, 0x0, 0x37);
+		set_cell(song, 1, row, 1, PERIOD_MAX, 2, 0x4, 0xFF);
+		set_cell(song, 1, row, 2, PERIOD_MAX, 3, 0x7, 0xFF);
+		set_cell(song, 1, row, 3, PERIOD_MAX, 1, 0xE, 0x91);
+	}
+
+	set_cell(song, 1, 0, 3, PERIOD_MAX, 1, 0xF, 0x02);
+
+	// Pattern 2: tempo change on every row, notes across the whole range
+	for (int row = 0; row < 64; row++) {
+		for (int ch = 0; ch < 3; ch++)
+			set_cell(song, 2, row, ch, periods[35 - (row + ch * 5) % 36], 1 + ch, 0x0, 0x47);
+
+		set_cell(song, 2, row, 3, PERIOD_MAX, 1, 0xF, (row & 1) ? 0xFF : 0x20);
+	}
+
+	set_order(song, 0, 0);
+	set_order(song, 1, 1);
+	set_order(song, 2, 2);
+}
+
+static void build_extreme(Song_t *song)
+{
+	build_stress(song);
+
+	// Pattern 3: portamento up by 106 per tick takes the period from 107
+	// (113 at finetune 7) to 1, a step of about 160 samples per output
+	// sample at 22050 Hz. Any further and the period would drop to 0, which
+	// silences the channel
+	for (int row = 0; row < 64; row++) {
+		for (int ch = 0; ch < 4; ch++)
+			set_cell(song, 3, row, ch, PERIOD_MAX, 1 + (ch % 3), 0x1, 0x6A);
+	}
+
+	set_cell(song, 3, 0, 3, PERIOD_MAX, 1, 0xF, 0x02);
+
+	set_order(song, 3, 3);
+}
+
+static const Preset_t presets[] = {
+	{ "stress", "worst case render load within the ProTracker limits", build_stress },
+	{ "extreme", "stress plus periods far below the ProTracker limit", build_extreme },
+};
+
+#define NUM_PRESETS      ((int)(sizeof(presets) / sizeof(presets[0])))
+
+int main(int argc, char **argv)
+{
+	if (argc == 2 && !strcmp(argv[1], "-l")) {
+		for (int i = 0; i < NUM_PRESETS; i++) printf("%-16s %s\n", presets[i].name, presets[i].description);
+		return 0;
+	}
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s [-l] preset out.mod\n", argv[0]);
+		return 2;
+	}
+
+	for (int i = 0; i < NUM_PRESETS; i++) {
+		if (strcmp(argv[1], presets[i].name)) continue;
+
+		snprintf(g_song.title, sizeof(g_song.title), "%s", presets[i].name);
+		presets[i].build(&g_song);
+
+		if (!WriteMOD(&g_song, argv[2])) {
+			fprintf(stderr, "%s: cannot write\n", argv[2]);
+			return 1;
+		}
+
+		return 0;
+	}
+
+	fprintf(stderr, "unknown preset %s (-l lists them)\n", argv[1]);
+	return 2;
+}
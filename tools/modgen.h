@@ -0,0 +1,131 @@
+/*
+ * Song builder shared by the synthetic MOD tools (modgen, modconform)
+ *
+ * A Song_t holds patterns and samples in plain arrays; PackMOD() turns
+ * it into a 4-channel ProTracker ("M.K.") file in memory and WriteMOD()
+ * stores it on disk.
+ */
+
+#ifndef MODGEN_H_INCLUDED
+#define MODGEN_H_INCLUDED
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#define MAX_PATTERNS     16
+#define MAX_SAMPLE_LEN   8192          // bytes, per sample
+
+typedef struct {
+	int length, loopstart, looplength;   // in bytes, even
+	int volume, finetune;
+	int8_t data[MAX_SAMPLE_LEN];
+} SampleDef_t;
+
+typedef struct {
+	char title[20];
+	int orders;
+	uint8_t ordertable[128];
+	uint8_t patterns[MAX_PATTERNS][64][4][4];
+	SampleDef_t samples[31];
+} Song_t;
+
+#define MAX_MOD_SIZE     (1084 + MAX_PATTERNS * 1024 + 31 * MAX_SAMPLE_LEN)
+
+static inline void set_cell(Song_t *song, int pattern, int row, int ch, int period, int sample, int eff, int effval)
+{
+	uint8_t *cell = song->patterns[pattern][row][ch];
+
+	cell[0] = (sample & 0xF0) | (period >> 8);
+	cell[1] = period & 0xFF;
+	cell[2] = ((sample & 0x0F) << 4) | (eff & 0x0F);
+	cell[3] = effval;
+}
+
+static inline void set_order(Song_t *song, int pos, int pattern)
+{
+	song->ordertable[pos] = pattern;
+	if (pos + 1 > song->orders) song->orders = pos + 1;
+}
+
+/*
+ * Sample `n` (1..31) with a simple waveform: 0 = square, 1 = sawtooth
+ */
+static inline void set_sample(Song_t *song, int n, int length, int loopstart, int looplength, int wave)
+{
+	SampleDef_t *smp = &song->samples[n - 1];
+
+	smp->length = length;
+	smp->loopstart = loopstart;
+	smp->looplength = looplength;
+	smp->volume = 64;
+
+	for (int i = 0; i < length; i++)
+		smp->data[i] = wave ? (int8_t) (i * 256 / length - 128) : (i & 1) ? -128 : 127;
+}
+
+static inline void _put_be16(uint8_t *p, int v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+/*
+ * Writes the song as a MOD file to `out` (at least MAX_MOD_SIZE bytes),
+ * returns its size
+ */
+static inline size_t PackMOD(const Song_t *song, uint8_t *out)
+{
+	uint8_t *header = out;
+	int maxpattern = 0;
+
+	memset(header, 0, 1084);
+	memcpy(header, song->title, sizeof(song->title));
+
+	for (int i = 0; i < 31; i++) {
+		uint8_t *sh = header + 20 + 30 * i;
+
+		snprintf((char *) sh, 22, "sample %d", i + 1);
+		_put_be16(sh + 22, song->samples[i].length / 2);
+		sh[24] = song->samples[i].finetune & 0xF;
+		sh[25] = song->samples[i].volume;
+		_put_be16(sh + 26, song->samples[i].loopstart / 2);
+		_put_be16(sh + 28, song->samples[i].looplength ? song->samples[i].looplength / 2 : 1);
+	}
+
+	header[950] = song->orders;
+	header[951] = 127;
+	memcpy(header + 952, song->ordertable, 128);
+	memcpy(header + 1080, "M.K.", 4);
+
+	for (int i = 0; i < 128; i++) {
+		if (song->ordertable[i] > maxpattern) maxpattern = song->ordertable[i];
+	}
+
+	size_t size = 1084;
+
+	memcpy(out + size, song->patterns, 1024 * (maxpattern + 1));
+	size += 1024 * (maxpattern + 1);
+
+	for (int i = 0; i < 31; i++) {
+		memcpy(out + size, song->samples[i].data, song->samples[i].length);
+		size += song->samples[i].length;
+	}
+
+	return size;
+}
+
+static inline int WriteMOD(const Song_t *song, const char *path)
+{
+	static uint8_t buf[MAX_MOD_SIZE];
+	size_t size = PackMOD(song, buf);
+
+	FILE *f = fopen(path, "wb");
+	if (!f) return 0;
+
+	int ok = fwrite(buf, 1, size, f) == size;
+
+	return (fclose(f) == 0) && ok;
+}
+
+#endif
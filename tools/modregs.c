@@ -0,0 +1,282 @@
+/*
+ * Paula register stream exporter
+ *
+ * Records the register stream of every song with RecordMODRegs (see
+ * modplay_regs.h) and checks it in two ways.
+ *
+ * First, it replays the stream next to the player. The player plays the
+ * song through AdvanceMOD, stepping its channels like the mixer does. A
+ * second set of channels is stepped in the same way, but driven only by the
+ * stream (TickMODRegs and ApplyMODRegs). After every tick the two sets must
+ * hold the same sample, length, loop, step, volume and read position, so
+ * a mixer fed from the stream renders the same audio as RenderMOD.
+ *
+ * Second, it seeks to ticks spread over the song (SeekMODRegs). Each seek
+ * must give the registers of that tick as read from the start, and the
+ * read positions of an ideal Paula played from the start.
+ *
+ * The report lists a hash of the stream, its size, the number of ticks
+ * and keyframes, and the data rate.
+ *
+ * Usage: modregs [-k keyframe_ticks] [-r samplerate] [-o outdir] file...
+ *
+ *   -k   ticks between keyframes (default 250, 5 seconds at 125 BPM)
+ *   -r   output rate of the replay check (default 44100)
+ *   -o   write the stream of every song to outdir/<name>.regs
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#define USING_EXTERNAL_RENDERING
+#include "modplay_regs.h"
+
+#define MAX_STREAM      (16 << 20)
+#define SEEKS           64
+
+static uint32_t g_keyframeticks = 250;
+static uint32_t g_samplerate = 44100;
+static const char *g_outdir = NULL;
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	for (size_t i = 0; i < len; i++) hash = (hash ^ p[i]) * 1099511628211ULL;
+
+	return hash;
+}
+
+static void step_channels(PaulaChannel_t *paula, int n)
+{
+	for (int ch = 0; ch < 4; ch++) {
+		PaulaChannel_t *pch = &paula[ch];
+
+		for (int s = 0; s < n; s++) {
+			if (!pch->sample || !WrapChannelMOD(pch)) break;
+			StepChannelMOD(pch);
+		}
+	}
+}
+
+static int same_channel(PaulaChannel_t a, PaulaChannel_t b)
+{
+	// The player brings positions back into the loop once per tick,
+	// the mixer on the next sample
+	if (a.sample) WrapChannelMOD(&a);
+	if (b.sample) WrapChannelMOD(&b);
+
+	return a.sample == b.sample && a.length == b.length && a.looplength == b.looplength &&
+	       a.period == b.period && a.volume == b.volume &&
+	       (!a.sample || (a.currentptr == b.currentptr && a.currentsubptr == b.currentsubptr));
+}
+
+/*
+ * Plays the song and the stream side by side, returns the first tick at
+ * which they differ, or -1
+ */
+static int32_t check_replay(const uint8_t *mod, uint32_t size, const uint8_t *stream, uint32_t len)
+{
+	static ModPlayerStatus_t mp;
+	ModRegs_t rs;
+	PaulaChannel_t replica[4];
+
+	memset(replica, 0, sizeof(replica));
+
+	if (!InitMOD(&mp, mod, size, g_samplerate) || !InitMODRegs(&rs, stream, len)) return 0;
+
+	while (rs.tick < rs.ticks) {
+		int tick = mp.audiotick <= 0;
+		int n = AdvanceMOD(&mp, 4096);
+
+		if (tick) {
+			if (!TickMODRegs(&rs)) return rs.tick;
+
+			ApplyMODRegs(&rs, replica, mod, mp.paularate);
+
+			for (int ch = 0; ch < 4; ch++) {
+				if (!same_channel(mp.paula[ch], replica[ch])) return rs.tick - 1;
+			}
+		}
+
+		step_channels(mp.paula, n);
+		step_channels(replica, n);
+	}
+
+	return -1;
+}
+
+static void advance_ideal(ModRegsChannel_t *ch, int bpm)
+{
+	// One tick of an ideal Paula, as documented for keyframes
+	if (!ch->period || !bpm || ch->position >= ch->length) return;
+
+	uint64_t pos = ((uint64_t) ch->position << 16 | ch->fraction) + 3546895ULL * 5 * 32768 / (bpm * ch->period);
+
+	if ((pos >> 16) >= ch->length && ch->looplength) {
+		uint64_t end = (uint64_t) ch->length << 16, loop = (uint64_t) ch->looplength << 16;
+
+		pos = end - loop + (pos - end) % loop;
+	}
+
+	ch->position = (pos >> 16 < ch->length) ? (uint32_t) (pos >> 16) : ch->length;
+	ch->fraction = (pos >> 16 < ch->length) ? (uint16_t) pos : 0;
+}
+
+/*
+ * Seeks to SEEKS ticks and compares with the stream read from the start,
+ * returns the first tick that differs, or -1
+ */
+static int32_t check_seek(const uint8_t *stream, uint32_t len)
+{
+	ModRegs_t rs, seek;
+
+	InitMODRegs(&rs, stream, len);
+
+	// Registers and ideal positions of every tick, read from the start
+	ModRegs_t *ticks = malloc(sizeof(ModRegs_t) * rs.ticks);
+	ModRegsChannel_t ideal[4];
+	int32_t bad = -1;
+
+	for (uint32_t t = 0; t < rs.ticks; t++) {
+		TickMODRegs(&rs);
+
+		for (int ch = 0; ch < 4; ch++) {
+			if (t == 0) ideal[ch] = rs.ch[ch];
+
+			ideal[ch].sample = rs.ch[ch].sample;
+			ideal[ch].length = rs.ch[ch].length;
+			ideal[ch].looplength = rs.ch[ch].looplength;
+			ideal[ch].period = rs.ch[ch].period;
+
+			if (rs.ch[ch].changed & MOD_REGS_TRIGGER) {
+				ideal[ch].position = rs.ch[ch].position;
+				if (!rs.ch[ch].keep) ideal[ch].fraction = 0;
+			}
+		}
+
+		ticks[t] = rs;
+
+		for (int ch = 0; ch < 4; ch++) {
+			ticks[t].ch[ch].position = ideal[ch].position;
+			ticks[t].ch[ch].fraction = ideal[ch].fraction;
+			advance_ideal(&ideal[ch], rs.bpm);
+		}
+	}
+
+	for (int i = 0; i < SEEKS && bad < 0; i++) {
+		uint32_t t = (uint64_t) rs.ticks * i / SEEKS + i % 7;
+
+		if (t >= rs.ticks) continue;
+
+		InitMODRegs(&seek, stream, len);
+
+		if (!SeekMODRegs(&seek, t) || seek.tick != t + 1 || seek.bpm != ticks[t].bpm || seek.ledfilter != ticks[t].ledfilter) {
+			bad = t;
+			break;
+		}
+
+		for (int ch = 0; ch < 4; ch++) {
+			const ModRegsChannel_t *a = &seek.ch[ch], *b = &ticks[t].ch[ch];
+
+			if (a->sample != b->sample || a->start != b->start || a->length != b->length ||
+			    a->looplength != b->looplength || a->period != b->period || a->volume != b->volume ||
+			    a->position != b->position || a->fraction != b->fraction) bad = t;
+		}
+
+		// Reading on from the seek must give the same ticks
+		if (bad < 0 && t + 1 < rs.ticks && (!TickMODRegs(&seek) || seek.ch[0].period != ticks[t + 1].ch[0].period)) bad = t + 1;
+	}
+
+	free(ticks);
+	return bad;
+}
+
+static int export_song(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+
+	if (!f) {
+		fprintf(stderr, "%s: not found\n", path);
+		return 0;
+	}
+
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	uint8_t *mod = malloc(size > 0 ? size : 1);
+	int ok = size > 0 && fread(mod, 1, size, f) == (size_t) size;
+	fclose(f);
+
+	static ModPlayerStatus_t mp;
+	static uint8_t stream[MAX_STREAM];
+	uint32_t len = ok ? RecordMODRegs(&mp, mod, size, stream, sizeof(stream), g_keyframeticks) : 0;
+
+	if (!len) {
+		printf("%-16s %8s %7s %5s %7s  %s\n", "FAILED", "-", "-", "-", "-", path);
+		free(mod);
+		return 0;
+	}
+
+	ModRegs_t rs;
+	double secs = 0;
+
+	InitMODRegs(&rs, stream, len);
+
+	while (TickMODRegs(&rs)) secs += 2.5 / rs.bpm;
+
+	int32_t replay = check_replay(mod, size, stream, len);
+	int32_t seek = check_seek(stream, len);
+
+	printf("%016llx %8u %7u %5u %7.0f  %s\n", (unsigned long long) fnv1a(14695981039346656037ULL, stream, len),
+	       len, rs.ticks, rs.keyframes, len / secs, path);
+
+	if (replay >= 0) fprintf(stderr, "%s: replay differs from the player at tick %d\n", path, replay);
+	if (seek >= 0) fprintf(stderr, "%s: seek to tick %d differs from reading from the start\n", path, seek);
+
+	if (g_outdir) {
+		const char *name = strrchr(path, '/');
+		char outpath[4096];
+
+		snprintf(outpath, sizeof(outpath), "%s/%s.regs", g_outdir, name ? name + 1 : path);
+
+		FILE *out = fopen(outpath, "wb");
+
+		if (!out || fwrite(stream, 1, len, out) != len) fprintf(stderr, "%s: cannot write\n", outpath);
+		if (out) fclose(out);
+	}
+
+	free(mod);
+	return replay < 0 && seek < 0;
+}
+
+int main(int argc, char **argv)
+{
+	int opt, failed = 0;
+
+	while ((opt = getopt(argc, argv, "k:r:o:")) != -1) {
+		switch (opt) {
+			case 'k': g_keyframeticks = atoi(optarg); break;
+			case 'r': g_samplerate = atoi(optarg); break;
+			case 'o': g_outdir = optarg; break;
+			default:
+				fprintf(stderr, "usage: %s [-k keyframe_ticks] [-r samplerate] [-o outdir] file...\n", argv[0]);
+				return 2;
+		}
+	}
+
+	if (optind >= argc || g_samplerate < 1000) {
+		fprintf(stderr, "usage: %s [-k keyframe_ticks] [-r samplerate] [-o outdir] file...\n", argv[0]);
+		return 2;
+	}
+
+	printf("%-16s %8s %7s %5s %7s  file\n", "hash", "bytes", "ticks", "keys", "bytes/s");
+
+	for (int i = optind; i < argc; i++) failed += !export_song(argv[i]);
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,523 @@
+/*
+ * Host-side batch renderer for MOD files
+ *
+ * Renders a set of MOD files (or all *.mod files in a directory) in parallel,
+ * one player instance per worker thread, and reports a content hash and the
+ * render time of every song. Optionally writes each song as a 16-bit stereo WAV.
+ *
+ * Built with -DUSE_MONO_OUTPUT=1 (as on the device), the hash covers the
+ * 8-bit PWM stream and the WAV holds that stream as 8-bit mono at
+ * samplerate * OSR, which plays back like the filtered PWM output. With
+ * -DUSE_STEREO_PWM=1 as well, the streams of both PWM channels are hashed
+ * and written interleaved, as an 8-bit stereo WAV. A build with separate
+ * buffers (PWM_RIGHT_BUFFER) is interleaved here first, so it must give
+ * the same hash as the interleaved build and as PullMOD().
+ *
+ * With -f, songs are rendered by the floating point reference renderer
+ * (modplay_hq.c) instead, with the given output filter emulation
+ * (none, a500 or a1200), and written as 32-bit float WAVs.
+ *
+ * With -p, songs are rendered through PullMOD() with the output descriptor
+ * of RenderMOD's format, in calls of PULL_VALUES values that split frames
+ * across calls. The hash must then match the sample-by-sample mixer.
+ *
+ * With -b, songs are rendered in blocks of `block` samples (at most 1024)
+ * and every block is timed on its own: it is rendered BLOCK_REPEATS times
+ * from a copy of the player state and the fastest run counts, so that
+ * interrupts and preemption on the host do not show up as slow blocks. The
+ * report then also lists the
+ * average and the slowest block in microseconds and the slowest block as a
+ * percentage of the time it plays for: the host equivalent of the render
+ * IRQ budget on the device, where a block of 64 samples is half of
+ * BUF_SAMPLES. Use -j 1 for stable numbers.
+ *
+ * With -g, RenderMOD scales the PWM output by SetGainMOD(): by the given
+ * factor, or with `-g auto` by the gain GainMOD() finds for each song, as
+ * the device plays the songs it embeds.
+ *
+ * Built with -DUSE_SAMPLE_BANK=1, -k loads the sample bank of songs packed
+ * by modbank, which are then rendered like the originals.
+ *
+ * Usage: modrender [-j threads] [-r samplerate] [-t max_seconds] [-o outdir] [-f filter] [-b block] [-p] [-g gain|auto] [-k bank] file|dir...
+ *
+ * Every song is rendered up to the exact sample where it loops back for the
+ * first time (see LengthMOD), or until `max_seconds` of audio have been
+ * produced, so the hashes do not depend on the block size.
+ *
+ * Files that InitMOD rejects (not a MOD, or pattern data beyond the end of
+ * the file) are reported as FAILED without being played.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "modplay.h"
+#include "modplay_hq.h"
+
+#define BLOCK_SAMPLES    1024          // Samples rendered per RenderMOD call
+#define BLOCK_REPEATS    5             // Renders of every block timed with -b
+#define PULL_VALUES      7             // Values per PullMOD call with -p, not a multiple of a frame
+
+// Output format of RenderMOD, same defaults as modplay.c
+#ifndef USE_MONO_OUTPUT
+#define USE_MONO_OUTPUT 0
+#endif
+
+#ifndef OSR
+#define OSR 8
+#endif
+
+#ifndef USE_STEREO_PWM
+#define USE_STEREO_PWM 0
+#endif
+
+#ifndef PWM_RIGHT_BUFFER
+#define PWM_RIGHT_BUFFER 0
+#endif
+
+#ifndef USE_DSM_INTERPOLATION
+#define USE_DSM_INTERPOLATION 0
+#endif
+
+// Output channels and values per output sample of RenderMOD
+#define OUT_CHANNELS     ((USE_MONO_OUTPUT && !USE_STEREO_PWM) ? 1 : 2)
+#define OUT_VALUES       ((USE_MONO_OUTPUT ? OSR : 1) * OUT_CHANNELS)
+
+#if PWM_RIGHT_BUFFER && PWM_RIGHT_BUFFER < BLOCK_SAMPLES * OSR
+#error "PWM_RIGHT_BUFFER must leave room for a block of left values"
+#endif
+
+// Renderer under test: RenderMOD, or a kernel of modplay.hpp exported by
+// modrender_tmpl.cpp in the same output format
+#ifdef RENDER_FUNC
+ModPlayerStatus_t *RENDER_FUNC(ModPlayerStatus_t *mp, volatile uint8_t *buf, int len);
+#else
+#define RENDER_FUNC RenderMOD
+#endif
+
+typedef struct {
+	const char *path;
+	off_t size;
+
+	// Results
+	int ok;
+	uint32_t samples;
+	uint64_t hash;
+	double seconds;
+	double blockavg, blockmax;         // Per block render time with -b, in seconds
+} Job_t;
+
+static Job_t *g_jobs;
+static int g_numjobs;
+static int g_nextjob;                  // Next job to be taken by an idle worker
+
+static uint32_t g_samplerate = 44100;
+static uint32_t g_maxseconds = 600;
+static const char *g_outdir = NULL;
+static int g_filter = -1;              // MOD_FILTER_* for float rendering, -1 for RenderMOD
+static int g_block = BLOCK_SAMPLES;    // Samples rendered per call
+static int g_timeblocks = 0;           // Time every block (-b)
+static int g_pull = 0;                 // Render through PullMOD (-p)
+static int32_t g_gain = 0;             // SetGainMOD() factor (-g), 16.16, -1 for GainMOD()
+
+#if USE_SAMPLE_BANK
+static int load_bank(const char *path)
+{
+	// Read into a buffer of exactly its size, so that a read past the bank
+	// is caught by the sanitizers
+	FILE *f = fopen(path, "rb");
+
+	if (!f) return 0;
+
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	int8_t *bank = malloc(size > 0 ? size : 1);
+	int ok = size >= 0 && fread(bank, 1, size, f) == (size_t) size;
+
+	fclose(f);
+	if (ok) SetSampleBankMOD(bank, size);
+
+	return ok;
+}
+#endif
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double thread_cpu(void)
+{
+	// CPU time of the calling thread, which leaves out time spent preempted
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void put_le(uint8_t *p, uint32_t v, int bytes)
+{
+	for (int i = 0; i < bytes; i++) p[i] = v >> (8 * i);
+}
+
+/*
+ * Canonical 44-byte header of a WAV file: 8/16-bit PCM or 32-bit float
+ */
+static void wav_header(uint8_t *h, uint32_t samplerate, int channels, int bits, int isfloat, uint32_t frames)
+{
+	uint32_t align = channels * bits / 8;
+	uint32_t datalen = frames * align;
+
+	memcpy(h, "RIFF", 4);      put_le(h + 4, 36 + datalen, 4);
+	memcpy(h + 8, "WAVEfmt ", 8);
+	put_le(h + 16, 16, 4);     put_le(h + 20, isfloat ? 3 : 1, 2);  // PCM or IEEE float
+	put_le(h + 22, channels, 2); put_le(h + 24, samplerate, 4);
+	put_le(h + 28, samplerate * align, 4);
+	put_le(h + 32, align, 2);  put_le(h + 34, bits, 2);
+	memcpy(h + 36, "data", 4); put_le(h + 40, datalen, 4);
+}
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len)
+{
+	// FNV-1a over the raw (little-endian) sample data
+	const uint8_t *p = data;
+
+	for (size_t i = 0; i < len; i++) hash = (hash ^ p[i]) * 1099511628211ULL;
+
+	return hash;
+}
+
+static void render_job(Job_t *job)
+{
+	int fd = open(job->path, O_RDONLY);
+	if (fd < 0) return;
+
+	// Map the song instead of reading it, the player only reads from it.
+	// Pages are faulted in up front so that they do not count as slow blocks
+	int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+	flags |= MAP_POPULATE;
+#endif
+	const uint8_t *mod = mmap(NULL, job->size, PROT_READ, flags, fd, 0);
+	close(fd);
+	if (mod == MAP_FAILED) return;
+
+	FILE *out = NULL;
+	if (g_outdir) {
+		const char *name = strrchr(job->path, '/');
+		char outpath[4096];
+
+		snprintf(outpath, sizeof(outpath), "%s/%s.wav", g_outdir, name ? name + 1 : job->path);
+		out = fopen(outpath, "wb");
+
+		// Reserve space for the header, it is written once the length is known
+		uint8_t header[44] = {0};
+		if (out) fwrite(header, 1, sizeof(header), out);
+	}
+
+	ModPlayerStatus_t mp;
+	ModFloatOutput_t fout;
+	ModOutput_t pout;
+#if USE_MONO_OUTPUT
+	static __thread uint8_t buf[BLOCK_SAMPLES * OSR * 2];
+#if PWM_RIGHT_BUFFER
+	static __thread uint8_t dual[PWM_RIGHT_BUFFER + BLOCK_SAMPLES * OSR];
+#endif
+#else
+	static __thread int16_t buf[BLOCK_SAMPLES * 2];
+#endif
+	static __thread float fbuf[BLOCK_SAMPLES * 2];
+
+	double start = now();
+
+	if (InitMOD(&mp, mod, job->size, g_samplerate)) {
+		uint64_t hash = 14695981039346656037ULL;
+		uint32_t maxsamples = g_maxseconds * g_samplerate;
+		uint32_t length = LengthMOD(&mp, mod, job->size, g_samplerate);
+		uint32_t blocks = 0;
+		double blocksum = 0;
+
+		if (length > maxsamples) length = maxsamples;
+
+		uint32_t gain = (g_gain < 0) ? GainMOD(&mp, mod, job->size, g_samplerate) : (uint32_t) g_gain;
+
+		InitMOD(&mp, mod, job->size, g_samplerate);
+		if (gain) SetGainMOD(&mp, gain);
+		job->samples = 0;
+
+		if (g_filter >= 0) InitMODFloat(&fout, g_filter, g_samplerate);
+		InitMODOutput(&pout, USE_MONO_OUTPUT ? MOD_FORMAT_PWM8 : MOD_FORMAT_S16, OUT_CHANNELS, OSR, 8);
+		pout.ramp = USE_DSM_INTERPOLATION;
+
+		while (job->samples < length) {
+			int n = (length - job->samples < (uint32_t) g_block) ? length - job->samples : g_block;
+			const void *data = buf;
+			size_t bytes = n * OUT_VALUES * sizeof(buf[0]);
+			double blocktime = 1e9;
+
+			// The player and filter state only depend on what was rendered
+			// before, so every repeat produces the same block
+			ModPlayerStatus_t mpstart = mp;
+			ModFloatOutput_t foutstart = fout;
+			ModOutput_t poutstart = pout;
+
+			for (int r = 0; r < (g_timeblocks ? BLOCK_REPEATS : 1); r++) {
+				double start = thread_cpu();
+
+				mp = mpstart;
+				fout = foutstart;
+				pout = poutstart;
+
+				if (g_filter >= 0) {
+					RenderMODFloat(&mp, &fout, fbuf, n);
+					data = fbuf;
+					bytes = n * 2 * sizeof(fbuf[0]);
+				} else if (g_pull) {
+					int values = bytes / sizeof(buf[0]);
+
+					for (int v = 0; v < values; v += PULL_VALUES)
+						PullMOD(&mp, &pout, buf + v, NULL, (values - v < PULL_VALUES) ? values - v : PULL_VALUES);
+				} else {
+#if USE_MONO_OUTPUT && PWM_RIGHT_BUFFER
+					RENDER_FUNC(&mp, dual, n);
+#else
+					RENDER_FUNC(&mp, (uint8_t *) buf, n);
+#endif
+				}
+
+				double t = thread_cpu() - start;
+				if (t < blocktime) blocktime = t;
+			}
+
+#if USE_MONO_OUTPUT && PWM_RIGHT_BUFFER
+			// Left and right buffer, interleaved as the other stereo layouts
+			if (g_filter < 0 && !g_pull) {
+				for (int i = 0; i < n * OSR; i++) {
+					buf[2 * i] = dual[i];
+					buf[2 * i + 1] = dual[PWM_RIGHT_BUFFER + i];
+				}
+			}
+#endif
+
+			// Only full blocks, the last one of the song is usually shorter
+			if (g_timeblocks && n == g_block) {
+				if (blocktime > job->blockmax) job->blockmax = blocktime;
+				blocksum += blocktime;
+				blocks++;
+			}
+
+			job->samples += n;
+			hash = fnv1a(hash, data, bytes);
+
+			if (out) fwrite(data, 1, bytes, out);
+		}
+
+		job->hash = hash;
+		job->blockavg = blocks ? blocksum / blocks : 0;
+		job->ok = 1;
+	}
+
+	job->seconds = now() - start;
+
+	if (out) {
+		uint8_t header[44];
+
+		if (g_filter >= 0)
+			wav_header(header, g_samplerate, 2, 32, 1, job->samples);
+		else if (USE_MONO_OUTPUT)
+			wav_header(header, g_samplerate * OSR, OUT_CHANNELS, 8, 0, job->samples * OSR);
+		else
+			wav_header(header, g_samplerate, 2, 16, 0, job->samples);
+
+		fseek(out, 0, SEEK_SET);
+		fwrite(header, 1, sizeof(header), out);
+		fclose(out);
+	}
+
+	munmap((void *) mod, job->size);
+}
+
+static void *worker(void *arg)
+{
+	(void) arg;
+
+	// Idle workers take the next song from the shared list until it is empty
+	for (;;) {
+		int i = __atomic_fetch_add(&g_nextjob, 1, __ATOMIC_RELAXED);
+		if (i >= g_numjobs) break;
+
+		render_job(&g_jobs[i]);
+	}
+
+	return NULL;
+}
+
+static void add_job(const char *path)
+{
+	struct stat st;
+
+	if (stat(path, &st) != 0) {
+		fprintf(stderr, "%s: not found\n", path);
+		return;
+	}
+
+	if (S_ISDIR(st.st_mode)) {
+		DIR *dir = opendir(path);
+		struct dirent *de;
+
+		while (dir && (de = readdir(dir))) {
+			size_t len = strlen(de->d_name);
+			if (len < 4 || strcasecmp(de->d_name + len - 4, ".mod")) continue;
+
+			char *sub = malloc(strlen(path) + len + 2);
+			sprintf(sub, "%s/%s", path, de->d_name);
+			add_job(sub);
+		}
+
+		if (dir) closedir(dir);
+		return;
+	}
+
+	g_jobs = realloc(g_jobs, (g_numjobs + 1) * sizeof(Job_t));
+	memset(&g_jobs[g_numjobs], 0, sizeof(Job_t));
+	g_jobs[g_numjobs].path = path;
+	g_jobs[g_numjobs].size = st.st_size;
+	g_numjobs++;
+}
+
+static int by_size(const void *a, const void *b)
+{
+	const Job_t *ja = a, *jb = b;
+	return (jb->size > ja->size) - (jb->size < ja->size);
+}
+
+int main(int argc, char **argv)
+{
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt;
+
+	static const char *filters[] = { "none", "a500", "a1200" };
+
+	while ((opt = getopt(argc, argv, "j:r:t:o:f:b:pg:k:")) != -1) {
+		switch (opt) {
+			case 'j': threads = atoi(optarg); break;
+			case 'r': g_samplerate = atoi(optarg); break;
+			case 't': g_maxseconds = atoi(optarg); break;
+			case 'o': g_outdir = optarg; break;
+			case 'p': g_pull = 1; break;
+			case 'g':
+				g_gain = strcmp(optarg, "auto") ? (int32_t) (atof(optarg) * 65536) : -1;
+
+				if (g_gain) break;
+				goto usage;
+#if USE_SAMPLE_BANK
+			case 'k':
+				if (load_bank(optarg)) break;
+
+				fprintf(stderr, "%s: cannot read the sample bank\n", optarg);
+				return 2;
+#endif
+			case 'b':
+				g_block = atoi(optarg);
+				g_timeblocks = 1;
+
+				if (g_block >= 1 && g_block <= BLOCK_SAMPLES) break;
+				goto usage;
+			case 'f':
+				for (int i = 0; i < 3; i++) {
+					if (!strcasecmp(optarg, filters[i])) g_filter = i;
+				}
+
+				if (g_filter >= 0) break;
+				// fall through
+			default:
+			usage:
+				fprintf(stderr, "usage: %s [-j threads] [-r samplerate] [-t max_seconds] [-o outdir] [-f none|a500|a1200] [-b block] [-p] [-g gain|auto] [-k bank] file|dir...\n", argv[0]);
+				return 2;
+		}
+	}
+
+	for (int i = optind; i < argc; i++) add_job(argv[i]);
+
+	if (g_numjobs == 0) {
+		fprintf(stderr, "no MOD files given\n");
+		return 2;
+	}
+
+	// Start with the largest songs so that the tail of the batch is short
+	qsort(g_jobs, g_numjobs, sizeof(Job_t), by_size);
+
+	if (threads < 1) threads = 1;
+	if (threads > g_numjobs) threads = g_numjobs;
+
+	pthread_t *tids = malloc(threads * sizeof(pthread_t));
+	double start = now();
+
+	for (int i = 0; i < threads; i++) pthread_create(&tids[i], NULL, worker, NULL);
+	for (int i = 0; i < threads; i++) pthread_join(tids[i], NULL);
+
+	double wall = now() - start;
+	double cpu = 0, audio = 0;
+	int failed = 0;
+
+	printf("%-16s %8s %9s %8s  ", "hash", "audio_s", "render_ms", "x_rt");
+	if (g_timeblocks) printf("%8s %8s %6s  ", "blk_avg", "blk_max", "peak%");
+	printf("file\n");
+
+	double blockmax = 0;
+	const char *blockmaxpath = NULL;
+
+	for (int i = 0; i < g_numjobs; i++) {
+		Job_t *job = &g_jobs[i];
+
+		if (!job->ok) {
+			printf("%-16s %8s %9s %8s  %s\n", "FAILED", "-", "-", "-", job->path);
+			failed++;
+			continue;
+		}
+
+		double secs = (double) job->samples / g_samplerate;
+
+		printf("%016llx %8.1f %9.1f %8.0f  ", (unsigned long long) job->hash,
+		       secs, job->seconds * 1000, secs / job->seconds);
+
+		if (g_timeblocks) {
+			// Slowest block relative to its playback time
+			printf("%8.2f %8.2f %6.2f  ", job->blockavg * 1e6, job->blockmax * 1e6,
+			       job->blockmax * g_samplerate / g_block * 100);
+
+			if (job->blockmax > blockmax) {
+				blockmax = job->blockmax;
+				blockmaxpath = job->path;
+			}
+		}
+
+		printf("%s\n", job->path);
+
+		cpu += job->seconds;
+		audio += secs;
+	}
+
+	printf("%d songs, %.1f s audio in %.2f s (%d threads, %.0fx realtime, %.0fx per thread)\n",
+	       g_numjobs - failed, audio, wall, threads, audio / wall, cpu > 0 ? audio / cpu : 0);
+
+	if (blockmaxpath) {
+		printf("slowest %d-sample block: %.2f us, %.2f%% of its %.0f us playback time (%s)\n", g_block,
+		       blockmax * 1e6, blockmax * g_samplerate / g_block * 100, 1e6 * g_block / g_samplerate, blockmaxpath);
+	}
+
+	return failed ? 1 : 0;
+}
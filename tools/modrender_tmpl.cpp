@@ -0,0 +1,20 @@
+/*
+ * Kernels of modplay.hpp for the golden-output check
+ *
+ * One kernel per render configuration of the check, named after it. Each
+ * check/modrender_tmpl_* binary links this file and renders through the
+ * kernel of its configuration (-DRENDER_FUNC), so the kernels must
+ * reproduce the hashes of RenderMOD.
+ */
+
+#include "modplay.hpp"
+
+using modplay::Interpolation;
+using modplay::Output;
+
+MODPLAY_RENDERER(RenderMOD_stereo, 4, Interpolation::Linear, Output::Stereo16)
+MODPLAY_RENDERER(RenderMOD_stereo_nointerp, 4, Interpolation::None, Output::Stereo16)
+MODPLAY_RENDERER(RenderMOD_mono, 4, Interpolation::None, Output::MonoPWM, 8)
+MODPLAY_RENDERER(RenderMOD_mono_interp, 4, Interpolation::Linear, Output::MonoPWM, 8)
+MODPLAY_RENDERER(RenderMOD_mono_osr4, 4, Interpolation::None, Output::MonoPWM, 4)
+MODPLAY_RENDERER(RenderMOD_mono_osr16, 4, Interpolation::None, Output::MonoPWM, 16)
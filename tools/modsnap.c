@@ -0,0 +1,169 @@
+/*
+ * Playback snapshot check
+ *
+ * Plays every song with RenderMOD and saves a snapshot (SaveMOD) at points
+ * spread over the song, each at a different offset into a tick. A second
+ * instance is set up with InitMOD and RestoreMOD from the snapshot, and
+ * both render on: their output must be the same for the next few seconds,
+ * and a snapshot of the restored instance must be the same as the one it
+ * was restored from.
+ *
+ * The report lists the size of a snapshot and the time RestoreMOD takes on
+ * this machine, and fails if any restore differs.
+ *
+ * Usage: modsnap [-n snapshots] [-r samplerate] file...
+ *
+ *   -n   snapshots per song (default 32)
+ *   -r   output sample rate (default 22050)
+ *
+ * Build with the player configuration to check, see `make snapshot`.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "modplay.h"
+
+#ifndef USE_MONO_OUTPUT
+#define USE_MONO_OUTPUT 0
+#endif
+
+#ifndef OSR
+#define OSR 8
+#endif
+
+// Bytes RenderMOD writes per output sample
+#define SAMPLE_BYTES    (USE_MONO_OUTPUT ? OSR * (USE_STEREO_PWM ? 2 : 1) : 4)
+
+#define BLOCK           64             // Samples per render call, as in main.c
+#define COMPARE         (3 * 22050)    // Samples compared after every restore
+#define RESTORES        1000           // Repetitions for the timing
+
+static int g_snapshots = 32;
+static uint32_t g_samplerate = 22050;
+
+static void render(ModPlayerStatus_t *mp, uint8_t *buf, uint32_t len)
+{
+	for (uint32_t s = 0; s < len; s += BLOCK) {
+		int n = (len - s < BLOCK) ? len - s : BLOCK;
+
+		RenderMOD(mp, buf + s * SAMPLE_BYTES, n);
+	}
+}
+
+static int check_song(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+
+	if (!f) {
+		fprintf(stderr, "%s: not found\n", path);
+		return 0;
+	}
+
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	uint8_t *mod = malloc(size > 0 ? size : 1);
+	int ok = size > 0 && fread(mod, 1, size, f) == (size_t) size;
+	fclose(f);
+
+	static ModPlayerStatus_t mp, restored;
+	static uint8_t scratch[BLOCK * SAMPLE_BYTES], a[COMPARE * SAMPLE_BYTES], b[COMPARE * SAMPLE_BYTES];
+	uint32_t length = ok ? LengthMOD(&mp, mod, size, g_samplerate) : 0;
+
+	if (!length || !InitMOD(&mp, mod, size, g_samplerate)) {
+		fprintf(stderr, "%s: not a 4-channel MOD\n", path);
+		free(mod);
+		return 0;
+	}
+
+	int failed = 0;
+	double restorens = 0;
+	uint32_t pos = 0;
+
+	for (int i = 0; i < g_snapshots; i++) {
+		// Spread over the song, and off the block and tick boundaries
+		uint32_t at = (uint64_t) length * i / g_snapshots + 97 * i;
+
+		if (at < pos) at = pos;
+
+		for (; pos + BLOCK <= at; pos += BLOCK) RenderMOD(&mp, scratch, BLOCK);
+		if (pos < at) RenderMOD(&mp, scratch, at - pos);
+		pos = at;
+
+		ModSnapshot_t snap, again;
+
+		SaveMOD(&mp, &snap);
+		render(&mp, a, COMPARE);
+		pos += COMPARE;
+
+		InitMOD(&restored, mod, size, g_samplerate);
+
+		struct timespec t0, t1;
+
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (int k = 0; k < RESTORES; k++) {
+			if (!RestoreMOD(&restored, &snap)) {
+				fprintf(stderr, "%s: snapshot %d rejected\n", path, i);
+				failed = 1;
+				break;
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		restorens += ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / RESTORES;
+
+		SaveMOD(&restored, &again);
+
+		if (memcmp(&snap, &again, sizeof(snap))) {
+			fprintf(stderr, "%s: snapshot %d at sample %u does not survive a restore\n", path, i, at);
+			failed = 1;
+		}
+
+		render(&restored, b, COMPARE);
+
+		for (uint32_t s = 0; s < COMPARE; s++) {
+			if (memcmp(a + s * SAMPLE_BYTES, b + s * SAMPLE_BYTES, SAMPLE_BYTES)) {
+				fprintf(stderr, "%s: restore of the snapshot at sample %u differs %u samples later\n", path, at, s);
+				failed = 1;
+				break;
+			}
+		}
+	}
+
+	printf("%-6s %8zu %10.2f  %s\n", failed ? "FAILED" : "ok", sizeof(ModSnapshot_t),
+	       restorens / g_snapshots / 1000, path);
+
+	free(mod);
+	return !failed;
+}
+
+int main(int argc, char **argv)
+{
+	int opt, failed = 0;
+
+	while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+		switch (opt) {
+			case 'n': g_snapshots = atoi(optarg); break;
+			case 'r': g_samplerate = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [-n snapshots] [-r samplerate] file...\n", argv[0]);
+				return 2;
+		}
+	}
+
+	if (optind >= argc || g_snapshots < 1 || g_samplerate < 1000) {
+		fprintf(stderr, "usage: %s [-n snapshots] [-r samplerate] file...\n", argv[0]);
+		return 2;
+	}
+
+	printf("%-6s %8s %10s  file\n", "result", "bytes", "restore us");
+
+	for (int i = optind; i < argc; i++) failed += !check_song(argv[i]);
+
+	return failed ? 1 : 0;
+}
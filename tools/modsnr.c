@@ -0,0 +1,353 @@
+/*
+ * Signal-to-noise ratio of the PWM output
+ *
+ * Renders each song twice: with RenderMOD in the PWM configuration it is
+ * built with (as on the device), and as an ideal Paula would play it,
+ * evaluated at every duty value of the PWM output. The ideal Paula holds
+ * each sample byte for its exact share of the period, so the reference
+ * has no resampling error at all. It follows the read positions of a
+ * second player at the same mix rate, which keeps both at the same pitch
+ * (the 16.16 steps of a player at the PWM rate would drift apart from
+ * those of the device). Both are filtered by the same low-pass, as the RC
+ * filter and the speaker would, and compared: the reference is delayed
+ * and scaled to match the PWM output as closely as possible, and what
+ * remains of the difference is the noise. This covers everything the
+ * device output adds on the way: nearest-sample resampling at the mix
+ * rate, the hold or ramp across the OSR duty values, the 8-bit delta-sigma
+ * modulation and clipping.
+ *
+ * The SNR is reported up to 5 kHz and up to 10 kHz. Mixing at a lower rate
+ * loses the content above its Nyquist frequency, which counts as noise in
+ * the wider band.
+ *
+ * Usage: modsnr [-r samplerate] [-t max_seconds] file...
+ *
+ *   -r   mix rate given to InitMOD (default 22050)
+ *   -t   compare at most this much audio from the start (default 30)
+ *
+ * Stereo PWM builds (USE_STEREO_PWM) are compared per side against a
+ * reference panned like RenderMOD, and the noise of both sides is added up.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#define USING_EXTERNAL_RENDERING  // The ideal Paula steps the channels itself
+#include "modplay.h"
+
+// Hidden by USING_EXTERNAL_RENDERING, modplay.c always has it
+ModPlayerStatus_t *RenderMOD(ModPlayerStatus_t *mp, volatile uint8_t *buf, int len);
+
+#ifndef USE_MONO_OUTPUT
+#define USE_MONO_OUTPUT 0
+#endif
+
+#if !USE_MONO_OUTPUT
+#error "modsnr measures the PWM output, build it with USE_MONO_OUTPUT=1"
+#endif
+
+#ifndef OSR
+#define OSR 8
+#endif
+
+#ifndef USE_STEREO_PWM
+#define USE_STEREO_PWM 0
+#endif
+
+#ifndef USE_DSM_INTERPOLATION
+#define USE_DSM_INTERPOLATION 0
+#endif
+
+#define SIDES            (USE_STEREO_PWM ? 2 : 1)
+
+// Duty values summed into one sample of the comparison, which then runs
+// at samplerate * OSR / DECIMATE (44.1 kHz for a PWM rate of 176.4 kHz)
+#define DECIMATE         ((OSR % 4 == 0) ? 4 : (OSR % 2 == 0) ? 2 : 1)
+
+#define BLOCK            256           // Samples per render call
+#define TAPS_HALF        127           // Low-pass of 2 * TAPS_HALF + 1 taps
+#define MAX_LAG          64            // Delay searched, in comparison samples
+
+static uint32_t g_samplerate = 22050;
+static uint32_t g_maxseconds = 30;
+
+/*
+ * Windowed-sinc low-pass at `cutoff` (fraction of the sample rate),
+ * centered on `delay` samples
+ */
+static void lowpass(float *h, double cutoff, double delay)
+{
+	for (int k = -TAPS_HALF; k <= TAPS_HALF; k++) {
+		double t = k - delay;
+		double s = (t == 0) ? 2 * cutoff : sin(2 * M_PI * cutoff * t) / (M_PI * t);
+		double w = (fabs(t) > TAPS_HALF) ? 0 : 0.42 + 0.5 * cos(M_PI * t / TAPS_HALF) + 0.08 * cos(2 * M_PI * t / TAPS_HALF);
+
+		h[k + TAPS_HALF] = s * w;
+	}
+}
+
+static void filter(const float *in, float *out, uint32_t len, const float *h)
+{
+	for (uint32_t j = 0; j < len; j++) {
+		// Taps that fall inside the signal
+		int64_t lo = (int64_t) j - TAPS_HALF, hi = (int64_t) j + TAPS_HALF;
+		float acc = 0;
+
+		if (lo < 0) lo = 0;
+		if (hi > len - 1) hi = len - 1;
+
+		for (int64_t i = lo; i <= hi; i++) acc += h[j - i + TAPS_HALF] * in[i];
+
+		out[j] = acc;
+	}
+}
+
+static void remove_dc(float *x, uint32_t len)
+{
+	double sum = 0;
+
+	for (uint32_t j = 0; j < len; j++) sum += x[j];
+	for (uint32_t j = 0; j < len; j++) x[j] -= sum / len;
+}
+
+static double correlate(const float *x, const float *y, uint32_t len, int lag)
+{
+	// Sum of x[j] * y[j + lag] over the part where both exist
+	double acc = 0;
+
+	for (uint32_t j = (lag < 0) ? -lag : 0; j < len && j + lag < len; j++) acc += x[j] * y[j + lag];
+
+	return acc;
+}
+
+/*
+ * Finds the delay of `y` against `x` in samples, with a fraction
+ */
+static double find_delay(const float *x, const float *y, uint32_t len)
+{
+	double best = -1e300, c[2 * MAX_LAG + 1];
+	int lag = 0;
+
+	for (int l = -MAX_LAG; l <= MAX_LAG; l++) {
+		c[l + MAX_LAG] = correlate(x, y, len, l);
+
+		if (c[l + MAX_LAG] > best) {
+			best = c[l + MAX_LAG];
+			lag = l;
+		}
+	}
+
+	if (lag == -MAX_LAG || lag == MAX_LAG) return lag;
+
+	// Parabola through the peak and its neighbours
+	double a = c[lag + MAX_LAG - 1], b = c[lag + MAX_LAG], d = c[lag + MAX_LAG + 1];
+	double den = a - 2 * b + d;
+
+	return lag + (den < 0 ? 0.5 * (a - d) / den : 0);
+}
+
+/*
+ * Signal and noise energy of `y` against `x` in the band up to `cutoff`
+ * (fraction of the sample rate), after delaying and scaling `x`
+ */
+static void measure(const float *x, const float *y, uint32_t len, double cutoff, double delay,
+                    float *tmpx, float *tmpy, double *signal, double *noise)
+{
+	static float h[2 * TAPS_HALF + 1];
+	int lag = (int) floor(delay);
+
+	lowpass(h, cutoff, 0);
+	filter(y, tmpy, len, h);
+
+	// The fraction of the delay goes into the filter of the reference
+	lowpass(h, cutoff, delay - lag);
+	filter(x, tmpx, len, h);
+
+	double xx = 0, xy = 0;
+	uint32_t start = TAPS_HALF + MAX_LAG, end = len - TAPS_HALF - MAX_LAG;
+
+	for (uint32_t j = start; j < end; j++) {
+		xx += (double) tmpx[j - lag] * tmpx[j - lag];
+		xy += (double) tmpx[j - lag] * tmpy[j];
+	}
+
+	double g = xx > 0 ? xy / xx : 0;
+
+	for (uint32_t j = start; j < end; j++) {
+		double e = tmpy[j] - g * tmpx[j - lag];
+
+		*noise += e * e;
+	}
+
+	*signal += g * g * xx;
+}
+
+static int32_t ideal_sample(const PaulaChannel_t *pch, uint32_t sub)
+{
+	// Sample byte at `sub` (16.16) past the read position, continuing into
+	// the loop or silence past the end
+	uint32_t j = pch->currentptr + (sub >> 16);
+
+	if (j >= pch->length) {
+		if (!pch->looplength) return 0;
+
+		j = pch->length - pch->looplength + (j - pch->length) % pch->looplength;
+	}
+
+	return pch->sample[j] * pch->volume;
+}
+
+static int snr_song(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+
+	if (!f) {
+		fprintf(stderr, "%s: not found\n", path);
+		return 0;
+	}
+
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	uint8_t *mod = malloc(size > 0 ? size : 1);
+	int ok = size >= 1084 && fread(mod, 1, size, f) == (size_t) size;
+	fclose(f);
+
+	static ModPlayerStatus_t mp, ref;
+
+	if (!ok || !InitMOD(&mp, mod, size, g_samplerate) || !InitMOD(&ref, mod, size, g_samplerate)) {
+		fprintf(stderr, "%s: not a 4-channel MOD\n", path);
+		free(mod);
+		return 0;
+	}
+
+	uint32_t samples = LengthMOD(&mp, mod, size, g_samplerate);
+
+	if (samples > g_maxseconds * g_samplerate) samples = g_maxseconds * g_samplerate;
+	samples -= samples % BLOCK;
+
+	uint32_t len = samples * (OSR / DECIMATE);
+
+	if (len < 4 * (TAPS_HALF + MAX_LAG)) {
+		fprintf(stderr, "%s: too short\n", path);
+		free(mod);
+		return 0;
+	}
+
+	InitMOD(&mp, mod, size, g_samplerate);
+
+	float *x[SIDES], *y[SIDES], *tmpx = malloc(len * sizeof(float)), *tmpy = malloc(len * sizeof(float));
+
+	for (int c = 0; c < SIDES; c++) {
+		x[c] = calloc(len, sizeof(float));
+		y[c] = calloc(len, sizeof(float));
+	}
+
+	// PWM output, the duty values of each side summed in groups of DECIMATE
+	static uint8_t pwm[BLOCK * OSR * SIDES];
+
+	for (uint32_t s = 0; s < samples; s += BLOCK) {
+		RenderMOD(&mp, pwm, BLOCK);
+
+		for (int i = 0; i < BLOCK * OSR; i++) {
+			for (int c = 0; c < SIDES; c++)
+				y[c][(s * OSR + i) / DECIMATE] += pwm[i * SIDES + c];
+		}
+	}
+
+	// Ideal Paula at every duty value, mono as the sum of all channels
+	for (uint32_t s = 0; s < samples; ) {
+		int n = AdvanceMOD(&ref, samples - s);
+
+		for (; n > 0; n--, s++) {
+			for (int ch = 0; ch < 4; ch++) {
+				PaulaChannel_t *pch = &ref.paula[ch];
+
+				if (!pch->sample || !WrapChannelMOD(pch)) continue;
+
+				for (int i = 0; !pch->muted && i < OSR; i++) {
+					float v = ideal_sample(pch, pch->currentsubptr + pch->period * i / OSR);
+					uint32_t j = (s * OSR + i) / DECIMATE;
+
+					if (SIDES == 2) {
+						// Panned like RenderMOD, 1/3 to the other side
+						int major = (ch & 3) == 1 || (ch & 3) == 2;
+
+						x[major][j] += v;
+						x[!major][j] += v / 3;
+					} else {
+						x[0][j] += v;
+					}
+				}
+
+				StepChannelMOD(pch);
+			}
+		}
+	}
+
+	double rate = (double) g_samplerate * OSR / DECIMATE;
+	double signal5 = 0, noise5 = 0, signal10 = 0, noise10 = 0, delay = 0;
+
+	for (int c = 0; c < SIDES; c++) {
+		static float h[2 * TAPS_HALF + 1];
+
+		remove_dc(x[c], len);
+		remove_dc(y[c], len);
+
+		// Delay of the PWM output, found in the 5 kHz band
+		lowpass(h, 5000 / rate, 0);
+		filter(x[c], tmpx, len, h);
+		filter(y[c], tmpy, len, h);
+		delay = find_delay(tmpx, tmpy, len);
+
+		measure(x[c], y[c], len, 5000 / rate, delay, tmpx, tmpy, &signal5, &noise5);
+		measure(x[c], y[c], len, 10000 / rate, delay, tmpx, tmpy, &signal10, &noise10);
+	}
+
+	printf("%7.1f %7.1f %7.1f  %s\n", 10 * log10(signal5 / noise5), 10 * log10(signal10 / noise10),
+	       1e6 * delay / rate, path);
+
+	for (int c = 0; c < SIDES; c++) {
+		free(x[c]);
+		free(y[c]);
+	}
+
+	free(tmpx);
+	free(tmpy);
+	free(mod);
+
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	int opt, failed = 0;
+
+	while ((opt = getopt(argc, argv, "r:t:")) != -1) {
+		switch (opt) {
+			case 'r': g_samplerate = atoi(optarg); break;
+			case 't': g_maxseconds = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [-r samplerate] [-t max_seconds] file...\n", argv[0]);
+				return 2;
+		}
+	}
+
+	if (optind >= argc || g_samplerate < 1000 || g_maxseconds < 1) {
+		fprintf(stderr, "usage: %s [-r samplerate] [-t max_seconds] file...\n", argv[0]);
+		return 2;
+	}
+
+	printf("%u Hz mix, OSR %d, PWM %u Hz, %s%s\n", g_samplerate, OSR, g_samplerate * OSR,
+	       USE_DSM_INTERPOLATION ? "ramp" : "hold", USE_STEREO_PWM ? ", stereo" : "");
+	printf("snr_5k snr_10k delay_us  file\n");
+
+	for (int i = optind; i < argc; i++) failed += !snr_song(argv[i]);
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,193 @@
+/*
+ * Streaming playback from a simulated serial flash
+ *
+ * Plays songs with the player built with USE_STORAGE, as on a device that
+ * keeps its songs in SPI flash: the player reads the song through a
+ * ModStorage_t that is backed by the file. Every read is charged the time
+ * the same read takes on a serial flash (command and 24-bit address, then
+ * the data, at the SPI clock, plus a fixed setup time per read).
+ *
+ * The song is rendered with RenderMOD in blocks of `block` samples. The
+ * read time that falls into a block stalls its render IRQ: the report
+ * lists the worst stall of a song in microseconds and as a percentage of
+ * the block's playback time, the deadline of the DMA. It also lists the
+ * hit rate of the block cache for headers and patterns and the stream
+ * window fills per second. The hash covers the rendered output like the
+ * one of modrender, and must match modrender built without USE_STORAGE.
+ *
+ * Usage: modstream [-r samplerate] [-b block] [-c spi_mhz] [-j threads] file...
+ *
+ *   -r   output sample rate (default 22050, as in main.c)
+ *   -b   samples rendered per IRQ (default 64, half of BUF_SAMPLES in main.c)
+ *   -c   SPI clock in MHz (default 24, the fastest SPI clock of the CH32V00x at 48 MHz)
+ *   -j   accepted for the command line of modrender, songs are played one by one
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "modplay.h"
+
+#if !USE_STORAGE
+#error "modstream needs a player built with USE_STORAGE=1"
+#endif
+
+#ifndef USE_MONO_OUTPUT
+#define USE_MONO_OUTPUT 0
+#endif
+
+#ifndef OSR
+#define OSR 8
+#endif
+
+#define MAX_BLOCK        1024
+#define SPI_CMD_BYTES    4             // Read command (03h) and 24-bit address
+#define SPI_SETUP_US     1.0           // Chip select and the call of the read function
+
+typedef struct {
+	int fd;
+	off_t size;
+	uint32_t reads;
+	uint64_t bytes;
+	double busy;                       // Simulated time spent reading, in us
+} FileStorage_t;
+
+static uint32_t g_samplerate = 22050;
+static int g_block = 64;
+static double g_spimhz = 24;
+
+static int file_read(const ModStorage_t *st, uint32_t offset, void *buf, uint32_t len)
+{
+	FileStorage_t *fs = st->user;
+	ssize_t got = 0;
+
+	// Blocks are read whole, past the end of the song reads as zeros
+	if (offset < fs->size) got = pread(fs->fd, buf, len, offset);
+	if (got < 0) return 0;
+	if ((uint32_t) got < len) memset((uint8_t *) buf + got, 0, len - got);
+
+	fs->reads++;
+	fs->bytes += len;
+	fs->busy += SPI_SETUP_US + (SPI_CMD_BYTES + len) * 8 / g_spimhz;
+
+	return 1;
+}
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len)
+{
+	// Same hash as modrender
+	const uint8_t *p = data;
+
+	for (size_t i = 0; i < len; i++) hash = (hash ^ p[i]) * 1099511628211ULL;
+
+	return hash;
+}
+
+static int stream_song(const char *path, double *worst, const char **worstpath)
+{
+	FileStorage_t fs = {0};
+	ModStorage_t st = { file_read, &fs };
+	struct stat sb;
+
+	fs.fd = open(path, O_RDONLY);
+
+	if (fs.fd < 0 || fstat(fs.fd, &sb) != 0 || sb.st_size < 1084) {
+		printf("%-16s %8s %6s %8s %8s %9s %6s  %s\n", "FAILED", "-", "-", "-", "-", "-", "-", path);
+		if (fs.fd >= 0) close(fs.fd);
+		return 0;
+	}
+
+	fs.size = sb.st_size;
+
+	static ModPlayerStatus_t mp;
+#if USE_MONO_OUTPUT
+	static uint8_t buf[MAX_BLOCK * OSR];
+#else
+	static int16_t buf[MAX_BLOCK * 2];
+#endif
+
+	uint32_t length = LengthMOD(&mp, &st, fs.size, g_samplerate);
+
+	if (!length || !InitMOD(&mp, &st, fs.size, g_samplerate)) {
+		printf("%-16s %8s %6s %8s %8s %9s %6s  %s\n", "FAILED", "-", "-", "-", "-", "-", "-", path);
+		close(fs.fd);
+		return 0;
+	}
+
+	// Only count what playing costs, not loading
+	uint64_t hash = 14695981039346656037ULL;
+	uint32_t hits = mp.blockhits, misses = mp.blockmisses, fills = mp.windowfills;
+	uint64_t bytes = fs.bytes;
+	double stall = 0, total = 0;
+
+	for (uint32_t pos = 0; pos < length; ) {
+		int n = (length - pos < (uint32_t) g_block) ? length - pos : g_block;
+		double busy = fs.busy;
+
+		RenderMOD(&mp, (uint8_t *) buf, n);
+		hash = fnv1a(hash, buf, n * (USE_MONO_OUTPUT ? OSR : 2) * sizeof(buf[0]));
+
+		if (fs.busy - busy > stall) stall = fs.busy - busy;
+		total += fs.busy - busy;
+		pos += n;
+	}
+
+	double secs = (double) length / g_samplerate;
+	double deadline = 1e6 * g_block / g_samplerate;
+	uint32_t lookups = (mp.blockhits - hits) + (mp.blockmisses - misses);
+
+	printf("%016llx %8.1f %6.1f %8.0f %8.1f %9.2f %6.2f  %s\n", (unsigned long long) hash, secs,
+	       lookups ? 100.0 * (mp.blockhits - hits) / lookups : 100.0, (mp.windowfills - fills) / secs,
+	       (fs.bytes - bytes) / secs / 1024, stall, 100 * stall / deadline, path);
+
+	if (mp.readerrors) fprintf(stderr, "%s: %u failed reads\n", path, mp.readerrors);
+
+	if (stall > *worst) {
+		*worst = stall;
+		*worstpath = path;
+	}
+
+	close(fs.fd);
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	int opt, failed = 0;
+
+	while ((opt = getopt(argc, argv, "r:b:c:j:")) != -1) {
+		switch (opt) {
+			case 'r': g_samplerate = atoi(optarg); break;
+			case 'b': g_block = atoi(optarg); break;
+			case 'c': g_spimhz = atof(optarg); break;
+			case 'j': break;
+			default:
+				fprintf(stderr, "usage: %s [-r samplerate] [-b block] [-c spi_mhz] [-j threads] file...\n", argv[0]);
+				return 2;
+		}
+	}
+
+	if (optind >= argc || g_block < 1 || g_block > MAX_BLOCK || g_samplerate < 1000 || g_spimhz <= 0) {
+		fprintf(stderr, "usage: %s [-r samplerate] [-b block] [-c spi_mhz] [-j threads] file...\n", argv[0]);
+		return 2;
+	}
+
+	printf("%-16s %8s %6s %8s %8s %9s %6s  file\n", "hash", "audio_s", "hit%", "fills/s", "kB/s", "stall_us", "peak%");
+
+	double worst = 0;
+	const char *worstpath = NULL;
+
+	for (int i = optind; i < argc; i++) failed += !stream_song(argv[i], &worst, &worstpath);
+
+	if (worstpath) {
+		printf("worst stall of a %d-sample block: %.2f us at %.0f MHz SPI, %.2f%% of its %.0f us playback time (%s)\n",
+		       g_block, worst, g_spimhz, worst * g_samplerate / g_block / 1e4, 1e6 * g_block / g_samplerate, worstpath);
+	}
+
+	return failed ? 1 : 0;
+}